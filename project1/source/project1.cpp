@@ -1,14 +1,50 @@
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <limits>
+#include <type_traits>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 // README
 /*
-There are five sections to the project:
+There are sixteen sections to the project:
 1. Class Definitions
 2. SparseRow Implementation
-3. SparseMatrix Implementation
-4. Provided main() for testing
-5. Assertion/Unit Testing(commented out by default)
+3. EntryBuffer and WorkerPool Implementation (threading helpers)
+4. SparseStorage Implementation (arrays shared by a matrix and its transposes)
+5. SparseMatrix Implementation
+6. SparseMatrixBuilder Implementation
+7. BlockSparseMatrix Implementation (block compressed rows)
+8. TriangleSparseMatrix Implementation (symmetric and triangular matrices stored by one triangle)
+9. PackedSparseMatrix Implementation (delta encoded, bit-packed column indices)
+10. SparseSolver Implementation (preconditioned CG and BiCGSTAB)
+11. SparseGraph Implementation (BFS and PageRank over adjacency matrices)
+12. HybridSparseMatrix Implementation (row blocks stored sparsely or densely by density)
+13. SparseExpr Implementation (lazy, fused matrix expressions)
+14. MatrixReader Implementation (fast input parsing, parallel Matrix Market reading)
+15. Provided main() for testing (and the named checks that may follow the two input matrices)
+16. Assertion/Unit Testing(commented out by default)
 
 The above sections are easy to see due to the over the top ////////s
 to divide up the project.
@@ -22,42 +58,780 @@ trying to improve at.
 //                   Class Definitions
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/// @brief Compile-time properties of the value types a matrix can hold.
+///
+/// Accumulator is the type sums of products are built up in: integer products are summed in 64 bits
+/// and float ones in double, so intermediate sums do not overflow or lose precision before the final
+/// value is stored. CODE identifies the type in the binary file format. Value types without a
+/// specialization are rejected at compile time.
+template <typename T> struct ValueTraits;
+template <> struct ValueTraits<int> { typedef long long Accumulator; static const int CODE = 1; };
+template <> struct ValueTraits<long long> { typedef long long Accumulator; static const int CODE = 2; };
+template <> struct ValueTraits<float> { typedef double Accumulator; static const int CODE = 3; };
+template <> struct ValueTraits<double> { typedef double Accumulator; static const int CODE = 4; };
+
+/// @brief Narrowest index type able to count up to MaxIndex: 32 bit whenever the dimensions and the
+/// number of entries allow it, which halves the index bandwidth of every kernel, and 64 bit otherwise.
+template <long long MaxIndex> struct IndexFor {
+  typedef typename conditional<(MaxIndex <= 0x7fffffffLL), int, long long>::type type; ///< The index type
+};
+
 /// @brief A container datastructure to be used within SparseMatrix objects.
-class SparseRow {
+/// @tparam T The value type.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicSparseRow {
  protected:
-  int row; ///<  Row number
-  int col; ///< Column number
-  int value; ///< Value at the specified row and column
+  I row; ///<  Row number
+  I col; ///< Column number
+  T value; ///< Value at the specified row and column
  public:
-  SparseRow(); ///< Default constructor; initializes row=-1, col=-1, value=0
-  SparseRow(int row, int col, int value); ///< Parameterized constructor
+  BasicSparseRow(); ///< Default constructor; initializes row=-1, col=-1, value=0
+  BasicSparseRow(I row, I col, T value); ///< Parameterized constructor
   void display() const; ///< Print Row#, Column#, value
-  friend ostream& operator<<(ostream& s, const SparseRow& sr); ///< Overload << operator for printing
-  int getRow() const;
-  int getCol() const;
-  int getVal() const;
-  void setVal(int val);
+  template <typename U, typename J>
+  friend ostream& operator<<(ostream& s, const BasicSparseRow<U, J>& sr); ///< Overload << operator for printing
+  I getRow() const;
+  I getCol() const;
+  T getVal() const;
+  void setVal(T val);
+};
+typedef BasicSparseRow<int, int> SparseRow; ///< The int instantiation used by the project
+
+/// @brief Growable index/value arrays, used as per-thread scratch space by the parallel kernels.
+template <typename T, typename I>
+struct EntryBuffer {
+  I size; ///< Number of entries pushed
+  I capacity; ///< Number of entries the arrays can hold before they have to grow
+  I* indices; ///< Column index of every entry
+  T* values; ///< Value of every entry
+  EntryBuffer(); ///< Empty buffer
+  EntryBuffer(const EntryBuffer&) = delete;
+  EntryBuffer& operator=(const EntryBuffer&) = delete;
+  ~EntryBuffer(); ///< Destructor
+  void push(I index, T value); ///< Append one entry
 };
 
-/// @brief A matrix data structure that contains SparseRow objects.
-class SparseMatrix {
+/// @brief Sparse accumulator that sums the contributions to one output row at a time.
+///
+/// Holds a running sum per column, the row that last touched each column, and the list of columns the
+/// current row touched, so starting a new row costs nothing and only touched columns are emitted.
+/// Sums are kept in the accumulator type of T and narrowed to T when the row is flushed.
+template <typename T, typename I>
+struct RowAccumulator {
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type of the running sums
+  Sum* sums; ///< Running sum of every touched column
+  I* touchedBy; ///< Row that last touched every column
+  I* touched; ///< Columns touched by the current row, in touch order
+  I noTouched; ///< Length of touched
+  I row; ///< The current row
+  RowAccumulator(I noCols); ///< Accumulator for rows of noCols columns
+  RowAccumulator(const RowAccumulator&) = delete;
+  RowAccumulator& operator=(const RowAccumulator&) = delete;
+  ~RowAccumulator(); ///< Destructor
+  void start(I row); ///< Begin a new row, every row must have a distinct number
+  void add(I col, Sum value); ///< Add value to column col of the current row
+  I flush(EntryBuffer<T, I>& out, T background); ///< Append the row in column order, return its length
+};
+
+/// @brief Reductions over a contiguous array of values, the values array of a matrix or a slice of it.
+///
+/// The scalar versions keep four independent partial results so the compiler can vectorize them; the
+/// int and double versions have AVX2 specializations.
+template <typename T>
+struct ValueKernel {
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type of the running sums
+  static Sum sum(const T* values, size_t length); ///< Sum of the values, in the accumulator type
+  static T max(const T* values, size_t length, T start); ///< Largest of start and the values
+  static size_t countAbove(const T* values, size_t length, T threshold); ///< Number of values above threshold
+  static Sum sumAbs(const T* values, size_t length); ///< Sum of the absolute values, in the accumulator type
+  static double sumSquares(const T* values, size_t length); ///< Sum of the squares, in double
+  static void affine(const T* values, size_t length, T alpha, T beta, T* out); ///< out = alpha*values + beta
+  static void axpy(Sum alpha, const T* values, size_t length, Sum* out); ///< out += alpha*values, in the accumulator type
+};
+
+/// @brief A fixed set of worker threads that run numbered tasks for the parallel matrix kernels.
+///
+/// run() hands tasks 0..noTasks-1 out to the workers and the calling thread and returns once all of
+/// them are done. Tasks must not call run() on the same pool.
+class WorkerPool {
  protected:
-  int noRows; ///< Number of rows of the original matrix
-  int noCols; ///< Number of columns of the original matrix
-  int commonValue; ///< Common value read from input
-  int noNonSparseValues; ///< Number of non-sparse values
-  SparseRow* myMatrix; ///< Array of SparseRow objects
+  int noWorkers; ///< Number of threads owned by the pool
+  thread* myWorkers; ///< The worker threads
+  mutex lock; ///< Guards everything below
+  condition_variable wake; ///< Signalled when a new generation of tasks is posted
+  condition_variable finished; ///< Signalled when a worker is done with the current generation
+  const function<void(int)>* myTask; ///< Task of the current generation
+  int noTasks; ///< Number of tasks in the current generation
+  atomic<int> nextTask; ///< Next task number to hand out
+  int generation; ///< Incremented for every run()
+  int noFinishedWorkers; ///< Workers done with the current generation
+  bool stopping; ///< Set by the destructor
+  exception_ptr failure; ///< First exception thrown by a task
+  mutex runLock; ///< Serializes run() calls coming from different threads
+  void workerLoop(); ///< Body of every worker thread
+  void drain(); ///< Run tasks of the current generation until none are left
  public:
-  SparseMatrix(); ///< Default constructor
-  SparseMatrix(int n, int m, int cv, int nsv); ///< Parameterized constructor
-  ~SparseMatrix(); ///< Destructor
-  SparseMatrix* Transpose() const; ///< Matrix Transpose
-  SparseMatrix* Multiply(const SparseMatrix &M) const; ///< Matrix Multiplication
-  SparseMatrix* Add(const SparseMatrix &M) const; ///< Matrix Addition
-  friend ostream& operator<<(ostream& s, const SparseMatrix& sm); ///< Overload << operator for printing
+  WorkerPool(int noWorkers); ///< Start noWorkers threads
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  ~WorkerPool(); ///< Stop and join the workers
+  void run(int noTasks, const function<void(int)>& task); ///< Run tasks 0..noTasks-1 and wait for them
+  int size() const; ///< Number of threads that run tasks, the caller included
+  static WorkerPool& shared(); ///< Process-wide pool with one thread per hardware thread
+};
+
+/// @brief Fixed 128 byte header of the binary matrix file written by SparseMatrix::save().
+struct SparseFileHeader {
+  char magic[8]; ///< MAGIC
+  int version; ///< VERSION, bumped whenever the layout changes
+  int flags; ///< ROW_MAJOR when the arrays are compressed by rows
+  short valueType; ///< ValueTraits<T>::CODE of the stored values
+  short indexSize; ///< Size in bytes of the stored offsets and indices
+  int reserved; ///< Zero
+  long long noRows; ///< Number of rows
+  long long noCols; ///< Number of columns
+  long long nnz; ///< Number of entries
+  long long offsetsAt; ///< File position of the offsets array
+  long long indicesAt; ///< File position of the indices array, 64 byte aligned
+  long long valuesAt; ///< File position of the values array, 64 byte aligned
+  char commonValue[8]; ///< Common value, in its first sizeof(T) bytes
+  char padding[48]; ///< Zero
+  static const char MAGIC[8];
+  static const int VERSION = 2;
+  static const int ROW_MAJOR = 1;
+};
+const char SparseFileHeader::MAGIC[8] = {'S', 'P', 'M', 'A', 'T', 'R', 'X', '\0'};
+
+/// @brief Owner of the compressed arrays shared by a matrix and its transposed views.
+///
+/// The arrays are either on the heap or inside a read-only file mapping. They are released when the
+/// last SparseMatrix referring to them goes away.
+template <typename T, typename I>
+struct SparseStorage {
+  atomic<int> refs; ///< Number of SparseMatrix objects using the arrays
+  I* offsets; ///< Heap offsets array, or nullptr when mapped
+  I* indices; ///< Heap indices array, or nullptr when mapped
+  T* values; ///< Heap values array, or nullptr when mapped
+  void* mapping; ///< File mapping holding the arrays, or nullptr when they are on the heap
+  size_t mappingLength; ///< Length of mapping in bytes
+  SparseStorage(I* offsets, I* indices, T* values); ///< Own heap arrays
+  SparseStorage(void* mapping, size_t mappingLength); ///< Own a file mapping
+  SparseStorage(const SparseStorage&) = delete;
+  SparseStorage& operator=(const SparseStorage&) = delete;
+  ~SparseStorage(); ///< Delete or unmap the arrays
+};
+
+template <typename T, typename I> class BasicSparseExpr;
+template <typename T, typename I> class BasicBlockSparseMatrix;
+template <typename T, typename I> class BasicTriangleSparseMatrix;
+template <typename T, typename I> class BasicPackedSparseMatrix;
+template <typename T, typename I> class BasicSparseSolver;
+template <typename T, typename I> class BasicSparseGraph;
+template <typename T, typename I> class BasicHybridSparseMatrix;
+template <typename T, typename I> class BasicSparseVectorPlan;
+
+/// @brief A matrix data structure that stores its non-sparse values in compressed sparse row (CSR) form.
+///
+/// Entries are grouped by row in myOffsets/myIndices/myValues with the column indices sorted inside
+/// each row, so a point lookup is a binary search over a single row. A transposed matrix keeps the
+/// same arrays and is compressed by columns instead (CSC), which is what rowMajor records.
+///
+/// The value type T is int, long long, float or double (see ValueTraits). The index type I, int or
+/// long long, holds the dimensions, the offsets and the indices, so it has to count up to the number
+/// of entries as well as the rows and columns; IndexFor picks the narrower one when it can.
+/// SparseMatrix is the int, int instantiation.
+/// @tparam T The value type.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicSparseMatrix {
+  static_assert(is_integral<I>::value && is_signed<I>::value, "The index type must be a signed integer");
+ public:
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type sums of products are accumulated in
+ protected:
+  I noRows; ///< Number of rows of the original matrix
+  I noCols; ///< Number of columns of the original matrix
+  T commonValue; ///< Common value read from input
+  I noNonSparseValues; ///< Number of non-sparse values
+  I capacity; ///< Number of entries myIndices/myValues can hold before they have to grow
+  bool rowMajor; ///< True when compressed by rows (CSR), false when compressed by columns (CSC)
+  I* myOffsets; ///< Start of every row (or column) inside myIndices/myValues, majorCount()+1 long
+  I* myIndices; ///< Column (or row) index of every entry, sorted within a row (or column)
+  T* myValues; ///< Value of every entry
+  SparseStorage<T, I>* myStorage; ///< Owner of the arrays, shared with transposed views
+  I majorCount() const; ///< Number of rows when row major, columns otherwise
+  I find(I row, I col) const; ///< Position of (row, col) in myIndices/myValues, or -1
+  void reserve(I newCapacity); ///< Grow myIndices/myValues to hold at least newCapacity entries
+  static void balanceRows(const long long* costPrefix, I noRows, int noParts, I* bounds); ///< Split rows by cost
+  static void runParts(int noParts, const function<void(int)>& part); ///< Run parts inline or on the shared pool
+  static BasicSparseMatrix* assembleParts(I n, I m, T cv, int noParts, const I* bounds,
+                                          const EntryBuffer<T, I>* parts, I* offsets); ///< Join per-part rows into CSR
+  static BasicSparseMatrix* buildRows(I n, I m, T cv, const long long* costPrefix, int noThreads,
+                                      const function<void(I, RowAccumulator<T, I>&)>& row); ///< Row-parallel driver
+  static Sum dotRow(const I* indices, const T* values, I length, const T* x, T shift); ///< SIMD row kernel
+  static Sum dotSorted(const I* indicesA, const T* valuesA, I lengthA, const I* indicesB, const T* valuesB,
+                       I lengthB); ///< Dot product of two sorted sparse vectors
+  void balanceEntries(int noParts, I* bounds) const; ///< Split the rows into ranges of equal entries
+  void multiplyRows(const T* x, T* y, int noParts, const I* bounds) const; ///< CSR y = A*x over a given row split
+  template <typename Combine>
+  BasicSparseMatrix* mergeWith(const BasicSparseMatrix& M, T background, const Combine& combine,
+                               int noThreads) const; ///< Cell-wise combine(this, M) over both patterns
+  BasicSparseMatrix* affine(T alpha, T beta, int noThreads) const; ///< Cell-wise alpha*A + beta
+  void lineSums(Sum* sums, bool byRows, bool absolute, int noThreads) const; ///< Row or column (absolute) sums
+  static bool writeAll(int fd, const void* data, long long length); ///< write() until done
+  static bool writeAt(int fd, const void* data, long long length, long long at); ///< pwrite() until done
+  static bool readAt(int fd, void* data, long long length, long long at); ///< pread() until done
+  static SparseFileHeader makeHeader(I n, I m, T cv, long long nnz, bool rowMajor); ///< Header and array layout
+  static bool validHeader(const SparseFileHeader& header, long long length); ///< Header fits the type and file
+  static char* formatValue(long long value, char* out); ///< Integer as decimal text, returns its end
+  static char* formatValue(double value, char* out); ///< Floating point text as cout prints it, returns its end
+  void detach(); ///< Give this matrix private heap arrays before modifying them
+  BasicSparseMatrix(const BasicSparseMatrix& source, bool transposed); ///< View sharing the arrays of source
+ public:
+  BasicSparseMatrix(); ///< Default constructor
+  BasicSparseMatrix(I n, I m, T cv, I nsv); ///< Parameterized constructor
+  BasicSparseMatrix(I n, I m, T cv, I nnz, I* offsets, I* indices, T* values, bool rowMajor = true); ///< Adopt arrays
+  explicit BasicSparseMatrix(const char* path); ///< Open a file written by save() without copying it
+  BasicSparseMatrix(const BasicSparseMatrix&) = delete; ///< Matrices are passed around by pointer
+  BasicSparseMatrix& operator=(const BasicSparseMatrix&) = delete;
+  ~BasicSparseMatrix(); ///< Destructor
+  BasicSparseMatrix* Transpose() const; ///< Matrix Transpose, a view sharing this matrix's arrays
+  BasicSparseMatrix* Recompress(bool byRows) const; ///< Same matrix compressed by rows (CSR) or columns (CSC)
+  template <typename U, typename J>
+  BasicSparseMatrix<U, J>* Convert() const; ///< Same matrix with other value and index types
+  BasicSparseMatrix* Multiply(const BasicSparseMatrix &M) const; ///< Matrix Multiplication
+  BasicSparseMatrix* Add(const BasicSparseMatrix &M) const; ///< Matrix Addition
+  BasicSparseMatrix* Multiply(const BasicSparseMatrix &M, int noThreads) const; ///< Row-parallel Matrix Multiplication
+  BasicSparseMatrix* MaskedMultiply(const BasicSparseMatrix &M, const BasicSparseMatrix &mask) const; ///< mask .* (this*M)
+  BasicSparseMatrix* MaskedMultiply(const BasicSparseMatrix &M, const BasicSparseMatrix &mask,
+                                    int noThreads) const; ///< Row-parallel MaskedMultiply
+  BasicSparseMatrix* Add(const BasicSparseMatrix &M, int noThreads) const; ///< Row-parallel Matrix Addition
+  BasicSparseMatrix* Axpby(T alpha, const BasicSparseMatrix &M, T beta) const; ///< alpha*this + beta*M
+  BasicSparseMatrix* Axpby(T alpha, const BasicSparseMatrix &M, T beta, int noThreads) const; ///< Row-parallel Axpby
+  BasicSparseMatrix* Hadamard(const BasicSparseMatrix &M) const; ///< Element-wise product
+  BasicSparseMatrix* Hadamard(const BasicSparseMatrix &M, int noThreads) const; ///< Row-parallel Hadamard
+  BasicSparseMatrix* Scale(T alpha) const; ///< alpha times every cell
+  BasicSparseMatrix* Scale(T alpha, int noThreads) const; ///< Parallel Scale
+  BasicSparseMatrix* Shift(T beta) const; ///< beta added to every cell
+  BasicSparseMatrix* Shift(T beta, int noThreads) const; ///< Parallel Shift
+  void MultiplyVector(const T* x, T* y) const; ///< Matrix times dense vector, y = A*x
+  void MultiplyVector(const T* x, T* y, int noThreads) const; ///< Row-parallel y = A*x
+  void RowSums(Sum* sums) const; ///< Sum of every row, common values included
+  void RowSums(Sum* sums, int noThreads) const; ///< Row-parallel RowSums
+  void ColSums(Sum* sums) const; ///< Sum of every column, common values included
+  void ColSums(Sum* sums, int noThreads) const; ///< Parallel ColSums
+  double FrobeniusNorm() const; ///< Square root of the sum of squares of every cell
+  double FrobeniusNorm(int noThreads) const; ///< Parallel FrobeniusNorm
+  Sum OneNorm() const; ///< Largest column sum of absolute values
+  Sum OneNorm(int noThreads) const; ///< Parallel OneNorm
+  Sum InfinityNorm() const; ///< Largest row sum of absolute values
+  Sum InfinityNorm(int noThreads) const; ///< Parallel InfinityNorm
+  BasicSparseMatrix* TopK(I k) const; ///< The k largest stored entries of every row
+  BasicSparseMatrix* TopK(I k, int noThreads) const; ///< Row-parallel TopK
+  T MaxValue() const; ///< Largest value of the matrix, common values included
+  T MaxValue(int noThreads) const; ///< Parallel MaxValue
+  long long CountAbove(T threshold) const; ///< Number of cells holding more than threshold
+  long long CountAbove(T threshold, int noThreads) const; ///< Parallel CountAbove
+  void ReverseCuthillMcKee(I* perm) const; ///< Bandwidth-reducing ordering, perm[new] = old
+  BasicSparseMatrix* Permute(const I* perm) const; ///< Symmetric permutation P*A*P^T
+  BasicSparseMatrix* Permute(const I* perm, int noThreads) const; ///< Row-parallel Permute
+  static void PermuteVector(const I* perm, I n, const T* x, T* y); ///< y[new] = x[perm[new]]
+  static void UnpermuteVector(const I* perm, I n, const T* x, T* y); ///< y[perm[new]] = x[new]
+  I getBandwidth() const; ///< Largest |row - col| over the stored entries
+  double getAverageBandwidth() const; ///< Mean |row - col| over the stored entries
+  template <typename U, typename J> friend class BasicSparseMatrix; ///< Convert() reads the arrays of its source
+  friend class BasicSparseExpr<T, I>; ///< Expressions read the arrays of their operands directly
+  friend class BasicBlockSparseMatrix<T, I>; ///< Blocking reads the arrays and shares the threading helpers
+  friend class BasicTriangleSparseMatrix<T, I>; ///< Triangle storage runs the row kernels on its triangle
+  friend class BasicPackedSparseMatrix<T, I>; ///< Packing reads the arrays and runs the row kernel on decoded rows
+  friend class BasicSparseSolver<T, I>; ///< Solvers split their vector updates with the threading helpers
+  friend class BasicSparseGraph<T, I>; ///< Graph kernels walk the arrays as edge lists
+  friend class BasicHybridSparseMatrix<T, I>; ///< Hybrid storage keeps its sparse blocks as a CSR matrix
+  friend class BasicSparseVectorPlan<T, I>; ///< Plans run the row kernel over a split made once
+  template <typename U, typename J>
+  friend ostream& operator<<(ostream& s, const BasicSparseMatrix<U, J>& sm); ///< Overload << operator for printing
+  void displayMatrix() const; ///< Display the matrix in its original format
+  void displayMatrix(int fd) const; ///< Write the matrix in its original format to a file descriptor
+  void writeMarket(int fd) const; ///< Write the matrix as a Matrix Market coordinate file
+  void writeMarket(int fd, int noThreads) const; ///< writeMarket() with the lines formatted in parallel
+  void setValue(I row, I col, T value); ///< Set value in the matrix
+  T getValue(I row, I col) const; ///< Get value from the matrix
+  I getNoRows() const; ///< Number of rows
+  I getNoCols() const; ///< Number of columns
+  T getCommonValue() const; ///< Common (background) value
+  I getNoNonSparseValues() const; ///< Number of stored entries
+  bool isRowMajor() const; ///< True for CSR storage, false for CSC
+  void save(const char* path) const; ///< Write the binary format opened by SparseMatrix(path)
+  static void MultiplyFiles(const char* pathA, const char* pathB, const char* pathC,
+                            long long memoryBudget); ///< Out-of-core product of two matrix files
+  static void MultiplyFiles(const char* pathA, const char* pathB, const char* pathC,
+                            long long memoryBudget, int noThreads); ///< Row-parallel MultiplyFiles
+};
+typedef BasicSparseMatrix<int, int> SparseMatrix; ///< The int instantiation used by the project
+
+/// @brief Collects values in any order and freezes them into a CSR SparseMatrix.
+///
+/// Used while reading a matrix in: setValue() only appends, so ingestion is linear, and all of the
+/// sorting and duplicate removal is paid once by freeze(). A hashed builder instead finds each cell
+/// through an open addressing table keyed on (row, col), so a cell updated many times is stored once
+/// and getValue() answers in expected O(1) while building.
+template <typename T, typename I>
+class BasicSparseMatrixBuilder {
+ protected:
+  I noRows; ///< Number of rows of the matrix being built
+  I noCols; ///< Number of columns of the matrix being built
+  T commonValue; ///< Common value of the matrix being built
+  I noEntries; ///< Number of recorded entries (duplicates included, unless hashed)
+  I capacity; ///< Number of entries the arrays can hold before they have to grow
+  I* myRows; ///< Row of every recorded entry, in the order they were set
+  I* myCols; ///< Column of every recorded entry
+  T* myVals; ///< Value of every recorded entry
+  bool hashed; ///< True when every cell is recorded once and found through mySlots
+  I noSlots; ///< Size of mySlots, a power of two at least twice noEntries, 0 unless hashed
+  I* mySlots; ///< Open addressing (linear probing) table of entry positions, -1 when empty
+  I slotOf(I row, I col) const; ///< Slot holding (row, col), or the empty slot it would take
+  void rehash(I newNoSlots); ///< Rebuild mySlots with newNoSlots slots
+ public:
+  BasicSparseMatrixBuilder(I n, I m, T cv, I nsv, bool hashed = false); ///< nsv is the expected number of entries
+  BasicSparseMatrixBuilder(const BasicSparseMatrixBuilder&) = delete;
+  BasicSparseMatrixBuilder& operator=(const BasicSparseMatrixBuilder&) = delete;
+  ~BasicSparseMatrixBuilder(); ///< Destructor
+  void setValue(I row, I col, T value); ///< Record a value, the last one set for a cell wins
+  T getValue(I row, I col) const; ///< The value (row, col) would get if the builder were frozen now
+  I getNoEntries() const; ///< Number of recorded entries
+  bool isHashed() const; ///< True for a hashed builder
+  BasicSparseMatrix<T, I>* freeze(); ///< Build the CSR matrix, the builder is left empty
+};
+typedef BasicSparseMatrixBuilder<int, int> SparseMatrixBuilder; ///< Builder of SparseMatrix
+
+/// @brief A matrix prepared for many products with dense vectors, y = A*x.
+///
+/// MultiplyVector() splits the rows on every call, and a CSC matrix needs a scratch vector per thread
+/// to scatter into. A plan does that work once: the constructor re-compresses a CSC matrix by rows and
+/// splits the rows into ranges holding the same number of entries, so Multiply() is the row kernel of
+/// SparseMatrix over a fixed split and allocates nothing. A CSR matrix is referenced, not copied, and
+/// must outlive the plan.
+/// @tparam T The value type.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicSparseVectorPlan {
+ protected:
+  BasicSparseMatrix<T, I>* myRows; ///< The rows of a CSC matrix, or nullptr for a CSR one
+  const BasicSparseMatrix<T, I>& matrix; ///< The matrix compressed by rows
+  int noParts; ///< Row ranges the product is split into
+  I* myBounds; ///< First row of every range, noParts+1 long
+ public:
+  BasicSparseVectorPlan(const BasicSparseMatrix<T, I>& A, int noThreads); ///< Prepare A for noThreads threads
+  BasicSparseVectorPlan(const BasicSparseVectorPlan&) = delete;
+  BasicSparseVectorPlan& operator=(const BasicSparseVectorPlan&) = delete;
+  ~BasicSparseVectorPlan(); ///< Destructor
+  void Multiply(const T* x, T* y) const; ///< y = A*x
+  const BasicSparseMatrix<T, I>& getMatrix() const; ///< The matrix compressed by rows
+};
+typedef BasicSparseVectorPlan<int, int> SparseVectorPlan; ///< Plan of SparseMatrix
+
+/// @brief Register-blocked product kernels of BasicBlockSparseMatrix for one block size.
+///
+/// Blocks are B by B and stored column by column, so one block column times one element of x is a
+/// multiply-add of B contiguous values into B accumulators. With B known at compile time the loops
+/// unroll completely; the int and double kernels for B = 4 and 8 also have AVX2 specializations.
+/// @tparam T The value type.
+/// @tparam I The index type.
+/// @tparam B The block size.
+template <typename T, typename I, int B>
+struct BlockKernel {
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type the products are summed in
+  static void multiplyRow(const I* cols, const T* blocks, I count, const T* x, T shift, Sum* y); ///< One block row times x
+  static void multiplyTile(const T* a, const T* b, Sum* c); ///< c += a*b on single blocks
+};
+
+/// @brief A matrix stored as dense B by B blocks in block compressed sparse row (BSR) form.
+///
+/// Matrices whose entries cluster in small dense blocks, finite-element matrices for one, store one
+/// column index per block instead of one per entry and run register-blocked kernels that the compiler
+/// (or an AVX2 specialization) vectorizes. Cells of a stored block that are not set hold the common
+/// value. The block size is 1, 2, 4 or 8, either given or picked by chooseBlockSize() from a sample of
+/// the rows; rows and columns past the end of the matrix are padding.
+/// @tparam T The value type.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicBlockSparseMatrix {
+ public:
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type sums of products are accumulated in
+ protected:
+  I noRows; ///< Number of rows
+  I noCols; ///< Number of columns
+  T commonValue; ///< Value of every cell that is not stored
+  int blockSize; ///< Rows and columns of a block
+  I noBlockRows; ///< Number of block rows, noRows rounded up to whole blocks
+  I noBlockCols; ///< Number of block columns, noCols rounded up to whole blocks
+  I noBlocks; ///< Number of stored blocks
+  I* myOffsets; ///< Start of every block row inside myIndices, noBlockRows+1 long
+  I* myIndices; ///< Block column of every block, sorted within a block row
+  T* myValues; ///< blockSize*blockSize values per block, column by column
+  BasicBlockSparseMatrix(I n, I m, T cv, int blockSize); ///< Empty matrix, arrays still to be allocated
+  template <int B> void multiplyVectorRows(const T* x, Sum background, T* y, int noThreads) const; ///< SpMV for B
+  template <int B> BasicBlockSparseMatrix* multiplyBlocks(const BasicBlockSparseMatrix& M, int noThreads) const; ///< SpGEMM for B
+  static void checkBlockSize(int blockSize); ///< Throw unless blockSize is 1, 2, 4 or 8
+ public:
+  BasicBlockSparseMatrix(const BasicSparseMatrix<T, I>& M, int blockSize = 0); ///< Block M, 0 to pick the size
+  BasicBlockSparseMatrix(const BasicBlockSparseMatrix&) = delete; ///< Matrices are passed around by pointer
+  BasicBlockSparseMatrix& operator=(const BasicBlockSparseMatrix&) = delete;
+  ~BasicBlockSparseMatrix(); ///< Destructor
+  static int chooseBlockSize(const BasicSparseMatrix<T, I>& M, I noSamples = 64); ///< Block size with the least traffic
+  BasicSparseMatrix<T, I>* toSparse() const; ///< The same matrix in CSR form
+  BasicBlockSparseMatrix* Multiply(const BasicBlockSparseMatrix &M) const; ///< Matrix Multiplication
+  BasicBlockSparseMatrix* Multiply(const BasicBlockSparseMatrix &M, int noThreads) const; ///< Row-parallel Multiply
+  void MultiplyVector(const T* x, T* y) const; ///< Matrix times dense vector, y = A*x
+  void MultiplyVector(const T* x, T* y, int noThreads) const; ///< Row-parallel y = A*x
+  T getValue(I row, I col) const; ///< Get value from the matrix
+  I getNoRows() const; ///< Number of rows
+  I getNoCols() const; ///< Number of columns
+  T getCommonValue() const; ///< Common (background) value
+  int getBlockSize() const; ///< Rows and columns of a block
+  I getNoBlocks() const; ///< Number of stored blocks
+};
+typedef BasicBlockSparseMatrix<int, int> BlockSparseMatrix; ///< Block form of SparseMatrix
+
+/// @brief A square matrix stored by one triangle: a symmetric matrix by its upper triangle, or an upper
+/// or lower triangular matrix.
+///
+/// The stored triangle, diagonal included, is a CSR SparseMatrix whose common value applies inside the
+/// triangle. For SYMMETRIC the other triangle mirrors it, for UPPER and LOWER it is zero. Symmetric
+/// matrices such as Gram or adjacency matrices so take half the memory and half the SpMV bandwidth.
+/// @tparam T The value type.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicTriangleSparseMatrix {
+ public:
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type sums of products are accumulated in
+  enum Shape { SYMMETRIC, UPPER, LOWER }; ///< What the stored triangle stands for
+ protected:
+  Shape shape; ///< How the cells outside the stored triangle follow from it
+  BasicSparseMatrix<T, I>* myTriangle; ///< The upper (SYMMETRIC, UPPER) or lower (LOWER) triangle, by rows
+  bool inTriangle(I row, I col) const; ///< True when (row, col) lies in the stored triangle
+ public:
+  BasicTriangleSparseMatrix(const BasicSparseMatrix<T, I>& M, Shape shape); ///< Keep one triangle of M
+  BasicTriangleSparseMatrix(const BasicTriangleSparseMatrix&) = delete; ///< Matrices are passed around by pointer
+  BasicTriangleSparseMatrix& operator=(const BasicTriangleSparseMatrix&) = delete;
+  ~BasicTriangleSparseMatrix(); ///< Destructor
+  BasicSparseMatrix<T, I>* toSparse() const; ///< The whole matrix in CSR form
+  BasicSparseMatrix<T, I>* Multiply(const BasicSparseMatrix<T, I> &M) const; ///< Matrix Multiplication
+  BasicSparseMatrix<T, I>* Multiply(const BasicSparseMatrix<T, I> &M, int noThreads) const; ///< Row-parallel Multiply
+  void MultiplyVector(const T* x, T* y) const; ///< Matrix times dense vector, y = A*x
+  void MultiplyVector(const T* x, T* y, int noThreads) const; ///< Row-parallel y = A*x
+  void Solve(const T* b, T* x) const; ///< Substitution, x = A^-1 * b, for the triangular shapes
+  T getValue(I row, I col) const; ///< Get value from the matrix
+  I getNoRows() const; ///< Number of rows
+  I getNoCols() const; ///< Number of columns
+  T getCommonValue() const; ///< Common (background) value of the stored triangle
+  Shape getShape() const; ///< What the stored triangle stands for
+  I getNoNonSparseValues() const; ///< Number of stored entries
+};
+typedef BasicTriangleSparseMatrix<int, int> TriangleSparseMatrix; ///< Triangle form of SparseMatrix
+
+/// @brief A CSR matrix whose column indices are delta encoded and bit-packed, for matrices too large
+/// to hold with a full index per entry.
+///
+/// Rows are grouped in blocks of BLOCK_ROWS. Every row keeps its first column as is; the gaps to the
+/// following columns, minus one, are packed back to back with the bit width of the largest gap in the
+/// block, so clustered rows cost a few bits per index and runs of adjacent columns cost none. SpMV
+/// decodes the indices into a small buffer (with AVX2, eight per step) and runs the SIMD row kernel of
+/// SparseMatrix on it, trading arithmetic for memory traffic.
+/// @tparam T The value type.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicPackedSparseMatrix {
+ public:
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type sums of products are accumulated in
+  static const int BLOCK_ROWS = 64; ///< Rows sharing one bit width
+  static const int DECODE_CHUNK = 256; ///< Indices decoded at a time by the kernels
+ protected:
+  I noRows; ///< Number of rows
+  I noCols; ///< Number of columns
+  T commonValue; ///< Value of every cell that is not stored
+  I noNonSparseValues; ///< Number of stored entries
+  I noBlocks; ///< Number of row blocks
+  I* myOffsets; ///< Start of every row inside myValues, noRows+1 long
+  I* myFirsts; ///< First column of every non-empty row
+  unsigned char* myWidths; ///< Bit width of the packed gaps of every block
+  long long* myBitStarts; ///< First bit of every block inside myBits, noBlocks+1 long
+  unsigned char* myBits; ///< The packed gaps, followed by 8 bytes of padding for the decoders
+  T* myValues; ///< Value of every entry, in row order
+  static void decodeRun(const unsigned char* bits, long long bitPos, int width, I count, I base, I* cols); ///< Gaps to columns
+  static Sum dotRow(const unsigned char* bits, long long bitPos, int width, I first, I length, const T* values,
+                    const T* x, T shift); ///< One packed row times x
+  void multiplyBlocks(const T* x, Sum background, T* y, I firstBlock, I lastBlock) const; ///< SpMV over some blocks
+ public:
+  BasicPackedSparseMatrix(const BasicSparseMatrix<T, I>& M); ///< Pack M, compressed either way
+  BasicPackedSparseMatrix(const BasicPackedSparseMatrix&) = delete; ///< Matrices are passed around by pointer
+  BasicPackedSparseMatrix& operator=(const BasicPackedSparseMatrix&) = delete;
+  ~BasicPackedSparseMatrix(); ///< Destructor
+  BasicSparseMatrix<T, I>* toSparse() const; ///< The same matrix in CSR form
+  void MultiplyVector(const T* x, T* y) const; ///< Matrix times dense vector, y = A*x
+  void MultiplyVector(const T* x, T* y, int noThreads) const; ///< Block-parallel y = A*x
+  T getValue(I row, I col) const; ///< Get value from the matrix
+  I getNoRows() const; ///< Number of rows
+  I getNoCols() const; ///< Number of columns
+  T getCommonValue() const; ///< Common (background) value
+  I getNoNonSparseValues() const; ///< Number of stored entries
+  long long getMemoryUsage() const; ///< Bytes held by the arrays
+};
+typedef BasicPackedSparseMatrix<int, int> PackedSparseMatrix; ///< Packed form of SparseMatrix
+
+/// @brief Iterative solver for A*x = b over a square SparseMatrix: conjugate gradients for symmetric
+/// positive definite matrices and BiCGSTAB for general ones, both with Jacobi preconditioning.
+///
+/// Every iteration is one or two calls to the parallel SpMV of SparseMatrix plus a few passes over
+/// the vectors, which are split into ranges run on the shared pool with the dot products fused into
+/// the updates. The work vectors are allocated once by the constructor, so Solve() can be called
+/// again and again without allocating. After a solve the number of iterations, the relative residual
+/// of every iteration and the time spent are kept for inspection. The SpMV runs through a
+/// SparseVectorPlan made by the constructor, so a CSC matrix is re-compressed by rows once and no
+/// iteration allocates. A CSR matrix is referenced, not copied, and must outlive the solver.
+/// @tparam T The value type, float or double.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicSparseSolver {
+  static_assert(is_floating_point<T>::value, "Iterative solvers need a floating point value type");
+ public:
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type dot products are accumulated in
+  enum Method { CG, BICGSTAB }; ///< Conjugate gradients (SPD matrices) or BiCGSTAB (any matrix)
+ protected:
+  BasicSparseVectorPlan<T, I> plan; ///< The matrix being solved, split for the SpMV
+  Method method; ///< The iteration used by Solve()
+  I n; ///< Length of the vectors
+  int noThreads; ///< Threads used by the SpMV
+  int noParts; ///< Ranges the vector updates are split into
+  int maxIterations; ///< Iterations allowed before giving up
+  double tolerance; ///< Relative residual |b - A*x| / |b| to reach
+  bool preconditioned; ///< True to apply the Jacobi preconditioner
+  T* myInverseDiagonal; ///< 1 / A(i, i), or 1 where the diagonal is zero
+  T* myWork; ///< All work vectors in one allocation
+  T* r; ///< Residual
+  T* z; ///< Preconditioned residual (CG), preconditioned search direction (BiCGSTAB)
+  T* p; ///< Search direction
+  T* q; ///< A times the search direction
+  T* rHat; ///< Shadow residual (BiCGSTAB)
+  T* s; ///< Intermediate residual (BiCGSTAB)
+  T* t; ///< A times the preconditioned s (BiCGSTAB)
+  T* u; ///< Preconditioned s (BiCGSTAB)
+  double* myHistory; ///< Relative residual after every iteration, maxIterations+1 long
+  int noIterations; ///< Iterations done by the last solve
+  bool converged; ///< True if the last solve reached the tolerance
+  double seconds; ///< Wall time of the last solve
+  double spmvSeconds; ///< Part of seconds spent in the SpMV
+  Sum reduce(const function<Sum(I, I)>& range) const; ///< Sum of range() over a split of 0..n-1
+  void multiply(const T* x, T* y); ///< y = A*x, timed
+  bool solveCG(const T* b, T* x, double normB); ///< Preconditioned conjugate gradients
+  bool solveBiCGSTAB(const T* b, T* x, double normB); ///< Right preconditioned BiCGSTAB
+ public:
+  BasicSparseSolver(const BasicSparseMatrix<T, I>& A, Method method); ///< Single threaded solver
+  BasicSparseSolver(const BasicSparseMatrix<T, I>& A, Method method, int noThreads); ///< Parallel solver
+  BasicSparseSolver(const BasicSparseSolver&) = delete;
+  BasicSparseSolver& operator=(const BasicSparseSolver&) = delete;
+  ~BasicSparseSolver(); ///< Destructor
+  void setTolerance(double tolerance); ///< Relative residual to stop at, 1e-8 by default
+  void setMaxIterations(int maxIterations); ///< Iteration limit, 1000 by default
+  void setPreconditioned(bool preconditioned); ///< Jacobi preconditioning on or off, on by default
+  bool Solve(const T* b, T* x); ///< Solve A*x = b starting from the guess in x, true if converged
+  int getIterations() const; ///< Iterations done by the last solve
+  double getResidual() const; ///< Relative residual reached by the last solve
+  const double* getResidualHistory() const; ///< Relative residual after 0..getIterations() iterations
+  bool hasConverged() const; ///< True if the last solve reached the tolerance
+  double getSeconds() const; ///< Wall time of the last solve
+  double getSpMVSeconds() const; ///< Part of getSeconds() spent multiplying by A
+};
+typedef BasicSparseSolver<double, int> SparseSolver; ///< Solver over double matrices with int indices
+
+/// @brief Graph algorithms over a square SparseMatrix holding an adjacency matrix: every stored entry
+/// (u, v) is an edge from u to v, whatever its value.
+///
+/// The constructor keeps the out-edges compressed by rows and builds the in-edges, the rows of the
+/// transpose, once. BFS switches between pushing from the frontier over out-edges and pulling into
+/// the unvisited vertices over in-edges, whichever touches fewer edges; PageRank is a power iteration
+/// whose step is a pull SpMV over the in-edges. Both split their work across the shared pool, and
+/// the time, frontier size or change of every step of the last run is kept for inspection. Work
+/// arrays are allocated once by the constructor.
+/// @tparam T The value type of the adjacency matrix.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicSparseGraph {
+ public:
+  enum Direction { PUSH, PULL }; ///< How a BFS level was expanded
+  static const int PULL_FACTOR = 14; ///< Pull once the frontier has more than 1/PULL_FACTOR of the unexplored edges
+  static const int PUSH_FACTOR = 24; ///< Push again once the frontier has fewer than 1/PUSH_FACTOR of the vertices
+ protected:
+  I n; ///< Number of vertices
+  int noThreads; ///< Threads to use
+  BasicSparseMatrix<T, I>* myOut; ///< Out-edges compressed by rows
+  BasicSparseMatrix<T, I>* myIn; ///< In-edges, the transpose compressed by rows
+  atomic<char>* myVisited; ///< Vertices reached by the running BFS
+  unsigned char* myInFrontier; ///< Frontier of a pull step as flags
+  I* myFrontier; ///< Vertices of the current BFS level
+  I* myNext; ///< Vertices of the next BFS level
+  double* myScratch; ///< Rank divided by out-degree during PageRank
+  int noSteps; ///< Steps of the last run
+  int stepCapacity; ///< Length of the step arrays
+  double* myStepSeconds; ///< Wall time of every step
+  double* myStepDeltas; ///< L1 change of the ranks in every PageRank step
+  I* myStepFrontiers; ///< Frontier size of every BFS level
+  Direction* myStepDirections; ///< Direction of every BFS level
+  void recordStep(double seconds, double delta, I frontier, Direction direction); ///< Append to the step arrays
+  void push(I depth, I* levels, I noFrontier, atomic<I>& noNext); ///< Top-down step into myNext
+  I pull(I depth, I* levels, I noFrontier); ///< Bottom-up step, returns the size of the next level
+  int partsFor(long long work) const; ///< Parts worth splitting work across
+ public:
+  BasicSparseGraph(const BasicSparseMatrix<T, I>& A); ///< Single threaded graph over adjacency matrix A
+  BasicSparseGraph(const BasicSparseMatrix<T, I>& A, int noThreads); ///< Parallel graph over A
+  BasicSparseGraph(const BasicSparseGraph&) = delete;
+  BasicSparseGraph& operator=(const BasicSparseGraph&) = delete;
+  ~BasicSparseGraph(); ///< Destructor
+  I BFS(I source, I* levels); ///< Distance of every vertex from source, returns the number reached
+  int PageRank(double* rank, double damping, double tolerance, int maxIterations); ///< Returns the iterations done
+  I getNoVertices() const; ///< Number of vertices
+  I getNoEdges() const; ///< Number of edges
+  int getNoSteps() const; ///< BFS levels or PageRank iterations of the last run
+  const double* getStepSeconds() const; ///< Wall time of every step of the last run
+  const double* getStepDeltas() const; ///< L1 change of the ranks after every PageRank iteration
+  const I* getStepFrontiers() const; ///< Frontier size of every BFS level
+  const Direction* getStepDirections() const; ///< Direction every BFS level was expanded in
+};
+typedef BasicSparseGraph<int, int> SparseGraph; ///< Graph over SparseMatrix adjacency
+
+/// @brief A matrix stored in blocks of rows that are each either sparse (CSR) or dense, by density.
+///
+/// Products of sparse matrices often come out much denser than their operands, and there a CSR entry
+/// pays for an index on top of its value and every lookup is a search. Every block of BLOCK_ROWS rows
+/// whose share of non-common cells reaches the density threshold keeps all of its cells in a dense
+/// row-major tile; the other blocks stay in one CSR matrix, where the rows of the dense blocks are
+/// empty. Add() and Multiply() choose the form of every result block from a bound on its density and
+/// compute dense blocks with the SIMD row kernel ValueKernel::axpy. getValue() and printing read both
+/// forms, so callers never see which form a block is in. The default threshold is the density at
+/// which a dense block takes as much memory as CSR, sizeof(T) / (sizeof(T) + sizeof(I)).
+/// @tparam T The value type.
+/// @tparam I The index type.
+template <typename T, typename I>
+class BasicHybridSparseMatrix {
+ public:
+  typedef typename ValueTraits<T>::Accumulator Sum; ///< Type sums of products are accumulated in
+  static const int BLOCK_ROWS = 64; ///< Rows sharing one representation
+ protected:
+  I noRows; ///< Number of rows
+  I noCols; ///< Number of columns
+  T commonValue; ///< Value of every cell a sparse block does not store
+  double threshold; ///< Share of non-common cells from which a block is stored densely
+  I noBlocks; ///< Number of row blocks
+  I noNonSparseValues; ///< Number of cells that differ from the common value
+  BasicSparseMatrix<T, I>* mySparse; ///< The sparse blocks in CSR form, with empty rows for the dense blocks
+  T** myTiles; ///< Cells of every dense block row by row, nullptr for the sparse blocks
+  BasicHybridSparseMatrix(I n, I m, T cv, double threshold); ///< Matrix without blocks, filled by assemble()
+  bool isDense(long long count, I rows) const; ///< count non-common cells in rows rows reach the threshold
+  const T* denseRow(I row) const; ///< Cells of a row of a dense block, nullptr for a sparse block
+  void addRow(I row, Sum alpha, Sum* cells) const; ///< cells += alpha times the row
+  static BasicHybridSparseMatrix* assemble(I n, I m, T cv, double threshold, const long long* estimates, int noThreads,
+                                           const function<void(I, Sum*)>& denseRow,
+                                           const function<void(I, RowAccumulator<T, I>&)>& sparseRow); ///< Block-parallel driver
+ public:
+  BasicHybridSparseMatrix(const BasicSparseMatrix<T, I>& M, double threshold = -1); ///< Split M, -1 for the default threshold
+  BasicHybridSparseMatrix(const BasicHybridSparseMatrix&) = delete; ///< Matrices are passed around by pointer
+  BasicHybridSparseMatrix& operator=(const BasicHybridSparseMatrix&) = delete;
+  ~BasicHybridSparseMatrix(); ///< Destructor
+  BasicSparseMatrix<T, I>* toSparse() const; ///< The same matrix in CSR form
+  BasicHybridSparseMatrix* Add(const BasicHybridSparseMatrix &M) const; ///< Matrix Addition
+  BasicHybridSparseMatrix* Add(const BasicHybridSparseMatrix &M, int noThreads) const; ///< Block-parallel Matrix Addition
+  BasicHybridSparseMatrix* Multiply(const BasicHybridSparseMatrix &M) const; ///< Matrix Multiplication
+  BasicHybridSparseMatrix* Multiply(const BasicHybridSparseMatrix &M, int noThreads) const; ///< Block-parallel Matrix Multiplication
+  T getValue(I row, I col) const; ///< Get value from the matrix
+  I getNoRows() const; ///< Number of rows
+  I getNoCols() const; ///< Number of columns
+  T getCommonValue() const; ///< Common (background) value
+  I getNoNonSparseValues() const; ///< Number of cells that differ from the common value
+  I getNoDenseBlocks() const; ///< Number of blocks stored densely
+  double getDensityThreshold() const; ///< Share of non-common cells from which a block is stored densely
+  long long getMemoryUsage() const; ///< Bytes held by the arrays and tiles
+  template <typename U, typename J>
+  friend ostream& operator<<(ostream& s, const BasicHybridSparseMatrix<U, J>& hm); ///< Overload << operator for printing
   void displayMatrix() const; ///< Display the matrix in its original format
-  void setValue(int row, int col, int value); ///< Set value in the matrix
-  int getValue(int row, int col) const; ///< Get value from the matrix
+};
+typedef BasicHybridSparseMatrix<int, int> HybridSparseMatrix; ///< Hybrid form of SparseMatrix
+
+/// @brief A lazily evaluated expression over SparseMatrix operands.
+///
+/// Transpose, Scale, Axpby/Add and Multiply only record the operation; evaluate() then plans the whole
+/// expression at once. Transposes are pushed down to the operands, where they become free views,
+/// sums of any length are computed in one pass, and a product of two sums is computed by a single
+/// Gustavson pass that adds the operand rows on the fly, so (A+B)*C never builds A+B. Only nested
+/// products are evaluated into temporaries. Operands are referenced, not copied, and must outlive
+/// the expression.
+template <typename T, typename I>
+class BasicSparseExpr {
+ public:
+  typedef BasicSparseMatrix<T, I> Matrix; ///< The operand and result type
+  enum Kind { LEAF, TRANSPOSE, SCALE, AXPBY, MULTIPLY }; ///< Kinds of expression nodes
+ protected:
+  /// @brief One recorded operation.
+  struct Node {
+    Kind kind; ///< The operation
+    const Matrix* matrix; ///< The operand of a LEAF
+    T alpha; ///< Scale of the left child for SCALE and AXPBY
+    T beta; ///< Scale of the right child for AXPBY
+    I noRows; ///< Rows of the result
+    I noCols; ///< Columns of the result
+    shared_ptr<Node> left; ///< First child
+    shared_ptr<Node> right; ///< Second child of AXPBY and MULTIPLY
+  };
+  /// @brief A scaled matrix taking part in a sum.
+  struct Term {
+    T coef; ///< Scale of the matrix
+    const Matrix* matrix; ///< The matrix, possibly one of the temporaries
+  };
+  shared_ptr<Node> myNode; ///< Root of the expression
+  BasicSparseExpr(const shared_ptr<Node>& node); ///< Wrap a node
+  static shared_ptr<Node> makeNode(Kind kind, I noRows, I noCols); ///< Allocate a node
+  static Matrix* evaluate(const Node& node, bool transposed, int noThreads); ///< Evaluate (the transpose of) node
+  static void collect(const Node& node, T coef, bool transposed, int noThreads, Term* terms, int& noTerms,
+                      Matrix** temporaries, int& noTemporaries); ///< Flatten a sum into terms
+  static int countTerms(const Node& node); ///< Upper bound on the terms of a sum
+  static bool toRows(Term* terms, int noTerms, Matrix** temporaries, int& noTemporaries); ///< CSR terms
+  static Matrix* sumOf(Term* terms, int noTerms, I noRows, I noCols, int noThreads); ///< Sum of any terms
+  static Matrix* combine(Term* terms, int noTerms, I noRows, I noCols, int noThreads); ///< Sum of CSR terms
+  static Matrix* multiply(Term* left, int noLeft, Term* right, int noRight, I noRows, I noCols,
+                          int noThreads); ///< Product of two sums of CSR terms
+ public:
+  BasicSparseExpr(const Matrix& M); ///< An expression that is just M
+  BasicSparseExpr Transpose() const; ///< Transpose of this expression
+  BasicSparseExpr Scale(T alpha) const; ///< alpha times this expression
+  BasicSparseExpr Add(const BasicSparseExpr& other) const; ///< this + other
+  BasicSparseExpr Axpby(T alpha, const BasicSparseExpr& other, T beta) const; ///< alpha*this + beta*other
+  BasicSparseExpr Multiply(const BasicSparseExpr& other) const; ///< this * other
+  I getNoRows() const; ///< Rows of the result
+  I getNoCols() const; ///< Columns of the result
+  Matrix* evaluate(int noThreads = 1) const; ///< Compute the expression into a new matrix
+};
+typedef BasicSparseExpr<int, int> SparseExpr; ///< Expressions over SparseMatrix
+
+/// @brief Reads matrices in the project's text format from a memory-mapped file, bypassing iostreams.
+class MatrixReader {
+ protected:
+  const char* myData; ///< The whole input, followed by at least one NUL byte
+  size_t myLength; ///< Length of the input in bytes
+  void* myMapping; ///< The mapping behind myData, or nullptr when the input was copied
+  char* myCopy; ///< The copied input when it could not be mapped
+  const char* position; ///< Next byte to parse
+  bool readInt(int& value); ///< Parse the next integer, false at the end of the input
+  static bool readLong(const char*& p, long long& value); ///< Parse an integer on the current line
+  static bool readReal(const char*& p, double& value); ///< Parse a real number on the current line
+  const char* readLine(); ///< Start of the next line, advancing position past it
+ public:
+  MatrixReader(int fd); ///< Map (or read) an open file descriptor
+  MatrixReader(const MatrixReader&) = delete;
+  MatrixReader& operator=(const MatrixReader&) = delete;
+  ~MatrixReader(); ///< Unmap the input
+  SparseMatrix* next(); ///< Read the next matrix, nullptr once the input is exhausted
+  bool nextWord(char* word, size_t size); ///< Read the next whitespace separated word, false at the end
+  template <typename T, typename I>
+  BasicSparseMatrix<T, I>* nextMarket(int noThreads); ///< Read the rest of the input as a Matrix Market file
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -65,7 +839,8 @@ class SparseMatrix {
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /// @brief Construct a new default SparseRow object.
-SparseRow::SparseRow()
+template <typename T, typename I>
+BasicSparseRow<T, I>::BasicSparseRow()
   : row(-1), col(-1), value(0)
 {
 }
@@ -74,271 +849,7780 @@ SparseRow::SparseRow()
 /// @param row The row of the object within the matrix.
 /// @param col The col of the object within the matrix.
 /// @param value The value that this container holds.
-SparseRow::SparseRow(int row, int col, int value)
+template <typename T, typename I>
+BasicSparseRow<T, I>::BasicSparseRow(I row, I col, T value)
   : row(row), col(col), value(value)
 {
 }
 
 /// @brief Displays the row to the console.
-void SparseRow::display() const
+template <typename T, typename I>
+void BasicSparseRow<T, I>::display() const
 {
   cout << "Row: " << row << ", Col: " << col << ", Value: " << value << endl;
 }
 
 /// @brief Gets the row of the sparse row.
 /// @return The row of the sparse row.
-int SparseRow::getRow() const
+template <typename T, typename I>
+inline I BasicSparseRow<T, I>::getRow() const
 {
   return this->row;
 }
 
 /// @brief Gets the column of the sparse row.
 /// @return The column of the sparse row.
-int SparseRow::getCol() const
+template <typename T, typename I>
+inline I BasicSparseRow<T, I>::getCol() const
 {
   return this->col;
 }
 
-/// @brief Overload << operator to allow for easier printing of SparseRow object.
-int SparseRow::getVal() const
+/// @brief Gets the value of the sparse row.
+/// @return The value of the sparse row.
+template <typename T, typename I>
+inline T BasicSparseRow<T, I>::getVal() const
 {
   return this->value;
 }
 
 /// @brief Sets the value of the sparse row.
 /// @param val The value to asign to the sparse row.
-void SparseRow::setVal(int val)
+template <typename T, typename I>
+inline void BasicSparseRow<T, I>::setVal(T val)
 {
   this->value = val;
 }
+
+/// @brief Overload << operator to allow for easier printing of SparseRow object.
 /// @param s The stream to send the display data.
 /// @param sr The reference to the SparseRow object to print.
 /// @return A reference to the stream where the object was sent.
-ostream& operator<<(ostream& s, const SparseRow& sr)
+template <typename T, typename I>
+ostream& operator<<(ostream& s, const BasicSparseRow<T, I>& sr)
 {
   s << "Row: " << sr.row << ", Col: " << sr.col << ", Value: " << sr.value;
   return s;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//              SparseMatrix Implementation.
+//              EntryBuffer and WorkerPool Implementation.
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-/// @brief Constructs a new empty SparseMatrix with a default SparseRow.
-SparseMatrix::SparseMatrix()
-  : noRows(0), noCols(0), commonValue(0), noNonSparseValues(0)
+/// @brief Constructs an empty buffer.
+template <typename T, typename I>
+EntryBuffer<T, I>::EntryBuffer()
+  : size(0), capacity(0), indices(nullptr), values(nullptr)
 {
-  myMatrix = new SparseRow[0]; // Allocate an empty array
 }
 
-/// @brief Constructs a new SparseMatrix 
-/// @param n the number of rows of the entire matrix.
-/// @param m the number of columns of the entire matrix.
-/// @param cv the common(default) value of the matrix. 
-/// @param nsv the number of non-sparse (non-default) values in the matrix.
-SparseMatrix::SparseMatrix(int n, int m, int cv, int nsv)
-  : noRows(n), noCols(m), commonValue(cv), noNonSparseValues(nsv)
+/// @brief Deletes the buffer arrays.
+template <typename T, typename I>
+EntryBuffer<T, I>::~EntryBuffer()
 {
-  myMatrix = new SparseRow[noNonSparseValues]; // Allocate array for non-sparse values
+  delete[] indices;
+  delete[] values;
 }
 
-/// @brief Deletes the matrix array object and sets its pointer to null to avoid memory leaks.
-SparseMatrix::~SparseMatrix()
+/// @brief Appends one entry, doubling the arrays when they are full.
+/// @param index The column index of the entry.
+/// @param value The value of the entry.
+template <typename T, typename I>
+void EntryBuffer<T, I>::push(I index, T value)
 {
-  delete[] myMatrix;
-  myMatrix = nullptr;
+  if (size == capacity) {
+    I newCapacity = capacity < 8 ? 16 : capacity * 2;
+    I* newIndices = new I[newCapacity];
+    T* newValues = new T[newCapacity];
+    copy(indices, indices + size, newIndices);
+    copy(values, values + size, newValues);
+    delete[] indices;
+    delete[] values;
+    indices = newIndices;
+    values = newValues;
+    capacity = newCapacity;
+  }
+  indices[size] = index;
+  values[size] = value;
+  ++size;
 }
 
-/// @brief Transposes the current and generates a new matrix based on that transportation.
-/// @return The transposed matrix based on the current matrix.
-SparseMatrix* SparseMatrix::Transpose() const
+/// @brief Allocates an accumulator with no row started.
+/// @param noCols The number of columns of the rows to accumulate.
+template <typename T, typename I>
+RowAccumulator<T, I>::RowAccumulator(I noCols)
+  : noTouched(0), row(-1)
 {
-  // Create a new SparseMatrix with swapped rows and columns
-  SparseMatrix* transposed = new SparseMatrix(this->noCols, this->noRows, this->commonValue, this->noNonSparseValues);
+  sums = new Sum[noCols];
+  touchedBy = new I[noCols];
+  touched = new I[noCols];
+  fill(touchedBy, touchedBy + noCols, -1);
+}
 
-  // Iterate over the non-sparse values and set them in the transposed matrix
-  for (int i = 0; i < this->noNonSparseValues; ++i) {
-    int row = this->myMatrix[i].getRow();
-    int col = this->myMatrix[i].getCol();
-    int value = this->myMatrix[i].getVal();
-    transposed->setValue(col, row, value); // Swap row and col
-  }
+/// @brief Deletes the accumulator arrays.
+template <typename T, typename I>
+RowAccumulator<T, I>::~RowAccumulator()
+{
+  delete[] sums;
+  delete[] touchedBy;
+  delete[] touched;
+}
 
-  return transposed;
+/// @brief Begins accumulating a new row.
+/// @param row The number of the row, different from every row accumulated before.
+template <typename T, typename I>
+void RowAccumulator<T, I>::start(I row)
+{
+  this->row = row;
+  noTouched = 0;
 }
 
-/// @brief Multiplies two two matrices together and returns the result as a new matrix.
-/// @param M The matrix to multiply with the current matrix calling the method.
-/// @return The newly genereated matrix based on the multipliation completed.
-SparseMatrix* SparseMatrix::Multiply(const SparseMatrix &M) const
+/// @brief Adds a contribution to a column of the current row.
+/// @param col The column.
+/// @param value The contribution.
+template <typename T, typename I>
+void RowAccumulator<T, I>::add(I col, Sum value)
 {
-  // Check if the matrices can be multiplied
-  if (this->noCols != M.noRows) {
-    throw std::invalid_argument("Matrix multiplication is not possible");
+  if (touchedBy[col] != row) {
+    touchedBy[col] = row;
+    sums[col] = value;
+    touched[noTouched++] = col;
+  } else {
+    sums[col] += value;
   }
+}
 
-  // Create a new SparseMatrix to store the result
-  SparseMatrix* result = new SparseMatrix(this->noRows, M.noCols, this->commonValue, 0);
-
-  // Perform the multiplication logic
-  for (int i = 0; i < this->noRows; ++i) {
-    for (int j = 0; j < M.noCols; ++j) {
-      int sum = 0;
-      for (int k = 0; k < this->noCols; ++k) {
-        sum += this->getValue(i, k) * M.getValue(k, j);
-      }
-      if (sum != this->commonValue) {
-        result->setValue(i, j, sum);
-      }
+/// @brief Appends the current row in column order, dropping sums that cancelled out.
+/// @param out The buffer to append to.
+/// @param background Added to every stored sum, the common value of the result.
+/// @return The number of entries appended.
+template <typename T, typename I>
+I RowAccumulator<T, I>::flush(EntryBuffer<T, I>& out, T background)
+{
+  sort(touched, touched + noTouched);
+  I before = out.size;
+  for (I t = 0; t < noTouched; ++t) {
+    if (sums[touched[t]] != 0) {
+      out.push(touched[t], (T)(sums[touched[t]] + background));
     }
   }
-
-  return result;
+  return out.size - before;
 }
 
-/// @brief Adds two two matrices together and returns the result as a new matrix.
-/// @param M The matrix to add to the current matrix calling the method.
-/// @return The newly genereated matrix based on the addition completed.
-SparseMatrix* SparseMatrix::Add(const SparseMatrix &M) const
+/// @brief Starts the worker threads, which sleep until run() posts tasks.
+/// @param noWorkers The number of threads to start, the caller of run() works alongside them.
+WorkerPool::WorkerPool(int noWorkers)
+  : noWorkers(noWorkers > 0 ? noWorkers : 0), myTask(nullptr), noTasks(0), nextTask(0),
+    generation(0), noFinishedWorkers(0), stopping(false)
 {
-  if (this->noRows != M.noRows || this->noCols != M.noCols) {
-    throw std::invalid_argument("Matrix addition is not possible");
+  myWorkers = new thread[this->noWorkers];
+  for (int w = 0; w < this->noWorkers; ++w) {
+    myWorkers[w] = thread(&WorkerPool::workerLoop, this);
   }
+}
 
-  SparseMatrix* result = new SparseMatrix(this->noRows, this->noCols, this->commonValue, 0);
-
-  // Add non-sparse values from the first matrix
-  for (int i = 0; i < this->noNonSparseValues; ++i) {
-    result->setValue(this->myMatrix[i].getRow(), this->myMatrix[i].getCol(), this->myMatrix[i].getVal());
+/// @brief Wakes the workers up to stop and waits for them to exit.
+WorkerPool::~WorkerPool()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
   }
-
-  // Add non-sparse values from the second matrix
-  for (int i = 0; i < M.noNonSparseValues; ++i) {
-    int row = M.myMatrix[i].getRow();
-    int col = M.myMatrix[i].getCol();
-    int value = M.myMatrix[i].getVal() + result->getValue(row, col);
-    result->setValue(row, col, value);
+  wake.notify_all();
+  for (int w = 0; w < noWorkers; ++w) {
+    myWorkers[w].join();
   }
-
-  return result;
+  delete[] myWorkers;
+  myWorkers = nullptr;
 }
 
-/// @brief Overload << operator to allow for easier printing of SparseMatrix object.
-/// @param s The stream to send the display data.
-/// @param sm The reference to the SparseMatrix object to print.
-/// @return A reference to the stream where the object was sent.
-ostream& operator<<(ostream& s, const SparseMatrix& sm)
+/// @brief Waits for every generation of tasks and helps running it.
+void WorkerPool::workerLoop()
 {
-  // Print matrix dimensions and common value
-  //s << sm.noRows << ", " << sm.noCols << ", " << sm.commonValue << ", " << sm.noNonSparseValues << endl;
-
-  // Print non-sparse values
-  for (int i = 0; i < sm.noNonSparseValues; ++i) {
-    if (sm.myMatrix[i].getRow() != -1 && sm.myMatrix[i].getCol() != -1) {
-      s << sm.myMatrix[i].getRow() << ", " << sm.myMatrix[i].getCol() << ", " << sm.myMatrix[i].getVal() << endl;
+  int seen = 0;
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    wake.wait(guard, [&] { return stopping || generation != seen; });
+    if (stopping) {
+      return;
     }
-  }
+    seen = generation;
+    guard.unlock();
+    drain();
+    guard.lock();
 
-  return s;
+    // Every worker checks in once per generation, so none can wander into the next one late
+    ++noFinishedWorkers;
+    finished.notify_all();
+  }
 }
 
-/// @brief Display the matrix in its original format.
-void SparseMatrix::displayMatrix() const
+/// @brief Claims and runs tasks of the current generation until all of them are handed out.
+void WorkerPool::drain()
 {
-  for (int i = 0; i < noRows; ++i) {
-    for (int j = 0; j < noCols; ++j) {
-      cout << getValue(i, j) << " ";
+  for (int t = nextTask++; t < noTasks; t = nextTask++) {
+    try {
+      (*myTask)(t);
+    } catch (...) {
+      lock_guard<mutex> guard(lock);
+      if (!failure) {
+        failure = current_exception();
+      }
     }
-    cout << endl;
   }
 }
 
-/// @brief Set value in the matrix.
-/// @param row The row index.
-/// @param col The column index.
-/// @param value The value to set.
-void SparseMatrix::setValue(int row, int col, int value)
+/// @brief Runs tasks 0..noTasks-1 on the workers and the calling thread.
+///
+/// Returns once every task has finished. The first exception thrown by a task is rethrown here.
+/// @param noTasks The number of tasks.
+/// @param task The work of a single task, called with the task number.
+void WorkerPool::run(int noTasks, const function<void(int)>& task)
 {
-  // Check if the value already exists in the matrix
-  for (int i = 0; i < noNonSparseValues; ++i) {
-    if (myMatrix[i].getRow() == row && myMatrix[i].getCol() == col) {
-      // Update the value if it already exists
-      myMatrix[i].setVal(value);
-      return;
-    }
+  lock_guard<mutex> serial(runLock);
+  {
+    lock_guard<mutex> guard(lock);
+    this->myTask = &task;
+    this->noTasks = noTasks;
+    this->nextTask = 0;
+    this->noFinishedWorkers = 0;
+    this->failure = nullptr;
+    ++this->generation;
   }
+  wake.notify_all();
+  drain();
 
-  // If the value does not exist, add a new SparseRow
-  SparseRow* newMatrix = new SparseRow[noNonSparseValues + 1];
-  for (int i = 0; i < noNonSparseValues; ++i) {
-    newMatrix[i] = myMatrix[i];
+  unique_lock<mutex> guard(lock);
+  finished.wait(guard, [&] { return noFinishedWorkers == noWorkers; });
+  myTask = nullptr;
+  if (failure) {
+    exception_ptr thrown = failure;
+    failure = nullptr;
+    rethrow_exception(thrown);
   }
-  newMatrix[noNonSparseValues] = SparseRow(row, col, value);
-  delete[] myMatrix;
-  myMatrix = newMatrix;
-  ++noNonSparseValues;
 }
 
-/// @brief Get value from the matrix.
-/// @param row The row index.
-/// @param col The column index.
-/// @return The value at the specified row and column.
-int SparseMatrix::getValue(int row, int col) const
+/// @brief Gets the number of threads that take part in run().
+/// @return The number of workers plus the calling thread.
+int WorkerPool::size() const
 {
-  for (int i = 0; i < noNonSparseValues; ++i) {
-    if (myMatrix[i].getRow() == row && myMatrix[i].getCol() == col) {
-      return myMatrix[i].getVal();
-    }
-  }
-  return commonValue;
+  return noWorkers + 1;
 }
 
+/// @brief Gets the process-wide pool, started on first use.
+/// @return A pool with one thread per hardware thread, the caller of run() included.
+WorkerPool& WorkerPool::shared()
+{
+  static WorkerPool pool((int)thread::hardware_concurrency() - 1);
+  return pool;
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//             Testing with provided main()
+//              SparseStorage Implementation.
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-/// @brief Test
-/// @return 0 for success, >0 for failure.
+/// @brief Takes ownership of heap arrays.
+/// @param offsets The offsets array, allocated with new[].
+/// @param indices The indices array, allocated with new[].
+/// @param values The values array, allocated with new[].
+template <typename T, typename I>
+SparseStorage<T, I>::SparseStorage(I* offsets, I* indices, T* values)
+  : refs(1), offsets(offsets), indices(indices), values(values), mapping(nullptr), mappingLength(0)
+{
+}
 
-int main ()
+/// @brief Takes ownership of a file mapping that holds the arrays.
+/// @param mapping The mapping, released with munmap().
+/// @param mappingLength The length of the mapping in bytes.
+template <typename T, typename I>
+SparseStorage<T, I>::SparseStorage(void* mapping, size_t mappingLength)
+  : refs(1), offsets(nullptr), indices(nullptr), values(nullptr), mapping(mapping), mappingLength(mappingLength)
 {
- int n, m, cv, noNSV; 
- SparseMatrix* temp; 
- 
- cin >> n >> m >> cv >> noNSV; 
- SparseMatrix* firstOne = new SparseMatrix(n, m, cv, noNSV); 
+}
 
-  // Read the values for the first matrix
-  for (int i = 0; i < n; ++i) {
-    for (int j = 0; j < m; ++j) {
-      int value;
-      cin >> value; 
-      if (value != cv) {
-        firstOne->setValue(i, j, value);
+/// @brief Deletes or unmaps the arrays.
+template <typename T, typename I>
+SparseStorage<T, I>::~SparseStorage()
+{
+  if (mapping != nullptr) {
+    munmap(mapping, mappingLength);
+  }
+  delete[] offsets;
+  delete[] indices;
+  delete[] values;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              SparseMatrix Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Constructs a new empty SparseMatrix with no rows or columns.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>::BasicSparseMatrix()
+  : noRows(0), noCols(0), commonValue(0), noNonSparseValues(0), capacity(0), rowMajor(true)
+{
+  myOffsets = new I[1](); // A single offset so every row range is well defined
+  myIndices = new I[0]; // Allocate empty arrays
+  myValues = new T[0];
+  myStorage = new SparseStorage<T, I>(myOffsets, myIndices, myValues);
+}
+
+/// @brief Constructs a new SparseMatrix with room reserved for its non-sparse values.
+/// @param n the number of rows of the entire matrix.
+/// @param m the number of columns of the entire matrix.
+/// @param cv the common(default) value of the matrix. 
+/// @param nsv the expected number of non-sparse (non-default) values, used to size the arrays.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>::BasicSparseMatrix(I n, I m, T cv, I nsv)
+  : noRows(n), noCols(m), commonValue(cv), noNonSparseValues(0), capacity(nsv > 0 ? nsv : 0), rowMajor(true)
+{
+  if (n < 0 || m < 0) {
+    throw std::invalid_argument("Matrix dimensions must not be negative");
+  }
+  myOffsets = new I[noRows + 1](); // Every row starts out empty
+  myIndices = new I[capacity];
+  myValues = new T[capacity];
+  myStorage = new SparseStorage<T, I>(myOffsets, myIndices, myValues);
+}
+
+/// @brief Constructs a SparseMatrix that takes ownership of already compressed arrays.
+/// @param n the number of rows of the entire matrix.
+/// @param m the number of columns of the entire matrix.
+/// @param cv the common(default) value of the matrix.
+/// @param nnz the number of entries held in indices/values.
+/// @param offsets start of every row (column when rowMajor is false), allocated with new[].
+/// @param indices sorted column (row) index of every entry, allocated with new[].
+/// @param values value of every entry, allocated with new[].
+/// @param rowMajor true for CSR arrays, false for CSC arrays.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>::BasicSparseMatrix(I n, I m, T cv, I nnz, I* offsets, I* indices, T* values, bool rowMajor)
+  : noRows(n), noCols(m), commonValue(cv), noNonSparseValues(nnz), capacity(nnz), rowMajor(rowMajor),
+    myOffsets(offsets), myIndices(indices), myValues(values)
+{
+  myStorage = new SparseStorage<T, I>(offsets, indices, values);
+}
+
+/// @brief Constructs a view that shares the arrays of another matrix.
+/// @param source The matrix whose arrays are shared.
+/// @param transposed True to view the transpose of source, false to view source itself.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>::BasicSparseMatrix(const BasicSparseMatrix& source, bool transposed)
+  : noRows(transposed ? source.noCols : source.noRows), noCols(transposed ? source.noRows : source.noCols),
+    commonValue(source.commonValue), noNonSparseValues(source.noNonSparseValues), capacity(source.noNonSparseValues),
+    rowMajor(transposed ? !source.rowMajor : source.rowMajor),
+    myOffsets(source.myOffsets), myIndices(source.myIndices), myValues(source.myValues), myStorage(source.myStorage)
+{
+  ++myStorage->refs;
+}
+
+/// @brief Opens a matrix saved with save(), reading its arrays straight from the mapped file.
+///
+/// The file is mapped shared and read-only, so opening costs a few page faults whatever the size,
+/// and processes opening the same file share its pages. The arrays are copied to the heap the first
+/// time the matrix is modified.
+/// @param path The file written by save().
+template <typename T, typename I>
+BasicSparseMatrix<T, I>::BasicSparseMatrix(const char* path)
+  : noRows(0), noCols(0), commonValue(0), noNonSparseValues(0), capacity(0), rowMajor(true),
+    myOffsets(nullptr), myIndices(nullptr), myValues(nullptr), myStorage(nullptr)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Could not open the matrix file");
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(SparseFileHeader)) {
+    close(fd);
+    throw std::runtime_error("Not a matrix file");
+  }
+  void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the file alive
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Could not map the matrix file");
+  }
+
+  const SparseFileHeader* header = (const SparseFileHeader*)mapping;
+  size_t length = info.st_size;
+  long long majors = (header->flags & SparseFileHeader::ROW_MAJOR) ? header->noRows : header->noCols;
+  bool valid = validHeader(*header, length);
+  const I* offsets = (const I*)((const char*)mapping + header->offsetsAt);
+  if (!valid || offsets[0] != 0 || offsets[majors] != header->nnz) {
+    munmap(mapping, length);
+    throw std::runtime_error("Not a matrix file, or one of another version or type");
+  }
+
+  noRows = (I)header->noRows;
+  noCols = (I)header->noCols;
+  copy(header->commonValue, header->commonValue + sizeof(T), (char*)&commonValue);
+  noNonSparseValues = (I)header->nnz;
+  capacity = noNonSparseValues;
+  rowMajor = (header->flags & SparseFileHeader::ROW_MAJOR) != 0;
+  myOffsets = (I*)offsets;
+  myIndices = (I*)((char*)mapping + header->indicesAt);
+  myValues = (T*)((char*)mapping + header->valuesAt);
+  myStorage = new SparseStorage<T, I>(mapping, length);
+}
+
+/// @brief Writes the matrix in the binary format read by SparseMatrix(const char* path).
+///
+/// A 128 byte SparseFileHeader is followed by the offsets, indices and values arrays, each starting
+/// on a 64 byte boundary. The header records the value type and index size, and numbers are stored
+/// in the byte order of the machine.
+/// @param path The file to create or overwrite.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::save(const char* path) const
+{
+  SparseFileHeader header = makeHeader(noRows, noCols, commonValue, noNonSparseValues, rowMajor);
+  long long offsetsSize = (majorCount() + 1LL) * sizeof(I);
+  long long indicesSize = (long long)noNonSparseValues * sizeof(I);
+  long long valuesSize = (long long)noNonSparseValues * sizeof(T);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Could not create the matrix file");
+  }
+  static const char padding[64] = {};
+  bool written = writeAll(fd, &header, sizeof(header))
+              && writeAll(fd, myOffsets, offsetsSize)
+              && writeAll(fd, padding, header.indicesAt - header.offsetsAt - offsetsSize)
+              && writeAll(fd, myIndices, indicesSize)
+              && writeAll(fd, padding, header.valuesAt - header.indicesAt - indicesSize)
+              && writeAll(fd, myValues, valuesSize);
+  if (close(fd) != 0 || !written) {
+    throw std::runtime_error("Could not write the matrix file");
+  }
+}
+
+/// @brief Fills in the header of a matrix file and lays out its arrays.
+///
+/// The offsets follow the header, and the indices and values each start on the next 64 byte boundary.
+/// @param n The number of rows.
+/// @param m The number of columns.
+/// @param cv The common value.
+/// @param nnz The number of entries.
+/// @param rowMajor True when the arrays are compressed by rows.
+/// @return The header, zero everywhere else.
+template <typename T, typename I>
+SparseFileHeader BasicSparseMatrix<T, I>::makeHeader(I n, I m, T cv, long long nnz, bool rowMajor)
+{
+  SparseFileHeader header;
+  fill((char*)&header, (char*)&header + sizeof(header), 0);
+  copy(SparseFileHeader::MAGIC, SparseFileHeader::MAGIC + 8, header.magic);
+  header.version = SparseFileHeader::VERSION;
+  header.flags = rowMajor ? SparseFileHeader::ROW_MAJOR : 0;
+  header.valueType = ValueTraits<T>::CODE;
+  header.indexSize = sizeof(I);
+  header.noRows = n;
+  header.noCols = m;
+  header.nnz = nnz;
+  copy((const char*)&cv, (const char*)&cv + sizeof(T), header.commonValue);
+  long long offsetsSize = ((rowMajor ? n : m) + 1LL) * sizeof(I);
+  header.offsetsAt = sizeof(SparseFileHeader);
+  header.indicesAt = (header.offsetsAt + offsetsSize + 63) / 64 * 64;
+  header.valuesAt = (header.indicesAt + nnz * (long long)sizeof(I) + 63) / 64 * 64;
+  return header;
+}
+
+/// @brief Checks that a header describes a matrix of this value and index type that fits in the file.
+///
+/// The offsets array itself is not read, so its first and last entries still have to be checked.
+/// @param header The header at the start of the file.
+/// @param length The length of the file in bytes.
+/// @return True if the arrays can be read as described.
+template <typename T, typename I>
+bool BasicSparseMatrix<T, I>::validHeader(const SparseFileHeader& header, long long length)
+{
+  long long majors = (header.flags & SparseFileHeader::ROW_MAJOR) ? header.noRows : header.noCols;
+  long long maxIndex = numeric_limits<I>::max();
+  return equal(header.magic, header.magic + 8, SparseFileHeader::MAGIC)
+      && header.version == SparseFileHeader::VERSION
+      && header.valueType == ValueTraits<T>::CODE && header.indexSize == (short)sizeof(I)
+      && header.noRows >= 0 && header.noCols >= 0 && header.nnz >= 0
+      && header.noRows <= maxIndex && header.noCols <= maxIndex && header.nnz <= maxIndex
+      && header.offsetsAt % sizeof(I) == 0 && header.indicesAt % sizeof(I) == 0
+      && header.valuesAt % sizeof(T) == 0
+      && header.offsetsAt + (majors + 1) * (long long)sizeof(I) <= length
+      && header.indicesAt + header.nnz * (long long)sizeof(I) <= length
+      && header.valuesAt + header.nnz * (long long)sizeof(T) <= length;
+}
+
+/// @brief Multiplies two matrix files into a third without loading the left one.
+/// @param pathA The left matrix, a file written by save() compressed by rows.
+/// @param pathB The right matrix, a file written by save().
+/// @param pathC The file to create or overwrite with the product.
+/// @param memoryBudget The number of bytes the product may use, the right matrix included.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::MultiplyFiles(const char* pathA, const char* pathB, const char* pathC,
+                                            long long memoryBudget)
+{
+  MultiplyFiles(pathA, pathB, pathC, memoryBudget, 1);
+}
+
+/// @brief Multiplies two matrix files into a third, streaming the left one through in row panels.
+///
+/// The right matrix B stays resident: it is mapped, or re-compressed by rows on the heap when it is
+/// stored by columns, and it counts against the budget either way. What is left of the budget pays
+/// for one row accumulator per thread, a panel of A read with pread(), and the product of the panel.
+/// A panel grows until its rows of A fill a third of the rest, then shrinks until an upper bound on
+/// its product (the multiply-adds of every row, capped at the row width) fits in the other two
+/// thirds, counted three times over for the row buffers and the assembled panel. Every panel is
+/// computed by the same Gustavson kernel as Multiply() and appended to the result: its indices go
+/// straight into the output file and its values into a side file, which is copied behind the
+/// indices once the number of entries is known. The header goes in last, so an interrupted run never
+/// leaves a file that opens.
+///
+/// A panel holds at least one row, so a budget smaller than one row of A and its product is
+/// overshot by that row rather than refused.
+/// @param pathA The left matrix, a file written by save() compressed by rows.
+/// @param pathB The right matrix, a file written by save().
+/// @param pathC The file to create or overwrite with the product.
+/// @param memoryBudget The number of bytes the product may use, the right matrix included.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::MultiplyFiles(const char* pathA, const char* pathB, const char* pathC,
+                                            long long memoryBudget, int noThreads)
+{
+  BasicSparseMatrix mappedB(pathB);
+  BasicSparseMatrix* rowsOfB = mappedB.rowMajor ? nullptr : mappedB.Recompress(true);
+  const BasicSparseMatrix& B = rowsOfB ? *rowsOfB : mappedB;
+  unique_ptr<BasicSparseMatrix> ownedB(rowsOfB);
+
+  int fdA = open(pathA, O_RDONLY);
+  if (fdA < 0) {
+    throw std::runtime_error("Could not open the matrix file");
+  }
+  SparseFileHeader header;
+  struct stat info;
+  bool valid = fstat(fdA, &info) == 0 && readAt(fdA, &header, sizeof(header), 0)
+            && validHeader(header, info.st_size);
+  I firstOffset = -1;
+  valid = valid && readAt(fdA, &firstOffset, sizeof(I), header.offsetsAt) && firstOffset == 0;
+  if (!valid) {
+    close(fdA);
+    throw std::runtime_error("Not a matrix file, or one of another version or type");
+  }
+  if (!(header.flags & SparseFileHeader::ROW_MAJOR)) {
+    close(fdA);
+    throw std::invalid_argument("The left matrix file must be compressed by rows");
+  }
+  T cvA = 0;
+  copy(header.commonValue, header.commonValue + sizeof(T), (char*)&cvA);
+  if (cvA != 0 || B.commonValue != 0) {
+    close(fdA);
+    throw std::invalid_argument("Out-of-core multiplication needs matrices with a zero common value");
+  }
+  if (header.noCols != B.noRows) {
+    close(fdA);
+    throw std::invalid_argument("Matrix multiplication is not possible");
+  }
+
+  // Split the budget: B, then the accumulators, then a third of the rest for A and two for the product
+  I n = (I)header.noRows;
+  I m = B.noCols;
+  const long long entryBytes = sizeof(I) + sizeof(T);
+  long long rest = memoryBudget - (B.noRows + 1LL) * (long long)sizeof(I) - B.noNonSparseValues * entryBytes;
+  long long accumulatorBytes = (long long)m * (sizeof(Sum) + 2 * sizeof(I));
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  noThreads = (int)max(1LL, min((long long)noThreads, rest / 4 / max(1LL, accumulatorBytes)));
+  rest -= noThreads * accumulatorBytes;
+  if (rest <= 0) {
+    close(fdA);
+    throw std::invalid_argument("The memory budget is too small for the right matrix");
+  }
+  long long panelBytes = rest / 3;
+  long long productBytes = rest - panelBytes;
+
+  int fdC = open(pathC, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  size_t pathLength = strlen(pathC);
+  char* spillPath = new char[pathLength + 8];
+  copy(pathC, pathC + pathLength, spillPath);
+  copy(".values", ".values" + 8, spillPath + pathLength);
+  int fdSpill = fdC < 0 ? -1 : open(spillPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fdSpill < 0) {
+    close(fdA);
+    if (fdC >= 0) {
+      close(fdC);
+    }
+    delete[] spillPath;
+    throw std::runtime_error("Could not create the matrix file");
+  }
+
+  SparseFileHeader out = makeHeader(n, m, 0, 0, true);
+  bool written = writeAt(fdC, &firstOffset, sizeof(I), out.offsetsAt);
+  bool corrupt = false;
+  bool overflow = false;
+  long long nnz = 0;
+  long long maxPanelRows = max(1LL, panelBytes / 4 / (long long)(sizeof(I) + sizeof(long long)));
+  for (I start = 0; start < n && written && !corrupt && !overflow; ) {
+    // Offsets of the candidate rows, then as many rows as the panel share holds
+    I noPanelRows = (I)min((long long)(n - start), maxPanelRows);
+    I* offsets = new I[noPanelRows + 1];
+    corrupt = !readAt(fdA, offsets, (noPanelRows + 1LL) * sizeof(I), header.offsetsAt + (long long)start * sizeof(I));
+    for (I i = 0; i < noPanelRows && !corrupt; ++i) {
+      corrupt = offsets[i + 1] < offsets[i] || offsets[i + 1] > header.nnz;
+    }
+    corrupt = corrupt || (start + noPanelRows == n && offsets[noPanelRows] != header.nnz);
+    if (corrupt) {
+      delete[] offsets;
+      break;
+    }
+    long long entryRoom = panelBytes - (noPanelRows + 1LL) * (long long)(sizeof(I) + sizeof(long long));
+    I rows = (I)(upper_bound(offsets + 1, offsets + noPanelRows + 1, offsets[0] + max(0LL, entryRoom) / entryBytes)
+               - offsets - 1);
+    rows = max((I)1, rows);
+
+    I first = offsets[0];
+    I noEntries = offsets[rows] - first;
+    I* indices = new I[noEntries];
+    T* values = new T[noEntries];
+    corrupt = !readAt(fdA, indices, (long long)noEntries * sizeof(I), header.indicesAt + (long long)first * sizeof(I))
+           || !readAt(fdA, values, (long long)noEntries * sizeof(T), header.valuesAt + (long long)first * sizeof(T));
+
+    // Shrink the panel until the bound on its product fits
+    long long* cost = new long long[rows + 1];
+    cost[0] = 0;
+    long long bound = 0;
+    I fits = 0;
+    for (I i = 0; i < rows && !corrupt; ++i) {
+      long long rowCost = 0;
+      for (I ka = offsets[i] - first; ka < offsets[i + 1] - first && !corrupt; ++ka) {
+        I k = indices[ka];
+        corrupt = k < 0 || k >= B.noRows;
+        rowCost += corrupt ? 0 : B.myOffsets[k + 1] - B.myOffsets[k];
+      }
+      bound += min(rowCost, (long long)m);
+      cost[i + 1] = cost[i] + rowCost + 1;
+      if (fits > 0 && 3 * bound * entryBytes + (i + 1LL) * (long long)sizeof(I) > productBytes) {
+        break;
+      }
+      fits = i + 1;
+    }
+    if (!corrupt) {
+      rows = fits;
+      BasicSparseMatrix* panel = buildRows(rows, m, 0, cost, noThreads, [&](I i, RowAccumulator<T, I>& acc) {
+        for (I ka = offsets[i] - first; ka < offsets[i + 1] - first; ++ka) {
+          I k = indices[ka];
+          Sum a = values[ka];
+          for (I kb = B.myOffsets[k]; kb < B.myOffsets[k + 1]; ++kb) {
+            acc.add(B.myIndices[kb], a * B.myValues[kb]);
+          }
+        }
+      });
+
+      // Append the panel: its offsets shifted past the entries already written
+      long long panelNnz = panel->noNonSparseValues;
+      overflow = nnz + panelNnz > (long long)numeric_limits<I>::max();
+      if (!overflow) {
+        for (I i = 1; i <= rows; ++i) {
+          panel->myOffsets[i] += (I)nnz;
+        }
+        written = writeAt(fdC, panel->myOffsets + 1, (long long)rows * sizeof(I),
+                          out.offsetsAt + (start + 1LL) * (long long)sizeof(I))
+               && writeAt(fdC, panel->myIndices, panelNnz * (long long)sizeof(I),
+                          out.indicesAt + nnz * (long long)sizeof(I))
+               && writeAll(fdSpill, panel->myValues, panelNnz * (long long)sizeof(T));
+        nnz += panelNnz;
+      }
+      delete panel;
+      start += rows;
+    }
+    delete[] cost;
+    delete[] values;
+    delete[] indices;
+    delete[] offsets;
+  }
+  corrupt = corrupt || close(fdA) != 0;
+
+  // Values go behind the indices in chunks the size of a panel, then the header makes the file valid
+  if (written && !corrupt && !overflow) {
+    out = makeHeader(n, m, 0, nnz, true);
+    long long chunk = max(64LL, min(panelBytes, nnz * (long long)sizeof(T)));
+    char* buffer = new char[chunk];
+    for (long long at = 0; at < nnz * (long long)sizeof(T) && written; at += chunk) {
+      long long length = min(chunk, nnz * (long long)sizeof(T) - at);
+      written = readAt(fdSpill, buffer, length, at) && writeAt(fdC, buffer, length, out.valuesAt + at);
+    }
+    delete[] buffer;
+    written = written && writeAt(fdC, &out, sizeof(out), 0)
+                      && ftruncate(fdC, out.valuesAt + nnz * (long long)sizeof(T)) == 0;
+  }
+  close(fdSpill);
+  unlink(spillPath);
+  delete[] spillPath;
+  written = close(fdC) == 0 && written;
+  if (corrupt) {
+    throw std::runtime_error("Not a matrix file, or one of another version or type");
+  }
+  if (overflow) {
+    throw std::overflow_error("The product has more entries than the index type can count");
+  }
+  if (!written) {
+    throw std::runtime_error("Could not write the matrix file");
+  }
+}
+
+/// @brief Writes a whole buffer at a file position, retrying short writes.
+/// @param fd The file descriptor to write to.
+/// @param data The bytes to write.
+/// @param length The number of bytes to write.
+/// @param at The file position of the first byte.
+/// @return False if the write failed.
+template <typename T, typename I>
+bool BasicSparseMatrix<T, I>::writeAt(int fd, const void* data, long long length, long long at)
+{
+  const char* bytes = (const char*)data;
+  while (length > 0) {
+    ssize_t done = pwrite(fd, bytes, length > (1 << 30) ? (1 << 30) : length, at);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return false;
+    }
+    bytes += done;
+    length -= done;
+    at += done;
+  }
+  return true;
+}
+
+/// @brief Reads a whole buffer from a file position, retrying short reads.
+/// @param fd The file descriptor to read from.
+/// @param data Receives the bytes.
+/// @param length The number of bytes to read.
+/// @param at The file position of the first byte.
+/// @return False if the read failed or the file ended first.
+template <typename T, typename I>
+bool BasicSparseMatrix<T, I>::readAt(int fd, void* data, long long length, long long at)
+{
+  char* bytes = (char*)data;
+  while (length > 0) {
+    ssize_t done = pread(fd, bytes, length > (1 << 30) ? (1 << 30) : length, at);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return false;
+    }
+    bytes += done;
+    length -= done;
+    at += done;
+  }
+  return true;
+}
+
+/// @brief Writes a whole buffer to a file descriptor, retrying short writes.
+/// @param fd The file descriptor to write to.
+/// @param data The bytes to write.
+/// @param length The number of bytes to write.
+/// @return False if the write failed.
+template <typename T, typename I>
+bool BasicSparseMatrix<T, I>::writeAll(int fd, const void* data, long long length)
+{
+  const char* bytes = (const char*)data;
+  while (length > 0) {
+    ssize_t done = write(fd, bytes, length > (1 << 30) ? (1 << 30) : length);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return false;
+    }
+    bytes += done;
+    length -= done;
+  }
+  return true;
+}
+
+/// @brief Copies arrays that are shared with a view, or live in a file mapping, to private heap arrays.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::detach()
+{
+  if (myStorage->refs == 1 && myStorage->mapping == nullptr) {
+    return;
+  }
+  I* offsets = new I[majorCount() + 1];
+  I* indices = new I[noNonSparseValues];
+  T* values = new T[noNonSparseValues];
+  copy(myOffsets, myOffsets + majorCount() + 1, offsets);
+  copy(myIndices, myIndices + noNonSparseValues, indices);
+  copy(myValues, myValues + noNonSparseValues, values);
+  if (--myStorage->refs == 0) {
+    delete myStorage;
+  }
+  myStorage = new SparseStorage<T, I>(offsets, indices, values);
+  myOffsets = offsets;
+  myIndices = indices;
+  myValues = values;
+  capacity = noNonSparseValues;
+}
+
+/// @brief Releases the matrix arrays, freeing them if no view still uses them, and nulls the pointers.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>::~BasicSparseMatrix()
+{
+  if (--myStorage->refs == 0) {
+    delete myStorage;
+  }
+  myStorage = nullptr;
+  myOffsets = nullptr;
+  myIndices = nullptr;
+  myValues = nullptr;
+}
+
+/// @brief Number of compressed lines, rows for CSR and columns for CSC.
+/// @return The length of myOffsets minus one.
+template <typename T, typename I>
+I BasicSparseMatrix<T, I>::majorCount() const
+{
+  return rowMajor ? noRows : noCols;
+}
+
+/// @brief Binary searches the row (column) that holds (row, col).
+/// @param row The row index.
+/// @param col The column index.
+/// @return The position of the entry in myIndices/myValues, or -1 if it is not stored.
+template <typename T, typename I>
+I BasicSparseMatrix<T, I>::find(I row, I col) const
+{
+  I major = rowMajor ? row : col;
+  I minor = rowMajor ? col : row;
+  const I* first = myIndices + myOffsets[major];
+  const I* last = myIndices + myOffsets[major + 1];
+  const I* it = lower_bound(first, last, minor);
+  if (it != last && *it == minor) {
+    return (I)(it - myIndices);
+  }
+  return -1;
+}
+
+/// @brief Grows the index and value arrays, keeping the stored entries.
+/// @param newCapacity The number of entries the arrays must be able to hold.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::reserve(I newCapacity)
+{
+  detach();
+  if (newCapacity <= capacity) {
+    return;
+  }
+  I* newIndices = new I[newCapacity];
+  T* newValues = new T[newCapacity];
+  copy(myIndices, myIndices + noNonSparseValues, newIndices);
+  copy(myValues, myValues + noNonSparseValues, newValues);
+  delete[] myIndices;
+  delete[] myValues;
+  myIndices = myStorage->indices = newIndices;
+  myValues = myStorage->values = newValues;
+  capacity = newCapacity;
+}
+
+/// @brief Transposes the current and generates a new matrix based on that transportation.
+///
+/// The rows of this matrix are the columns of its transpose, so the transpose is a view over the same
+/// arrays in the other orientation (CSR becomes CSC and the other way around) and costs nothing to
+/// make. Modifying either matrix later gives it a private copy first.
+/// @return The transposed matrix based on the current matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Transpose() const
+{
+  return new BasicSparseMatrix(*this, true);
+}
+
+/// @brief Gets this matrix compressed by rows or by columns.
+///
+/// Changing the orientation is a two pass counting sort on the minor index: count the entries of
+/// every new line, prefix sum the counts into offsets, then scatter the entries walking the old lines
+/// in order, which leaves every new line sorted. That is O(nnz + rows + cols). When the orientation
+/// already matches the arrays are shared instead.
+/// @param byRows True for CSR, false for CSC.
+/// @return The re-compressed matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Recompress(bool byRows) const
+{
+  if (byRows == this->rowMajor) {
+    return new BasicSparseMatrix(*this, false);
+  }
+
+  I majors = this->majorCount();
+  I minors = this->rowMajor ? this->noCols : this->noRows;
+  I* offsets = new I[minors + 1]();
+  for (I k = 0; k < this->noNonSparseValues; ++k) {
+    ++offsets[this->myIndices[k] + 1];
+  }
+  for (I i = 0; i < minors; ++i) {
+    offsets[i + 1] += offsets[i];
+  }
+
+  I* next = new I[minors];
+  I* indices = new I[this->noNonSparseValues];
+  T* values = new T[this->noNonSparseValues];
+  copy(offsets, offsets + minors, next);
+  for (I major = 0; major < majors; ++major) {
+    for (I k = this->myOffsets[major]; k < this->myOffsets[major + 1]; ++k) {
+      I at = next[this->myIndices[k]]++;
+      indices[at] = major;
+      values[at] = this->myValues[k];
+    }
+  }
+  delete[] next;
+
+  return new BasicSparseMatrix(this->noRows, this->noCols, this->commonValue, this->noNonSparseValues,
+                               offsets, indices, values, byRows);
+}
+
+/// @brief Copies this matrix into one with other value and index types, keeping its orientation.
+///
+/// Widening the values, e.g. to long long before a Multiply that would overflow int, or narrowing the
+/// indices of a matrix that turned out small enough for them, are single passes over the arrays.
+/// @tparam U The value type of the copy.
+/// @tparam J The index type of the copy, which must be able to count every row, column and entry.
+/// @return The converted matrix, owned by the caller.
+template <typename T, typename I>
+template <typename U, typename J>
+BasicSparseMatrix<U, J>* BasicSparseMatrix<T, I>::Convert() const
+{
+  long long largest = max((long long)this->noNonSparseValues, (long long)max(this->noRows, this->noCols));
+  if (largest > (long long)numeric_limits<J>::max()) {
+    throw std::invalid_argument("Matrix is too large for the index type");
+  }
+  I majors = this->majorCount();
+  J* offsets = new J[majors + 1];
+  J* indices = new J[this->noNonSparseValues];
+  U* values = new U[this->noNonSparseValues];
+  copy(this->myOffsets, this->myOffsets + majors + 1, offsets);
+  copy(this->myIndices, this->myIndices + this->noNonSparseValues, indices);
+  copy(this->myValues, this->myValues + this->noNonSparseValues, values);
+  return new BasicSparseMatrix<U, J>((J)this->noRows, (J)this->noCols, (U)this->commonValue,
+                                     (J)this->noNonSparseValues, offsets, indices, values, this->rowMajor);
+}
+
+/// @brief Multiplies two two matrices together and returns the result as a new matrix.
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @return The newly genereated matrix based on the multipliation completed.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Multiply(const BasicSparseMatrix &M) const
+{
+  return this->Multiply(M, 1);
+}
+
+/// @brief Multiplies two matrices with the output rows split across threads.
+///
+/// Uses Gustavson's row-by-row algorithm: only pairs of stored entries are multiplied, so the cost
+/// follows the number of multiply-adds actually needed instead of the dense dimensions. Rows are
+/// split into contiguous ranges of equal multiply-add count, every range is computed into its own
+/// buffer, and a prefix sum over the row lengths places the buffers in the result without locking.
+/// Products are summed in the accumulator type of T (64 bit for int) and narrowed once per entry.
+///
+/// Common values a and b are handled algebraically. Writing A = a*J + dA and M = b*J + dM, where J
+/// is all ones and dA, dM hold the stored entries minus the common value, the product over k inner
+/// cells is A*M = a*b*k*J + a*(J*dM) + b*(dA*J) + dA*dM. J*dM repeats the column sums of dM in every
+/// row and dA*J the row sums of dA in every column, so the result has common value a*b*k and stores
+/// the sparse product dA*dM plus the two rank-one corrections: the columns of M with a non-zero
+/// difference sum when a is not 0, and the rows of A with one when b is not 0.
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix based on the multipliation completed.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Multiply(const BasicSparseMatrix &M, int noThreads) const
+{
+  // Check if the matrices can be multiplied
+  if (this->noCols != M.noRows) {
+    throw std::invalid_argument("Matrix multiplication is not possible");
+  }
+
+  // With both operands compressed by columns, A*M = (Mt*At)^T where the transposed views are CSR,
+  // so the product runs on the existing arrays and its result is handed back as a view
+  if (!this->rowMajor && !M.rowMajor) {
+    BasicSparseMatrix* left = M.Transpose();
+    BasicSparseMatrix* right = this->Transpose();
+    BasicSparseMatrix* product = left->Multiply(*right, noThreads);
+    BasicSparseMatrix* result = product->Transpose();
+    delete left;
+    delete right;
+    delete product;
+    return result;
+  }
+
+  // Gustavson's algorithm walks rows, so a CSC operand is re-compressed by rows
+  BasicSparseMatrix* rowsOfA = this->rowMajor ? nullptr : this->Recompress(true);
+  BasicSparseMatrix* rowsOfB = M.rowMajor ? nullptr : M.Recompress(true);
+  const BasicSparseMatrix& A = rowsOfA ? *rowsOfA : *this;
+  const BasicSparseMatrix& B = rowsOfB ? *rowsOfB : M;
+  T cvA = A.commonValue;
+  T cvB = B.commonValue;
+
+  // The columns of dM with a non-zero sum, which a*(J*dM) adds to every row
+  Sum* colSums = nullptr;
+  I* sumCols = nullptr;
+  I noSumCols = 0;
+  if (cvA != 0) {
+    colSums = new Sum[B.noCols]();
+    for (I k = 0; k < B.noNonSparseValues; ++k) {
+      colSums[B.myIndices[k]] += (Sum)B.myValues[k] - cvB;
+    }
+    sumCols = new I[B.noCols];
+    for (I j = 0; j < B.noCols; ++j) {
+      if (colSums[j] != 0) {
+        sumCols[noSumCols++] = j;
+      }
+    }
+  }
+
+  // The cost of an output row is the number of multiply-adds it needs, plus its corrections
+  long long* cost = new long long[A.noRows + 1];
+  cost[0] = 0;
+  for (I i = 0; i < A.noRows; ++i) {
+    long long rowCost = 1 + noSumCols;
+    for (I ka = A.myOffsets[i]; ka < A.myOffsets[i + 1]; ++ka) {
+      I k = A.myIndices[ka];
+      rowCost += B.myOffsets[k + 1] - B.myOffsets[k];
+    }
+    if (cvB != 0 && A.myOffsets[i + 1] > A.myOffsets[i]) {
+      rowCost += B.noCols;
+    }
+    cost[i + 1] = cost[i] + rowCost;
+  }
+
+  // Row i of the result is the sum of the rows of dM picked out by the entries of row i of dA, plus
+  // the corrections; the accumulator holds differences from the common value a*b*k
+  T background = (T)((Sum)cvA * cvB * A.noCols);
+  BasicSparseMatrix* result = buildRows(A.noRows, B.noCols, background, cost, noThreads,
+                                        [&](I i, RowAccumulator<T, I>& acc) {
+    Sum rowSum = 0;
+    for (I ka = A.myOffsets[i]; ka < A.myOffsets[i + 1]; ++ka) {
+      I k = A.myIndices[ka];
+      Sum a = (Sum)A.myValues[ka] - cvA;
+      rowSum += a;
+      for (I kb = B.myOffsets[k]; a != 0 && kb < B.myOffsets[k + 1]; ++kb) {
+        acc.add(B.myIndices[kb], a * ((Sum)B.myValues[kb] - cvB));
+      }
+    }
+    for (I s = 0; s < noSumCols; ++s) {
+      acc.add(sumCols[s], cvA * colSums[sumCols[s]]);
+    }
+    if (cvB != 0 && rowSum != 0) {
+      for (I j = 0; j < B.noCols; ++j) {
+        acc.add(j, cvB * rowSum);
+      }
+    }
+  });
+
+  delete[] cost;
+  delete[] colSums;
+  delete[] sumCols;
+  delete rowsOfA;
+  delete rowsOfB;
+  return result;
+}
+
+/// @brief Multiplies two matrices at the stored cells of a mask only, C = mask .* (A*M).
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @param mask The cells to compute, the size of the product.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::MaskedMultiply(const BasicSparseMatrix &M,
+                                                                 const BasicSparseMatrix &mask) const
+{
+  return this->MaskedMultiply(M, mask, 1);
+}
+
+/// @brief Multiplies two matrices at the stored cells of a mask only, with the rows split across threads.
+///
+/// Cell (i, j) of the result is mask(i, j) times the dot product of row i of A and column j of M, an
+/// intersection of two sorted index lists, so the work follows the mask and the lengths of the rows
+/// and columns it touches instead of the multiply-adds of the full product. The usual case A*A^T
+/// finds its columns of M already compressed in A^T, a view; other operands are re-compressed once.
+/// Operands with a non-zero common value, which make every cell of the product dense, fall back to
+/// the full product followed by Hadamard().
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @param mask The cells to compute, the size of the product. Cells it does not store are not computed.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::MaskedMultiply(const BasicSparseMatrix &M, const BasicSparseMatrix &mask,
+                                                                 int noThreads) const
+{
+  if (this->noCols != M.noRows || mask.noRows != this->noRows || mask.noCols != M.noCols) {
+    throw std::invalid_argument("Matrix multiplication is not possible");
+  }
+  if (this->commonValue != 0 || M.commonValue != 0 || mask.commonValue != 0) {
+    BasicSparseMatrix* product = this->Multiply(M, noThreads);
+    BasicSparseMatrix* result = mask.Hadamard(*product, noThreads);
+    delete product;
+    return result;
+  }
+
+  BasicSparseMatrix* rowsOfA = this->rowMajor ? nullptr : this->Recompress(true);
+  BasicSparseMatrix* colsOfB = M.rowMajor ? M.Recompress(false) : nullptr;
+  BasicSparseMatrix* rowsOfMask = mask.rowMajor ? nullptr : mask.Recompress(true);
+  const BasicSparseMatrix& A = rowsOfA ? *rowsOfA : *this;
+  const BasicSparseMatrix& B = colsOfB ? *colsOfB : M;
+  const BasicSparseMatrix& C = rowsOfMask ? *rowsOfMask : mask;
+
+  // The cost of an output row is the length of the lists it intersects
+  long long* cost = new long long[A.noRows + 1];
+  cost[0] = 0;
+  for (I i = 0; i < A.noRows; ++i) {
+    long long rowCost = 1;
+    I lengthA = A.myOffsets[i + 1] - A.myOffsets[i];
+    for (I kc = C.myOffsets[i]; kc < C.myOffsets[i + 1]; ++kc) {
+      I j = C.myIndices[kc];
+      rowCost += min(lengthA, B.myOffsets[j + 1] - B.myOffsets[j]) + 1;
+    }
+    cost[i + 1] = cost[i] + rowCost;
+  }
+
+  BasicSparseMatrix* result = buildRows(A.noRows, B.noCols, 0, cost, noThreads, [&](I i, RowAccumulator<T, I>& acc) {
+    I startA = A.myOffsets[i];
+    I lengthA = A.myOffsets[i + 1] - startA;
+    if (lengthA == 0) {
+      return;
+    }
+    for (I kc = C.myOffsets[i]; kc < C.myOffsets[i + 1]; ++kc) {
+      I j = C.myIndices[kc];
+      I startB = B.myOffsets[j];
+      Sum dot = dotSorted(A.myIndices + startA, A.myValues + startA, lengthA,
+                          B.myIndices + startB, B.myValues + startB, B.myOffsets[j + 1] - startB);
+      acc.add(j, (Sum)C.myValues[kc] * (T)dot);
+    }
+  });
+
+  delete[] cost;
+  delete rowsOfA;
+  delete colsOfB;
+  delete rowsOfMask;
+  return result;
+}
+
+/// @brief Sums the products of the entries two sorted sparse vectors have in common.
+///
+/// Lists of similar length are merged. When one is more than eight times longer, every index of the
+/// short one is found in it by galloping (doubling steps, then a binary search), so the cost is about
+/// the short length times the log of the gap rather than the long length.
+/// @param indicesA The sorted indices of the first vector.
+/// @param valuesA The values of the first vector.
+/// @param lengthA The number of entries of the first vector.
+/// @param indicesB The sorted indices of the second vector.
+/// @param valuesB The values of the second vector.
+/// @param lengthB The number of entries of the second vector.
+/// @return The dot product, in the accumulator type.
+template <typename T, typename I>
+typename BasicSparseMatrix<T, I>::Sum BasicSparseMatrix<T, I>::dotSorted(const I* indicesA, const T* valuesA, I lengthA,
+                                                                        const I* indicesB, const T* valuesB, I lengthB)
+{
+  if (lengthA > lengthB) {
+    return dotSorted(indicesB, valuesB, lengthB, indicesA, valuesA, lengthA);
+  }
+  Sum sum = 0;
+  if ((long long)lengthA * 8 < lengthB) {
+    const I* position = indicesB;
+    const I* end = indicesB + lengthB;
+    for (I ka = 0; ka < lengthA && position < end; ++ka) {
+      I target = indicesA[ka];
+      I step = 1;
+      while (step < end - position && position[step] < target) {
+        step *= 2;
+      }
+      position = lower_bound(position + step / 2, position + min((I)(end - position), (I)(step + 1)), target);
+      if (position < end && *position == target) {
+        sum += (Sum)valuesA[ka] * valuesB[position - indicesB];
+      }
+    }
+    return sum;
+  }
+  I ka = 0, kb = 0;
+  while (ka < lengthA && kb < lengthB) {
+    if (indicesA[ka] < indicesB[kb]) {
+      ++ka;
+    } else if (indicesB[kb] < indicesA[ka]) {
+      ++kb;
+    } else {
+      sum += (Sum)valuesA[ka++] * valuesB[kb++];
+    }
+  }
+  return sum;
+}
+
+/// @brief Adds two two matrices together and returns the result as a new matrix.
+/// @param M The matrix to add to the current matrix calling the method.
+/// @return The newly genereated matrix based on the addition completed.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Add(const BasicSparseMatrix &M) const
+{
+  return this->Axpby(1, M, 1, 1);
+}
+
+/// @brief Adds two matrices with the output rows split across threads.
+/// @param M The matrix to add to the current matrix calling the method.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix based on the addition completed.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Add(const BasicSparseMatrix &M, int noThreads) const
+{
+  return this->Axpby(1, M, 1, noThreads);
+}
+
+/// @brief Computes alpha*this + beta*M.
+/// @param alpha The scale of this matrix.
+/// @param M The matrix to add.
+/// @param beta The scale of M.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Axpby(T alpha, const BasicSparseMatrix &M, T beta) const
+{
+  return this->Axpby(alpha, M, beta, 1);
+}
+
+/// @brief Computes alpha*this + beta*M with the rows (columns) split across threads.
+///
+/// Every row of the result is a two-pointer merge of the two sorted input rows, so the work is
+/// O(nnz of this + nnz of M). A first pass counts the entries of every row, a prefix sum turns the
+/// counts into offsets, and a second pass writes the entries into arrays allocated once at their exact
+/// size. The background of the result is alpha*commonValue + beta*M.commonValue, and entries that
+/// come out equal to it are not stored. Operands compressed the same way are merged in that
+/// orientation; otherwise the CSC one is re-compressed by rows first.
+/// @param alpha The scale of this matrix.
+/// @param M The matrix to add.
+/// @param beta The scale of M.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Axpby(T alpha, const BasicSparseMatrix &M, T beta, int noThreads) const
+{
+  if (this->noRows != M.noRows || this->noCols != M.noCols) {
+    throw std::invalid_argument("Matrix addition is not possible");
+  }
+
+  T background = (T)((Sum)alpha * this->commonValue + (Sum)beta * M.commonValue);
+  return this->mergeWith(M, background, [alpha, beta](T a, T b) {
+    return (T)((Sum)alpha * a + (Sum)beta * b);
+  }, noThreads);
+}
+
+/// @brief Combines two matrices of the same size cell by cell, with the rows (columns) split across threads.
+///
+/// Every row of the result is a two-pointer merge of the two sorted input rows, so the work is
+/// O(nnz of this + nnz of M). A first pass counts the entries of every row, a prefix sum turns the
+/// counts into offsets, and a second pass writes the entries into arrays allocated once at their exact
+/// size. A cell stored by neither operand combines the two common values, which is the background,
+/// and entries that come out equal to it are not stored. Operands compressed the same way are merged
+/// in that orientation; otherwise the CSC one is re-compressed by rows first.
+/// @param M The other operand, the same size as this matrix.
+/// @param background combine(commonValue, M.commonValue), the common value of the result.
+/// @param combine Returns the cell of the result from the cells of this matrix and M.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+template <typename Combine>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::mergeWith(const BasicSparseMatrix& M, T background,
+                                                             const Combine& combine, int noThreads) const
+{
+  BasicSparseMatrix* rowsOfA = (this->rowMajor == M.rowMajor || this->rowMajor) ? nullptr : this->Recompress(true);
+  BasicSparseMatrix* rowsOfB = (this->rowMajor == M.rowMajor || M.rowMajor) ? nullptr : M.Recompress(true);
+  const BasicSparseMatrix& A = rowsOfA ? *rowsOfA : *this;
+  const BasicSparseMatrix& B = rowsOfB ? *rowsOfB : M;
+  I majors = A.majorCount();
+  I minors = A.rowMajor ? A.noCols : A.noRows;
+  T cvA = A.commonValue;
+  T cvB = B.commonValue;
+
+  // Merges line i, only counting when indices is null, and returns the number of entries kept
+  auto mergeLine = [&](I i, I* indices, T* values) {
+    I kept = 0;
+    I ka = A.myOffsets[i], endA = A.myOffsets[i + 1];
+    I kb = B.myOffsets[i], endB = B.myOffsets[i + 1];
+    while (ka < endA || kb < endB) {
+      I idxA = ka < endA ? A.myIndices[ka] : minors;
+      I idxB = kb < endB ? B.myIndices[kb] : minors;
+      I index = min(idxA, idxB);
+      T value = combine(idxA == index ? A.myValues[ka++] : cvA, idxB == index ? B.myValues[kb++] : cvB);
+      if (value != background) {
+        if (indices != nullptr) {
+          indices[kept] = index;
+          values[kept] = value;
+        }
+        ++kept;
+      }
+    }
+    return kept;
+  };
+
+  // Balance the lines by the number of entries they merge
+  long long* cost = new long long[majors + 1];
+  cost[0] = 0;
+  for (I i = 0; i < majors; ++i) {
+    cost[i + 1] = cost[i] + 1 + (A.myOffsets[i + 1] - A.myOffsets[i]) + (B.myOffsets[i + 1] - B.myOffsets[i]);
+  }
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, majors));
+  I* bounds = new I[noParts + 1];
+  balanceRows(cost, majors, noParts, bounds);
+  delete[] cost;
+
+  I* offsets = new I[majors + 1];
+  offsets[0] = 0;
+  runParts(noParts, [&](int p) {
+    for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+      offsets[i + 1] = mergeLine(i, nullptr, nullptr);
+    }
+  });
+  for (I i = 0; i < majors; ++i) {
+    offsets[i + 1] += offsets[i];
+  }
+
+  I nnz = offsets[majors];
+  I* indices = new I[nnz];
+  T* values = new T[nnz];
+  runParts(noParts, [&](int p) {
+    for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+      mergeLine(i, indices + offsets[i], values + offsets[i]);
+    }
+  });
+
+  BasicSparseMatrix* result = new BasicSparseMatrix(A.noRows, A.noCols, background, nnz, offsets, indices, values,
+                                                    A.rowMajor);
+  delete[] bounds;
+  delete rowsOfA;
+  delete rowsOfB;
+  return result;
+}
+
+/// @brief Multiplies two matrices cell by cell.
+/// @param M The matrix to multiply with, the same size as this one.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Hadamard(const BasicSparseMatrix &M) const
+{
+  return this->Hadamard(M, 1);
+}
+
+/// @brief Multiplies two matrices cell by cell with the rows (columns) split across threads.
+///
+/// The common value of the result is the product of the two common values. When one of them is zero
+/// so is the background, and only cells stored by both operands can end up stored.
+/// @param M The matrix to multiply with, the same size as this one.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Hadamard(const BasicSparseMatrix &M, int noThreads) const
+{
+  if (this->noRows != M.noRows || this->noCols != M.noCols) {
+    throw std::invalid_argument("Element-wise multiplication is not possible");
+  }
+  T background = (T)((Sum)this->commonValue * M.commonValue);
+  return this->mergeWith(M, background, [](T a, T b) { return (T)((Sum)a * b); }, noThreads);
+}
+
+/// @brief Multiplies every cell by a scalar.
+/// @param alpha The scale.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Scale(T alpha) const
+{
+  return this->affine(alpha, 0, 1);
+}
+
+/// @brief Multiplies every cell by a scalar, with the values split across threads.
+/// @param alpha The scale.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Scale(T alpha, int noThreads) const
+{
+  return this->affine(alpha, 0, noThreads);
+}
+
+/// @brief Adds a scalar to every cell.
+/// @param beta The value to add.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Shift(T beta) const
+{
+  return this->affine(1, beta, 1);
+}
+
+/// @brief Adds a scalar to every cell, with the values split across threads.
+/// @param beta The value to add.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Shift(T beta, int noThreads) const
+{
+  return this->affine(1, beta, noThreads);
+}
+
+/// @brief Maps every cell x to alpha*x + beta.
+///
+/// The common value is mapped along with the stored values, so the pattern and orientation are kept
+/// as they are, and the values array is transformed in contiguous slices by the SIMD kernel. A zero
+/// alpha makes every cell beta, which needs no entries at all.
+/// @param alpha The scale.
+/// @param beta The value added after scaling.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::affine(T alpha, T beta, int noThreads) const
+{
+  if (alpha == 0) {
+    return new BasicSparseMatrix(this->noRows, this->noCols, beta, 0);
+  }
+  I majors = majorCount();
+  I nnz = this->noNonSparseValues;
+  I* offsets = new I[majors + 1];
+  I* indices = new I[nnz];
+  T* values = new T[nnz];
+  copy(this->myOffsets, this->myOffsets + majors + 1, offsets);
+  copy(this->myIndices, this->myIndices + nnz, indices);
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, (I)(nnz / 4096 + 1)));
+  runParts(noParts, [&](int p) {
+    size_t first = (size_t)nnz * p / noParts;
+    size_t last = (size_t)nnz * (p + 1) / noParts;
+    ValueKernel<T>::affine(this->myValues + first, last - first, alpha, beta, values + first);
+  });
+  return new BasicSparseMatrix(this->noRows, this->noCols, (T)(alpha * this->commonValue + beta), nnz,
+                               offsets, indices, values, this->rowMajor);
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::MultiplyVector(const T* x, T* y) const
+{
+  this->MultiplyVector(x, y, 1);
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x, with the rows split across threads.
+///
+/// Every row of a CSR matrix is one gather-multiply-accumulate over its entries (see dotRow). The
+/// background is accounted for as y[i] = sum((v - commonValue) * x[j]) + commonValue * sum(x), so
+/// only stored entries are visited whatever the common value is. Rows are split into ranges holding
+/// the same number of entries. A CSC matrix is split into column ranges of equal entries instead;
+/// every range scatters into its own accumulator-typed scratch vector, and the scratch vectors are
+/// summed row by row and narrowed to T once. Fewer ranges are used when the matrix holds less than
+/// one entry per row and range, since every range costs a full scratch vector. A matrix multiplied
+/// with many vectors is better served by a SparseVectorPlan, which does the split (and for CSC the
+/// re-compression) once.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::MultiplyVector(const T* x, T* y, int noThreads) const
+{
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+
+  if (!this->rowMajor) {
+    Sum background = 0;
+    if (this->commonValue != 0) {
+      Sum sumX = 0;
+      for (I j = 0; j < this->noCols; ++j) {
+        sumX += x[j];
+      }
+      background = (Sum)this->commonValue * sumX;
+    }
+    long long perRow = (long long)this->noNonSparseValues / max((I)1, this->noRows) + 1;
+    int noParts = (int)max(1LL, min((long long)noThreads, min((long long)this->noCols, perRow)));
+    I* bounds = new I[noParts + 1];
+    this->balanceEntries(noParts, bounds);
+    Sum* scratch = new Sum[(size_t)noParts * this->noRows]();
+
+    runParts(noParts, [&](int p) {
+      Sum* out = scratch + (size_t)p * this->noRows;
+      for (I j = bounds[p]; j < bounds[p + 1]; ++j) {
+        for (I k = this->myOffsets[j]; k < this->myOffsets[j + 1]; ++k) {
+          out[this->myIndices[k]] += ((Sum)this->myValues[k] - this->commonValue) * x[j];
+        }
+      }
+    });
+
+    int noRanges = (int)max((I)1, min((I)noThreads, this->noRows));
+    runParts(noRanges, [&](int r) {
+      I first = (I)((long long)this->noRows * r / noRanges);
+      I last = (I)((long long)this->noRows * (r + 1) / noRanges);
+      for (I i = first; i < last; ++i) {
+        Sum sum = background;
+        for (int p = 0; p < noParts; ++p) {
+          sum += scratch[(size_t)p * this->noRows + i];
+        }
+        y[i] = (T)sum;
+      }
+    });
+    delete[] scratch;
+    delete[] bounds;
+    return;
+  }
+
+  int noParts = (int)max((I)1, min((I)noThreads, this->noRows));
+  I* bounds = new I[noParts + 1];
+  this->balanceEntries(noParts, bounds);
+  this->multiplyRows(x, y, noParts, bounds);
+  delete[] bounds;
+}
+
+/// @brief Multiplies a CSR matrix with a dense vector over a split of the rows made beforehand.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+/// @param noParts The number of row ranges.
+/// @param bounds The first row of every range, noParts+1 long (see balanceEntries).
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::multiplyRows(const T* x, T* y, int noParts, const I* bounds) const
+{
+  Sum background = 0;
+  if (this->commonValue != 0) {
+    Sum sumX = 0;
+    for (I j = 0; j < this->noCols; ++j) {
+      sumX += x[j];
+    }
+    background = (Sum)this->commonValue * sumX;
+  }
+
+  runParts(noParts, [&](int p) {
+    for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+      I start = this->myOffsets[i];
+      y[i] = (T)(background + dotRow(this->myIndices + start, this->myValues + start,
+                                     this->myOffsets[i + 1] - start, x, this->commonValue));
+    }
+  });
+}
+
+/// @brief Splits the rows (columns of a CSC matrix) into ranges holding the same number of entries.
+///
+/// Row i starts at myOffsets[i] + i in units of one entry plus one per row, so the bounds are found by
+/// binary search without a cost array.
+/// @param noParts The number of ranges.
+/// @param bounds Receives the first row of every range, noParts+1 long.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::balanceEntries(int noParts, I* bounds) const
+{
+  long long total = (long long)this->noNonSparseValues + majorCount();
+  bounds[0] = 0;
+  for (int p = 1; p < noParts; ++p) {
+    long long target = total * p / noParts;
+    I low = bounds[p - 1], high = majorCount();
+    while (low < high) {
+      I mid = low + (high - low) / 2;
+      if ((long long)this->myOffsets[mid] + mid < target) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    bounds[p] = low;
+  }
+  bounds[noParts] = majorCount();
+}
+
+/// @brief Sums (values[k] - shift) * x[indices[k]] over one compressed row.
+///
+/// Products are summed in the accumulator type. This is the scalar version; the int, float and double
+/// matrices with int indices have SIMD specializations below.
+/// @param indices The column indices of the row.
+/// @param values The values of the row.
+/// @param length The number of entries in the row.
+/// @param x The dense vector indexed by column.
+/// @param shift Subtracted from every value, the common value of the matrix.
+/// @return The dot product of the shifted row with x.
+template <typename T, typename I>
+typename BasicSparseMatrix<T, I>::Sum BasicSparseMatrix<T, I>::dotRow(const I* indices, const T* values, I length,
+                                                                      const T* x, T shift)
+{
+  Sum sum = 0;
+  for (I k = 0; k < length; ++k) {
+    sum += ((Sum)values[k] - shift) * x[indices[k]];
+  }
+  return sum;
+}
+
+/// @brief Sums (values[k] - shift) * x[indices[k]] over one compressed int row, in 64 bits.
+///
+/// Gathers eight elements of x per step with AVX2, four with SSE4.1, and one otherwise. The vector
+/// loops multiply the 32 bit lanes into exact 64 bit products values[k] * x, even and odd lanes
+/// separately, and sum x in 64 bit lanes beside them; the shift is taken off once at the end as
+/// shift * sum(x). No difference is ever formed in 32 bits, so the result matches the widening
+/// scatter of a CSC matrix.
+/// @param indices The column indices of the row.
+/// @param values The values of the row.
+/// @param length The number of entries in the row.
+/// @param x The dense vector indexed by column.
+/// @param shift Subtracted from every value, the common value of the matrix.
+/// @return The dot product of the shifted row with x.
+template <>
+long long BasicSparseMatrix<int, int>::dotRow(const int* indices, const int* values, int length, const int* x,
+                                              int shift)
+{
+  int k = 0;
+  long long sum = 0;
+#if defined(__AVX2__)
+  __m256i evens = _mm256_setzero_si256();
+  __m256i odds = _mm256_setzero_si256();
+  __m256i sumsX = _mm256_setzero_si256();
+  for (; k + 8 <= length; k += 8) {
+    __m256i cols = _mm256_loadu_si256((const __m256i*)(indices + k));
+    __m256i vals = _mm256_loadu_si256((const __m256i*)(values + k));
+    __m256i xs = _mm256_i32gather_epi32(x, cols, 4);
+    evens = _mm256_add_epi64(evens, _mm256_mul_epi32(vals, xs));
+    odds = _mm256_add_epi64(odds, _mm256_mul_epi32(_mm256_srli_epi64(vals, 32), _mm256_srli_epi64(xs, 32)));
+    sumsX = _mm256_add_epi64(sumsX, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(xs)));
+    sumsX = _mm256_add_epi64(sumsX, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(xs, 1)));
+  }
+  __m256i both = _mm256_add_epi64(evens, odds);
+  __m128i half = _mm_add_epi64(_mm256_castsi256_si128(both), _mm256_extracti128_si256(both, 1));
+  __m128i halfX = _mm_add_epi64(_mm256_castsi256_si128(sumsX), _mm256_extracti128_si256(sumsX, 1));
+#elif defined(__SSE4_1__)
+  __m128i evens = _mm_setzero_si128();
+  __m128i odds = _mm_setzero_si128();
+  __m128i sumsX = _mm_setzero_si128();
+  for (; k + 4 <= length; k += 4) {
+    __m128i vals = _mm_loadu_si128((const __m128i*)(values + k));
+    __m128i xs = _mm_set_epi32(x[indices[k + 3]], x[indices[k + 2]], x[indices[k + 1]], x[indices[k]]);
+    evens = _mm_add_epi64(evens, _mm_mul_epi32(vals, xs));
+    odds = _mm_add_epi64(odds, _mm_mul_epi32(_mm_srli_epi64(vals, 32), _mm_srli_epi64(xs, 32)));
+    sumsX = _mm_add_epi64(sumsX, _mm_cvtepi32_epi64(xs));
+    sumsX = _mm_add_epi64(sumsX, _mm_cvtepi32_epi64(_mm_srli_si128(xs, 8)));
+  }
+  __m128i half = _mm_add_epi64(evens, odds);
+  __m128i halfX = sumsX;
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__)
+  // The lanes wrap modulo 2^64, so the shift is taken off in unsigned arithmetic as well
+  unsigned long long products = (unsigned long long)_mm_cvtsi128_si64(half) +
+                                (unsigned long long)_mm_extract_epi64(half, 1);
+  unsigned long long sumX = (unsigned long long)_mm_cvtsi128_si64(halfX) +
+                            (unsigned long long)_mm_extract_epi64(halfX, 1);
+  sum = (long long)(products - (unsigned long long)(long long)shift * sumX);
+#endif
+  for (; k < length; ++k) {
+    sum += ((long long)values[k] - shift) * x[indices[k]];
+  }
+  return sum;
+}
+
+#if defined(__AVX2__)
+/// @brief Sums (values[k] - shift) * x[indices[k]] over one compressed float row, in double.
+///
+/// Gathers eight elements of x per step and widens both halves to double before the shift is
+/// subtracted, as the scatter of a CSC matrix does.
+/// @param indices The column indices of the row.
+/// @param values The values of the row.
+/// @param length The number of entries in the row.
+/// @param x The dense vector indexed by column.
+/// @param shift Subtracted from every value, the common value of the matrix.
+/// @return The dot product of the shifted row with x.
+template <>
+double BasicSparseMatrix<float, int>::dotRow(const int* indices, const float* values, int length, const float* x,
+                                             float shift)
+{
+  int k = 0;
+  __m256d acc = _mm256_setzero_pd();
+  __m256d shifts = _mm256_set1_pd(shift);
+  for (; k + 8 <= length; k += 8) {
+    __m256i cols = _mm256_loadu_si256((const __m256i*)(indices + k));
+    __m256 vals = _mm256_loadu_ps(values + k);
+    __m256 xs = _mm256_i32gather_ps(x, cols, 4);
+    __m256d low = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(vals)), shifts);
+    __m256d high = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(vals, 1)), shifts);
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(low, _mm256_cvtps_pd(_mm256_castps256_ps128(xs))));
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(high, _mm256_cvtps_pd(_mm256_extractf128_ps(xs, 1))));
+  }
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+  double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  for (; k < length; ++k) {
+    sum += ((double)values[k] - shift) * x[indices[k]];
+  }
+  return sum;
+}
+
+/// @brief Sums (values[k] - shift) * x[indices[k]] over one compressed double row.
+///
+/// Gathers four elements of x per step.
+/// @param indices The column indices of the row.
+/// @param values The values of the row.
+/// @param length The number of entries in the row.
+/// @param x The dense vector indexed by column.
+/// @param shift Subtracted from every value, the common value of the matrix.
+/// @return The dot product of the shifted row with x.
+template <>
+double BasicSparseMatrix<double, int>::dotRow(const int* indices, const double* values, int length, const double* x,
+                                              double shift)
+{
+  int k = 0;
+  __m256d acc = _mm256_setzero_pd();
+  __m256d shifts = _mm256_set1_pd(shift);
+  __m256d lanes = _mm256_castsi256_pd(_mm256_set1_epi64x(-1)); // Gather every lane, into a defined register
+  for (; k + 4 <= length; k += 4) {
+    __m128i cols = _mm_loadu_si128((const __m128i*)(indices + k));
+    __m256d vals = _mm256_sub_pd(_mm256_loadu_pd(values + k), shifts);
+    __m256d xs = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), x, cols, lanes, 8);
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(vals, xs));
+  }
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+  double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  for (; k < length; ++k) {
+    sum += (values[k] - shift) * x[indices[k]];
+  }
+  return sum;
+}
+#endif
+
+/// @brief Sums an array of values in the accumulator type.
+/// @param values The values.
+/// @param length The number of values.
+/// @return The sum.
+template <typename T>
+typename ValueKernel<T>::Sum ValueKernel<T>::sum(const T* values, size_t length)
+{
+  Sum part[4] = {0, 0, 0, 0};
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    part[0] += values[k];
+    part[1] += values[k + 1];
+    part[2] += values[k + 2];
+    part[3] += values[k + 3];
+  }
+  for (; k < length; ++k) {
+    part[0] += values[k];
+  }
+  return (part[0] + part[1]) + (part[2] + part[3]);
+}
+
+/// @brief Finds the largest value of an array.
+/// @param values The values.
+/// @param length The number of values.
+/// @param start The result for an empty array.
+/// @return The largest of start and the values.
+template <typename T>
+T ValueKernel<T>::max(const T* values, size_t length, T start)
+{
+  T part[4] = {start, start, start, start};
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    for (int l = 0; l < 4; ++l) {
+      part[l] = values[k + l] > part[l] ? values[k + l] : part[l];
+    }
+  }
+  for (; k < length; ++k) {
+    part[0] = values[k] > part[0] ? values[k] : part[0];
+  }
+  return std::max(std::max(part[0], part[1]), std::max(part[2], part[3]));
+}
+
+/// @brief Counts the values of an array above a threshold.
+/// @param values The values.
+/// @param length The number of values.
+/// @param threshold The value to compare with.
+/// @return The number of values greater than threshold.
+template <typename T>
+size_t ValueKernel<T>::countAbove(const T* values, size_t length, T threshold)
+{
+  size_t part[4] = {0, 0, 0, 0};
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    for (int l = 0; l < 4; ++l) {
+      part[l] += values[k + l] > threshold;
+    }
+  }
+  for (; k < length; ++k) {
+    part[0] += values[k] > threshold;
+  }
+  return part[0] + part[1] + part[2] + part[3];
+}
+
+/// @brief Sums the absolute values of an array in the accumulator type.
+/// @param values The values.
+/// @param length The number of values.
+/// @return The sum of the absolute values.
+template <typename T>
+typename ValueKernel<T>::Sum ValueKernel<T>::sumAbs(const T* values, size_t length)
+{
+  Sum part[4] = {0, 0, 0, 0};
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    for (int l = 0; l < 4; ++l) {
+      part[l] += values[k + l] < 0 ? -(Sum)values[k + l] : (Sum)values[k + l];
+    }
+  }
+  for (; k < length; ++k) {
+    part[0] += values[k] < 0 ? -(Sum)values[k] : (Sum)values[k];
+  }
+  return (part[0] + part[1]) + (part[2] + part[3]);
+}
+
+/// @brief Sums the squares of an array in double, which holds the square of any value exactly enough.
+/// @param values The values.
+/// @param length The number of values.
+/// @return The sum of the squares.
+template <typename T>
+double ValueKernel<T>::sumSquares(const T* values, size_t length)
+{
+  double part[4] = {0, 0, 0, 0};
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    for (int l = 0; l < 4; ++l) {
+      part[l] += (double)values[k + l] * values[k + l];
+    }
+  }
+  for (; k < length; ++k) {
+    part[0] += (double)values[k] * values[k];
+  }
+  return (part[0] + part[1]) + (part[2] + part[3]);
+}
+
+/// @brief Scales and shifts an array, out[k] = alpha*values[k] + beta.
+/// @param values The values.
+/// @param length The number of values.
+/// @param alpha The scale.
+/// @param beta The value added after scaling.
+/// @param out Receives the results, may be values itself.
+template <typename T>
+void ValueKernel<T>::affine(const T* values, size_t length, T alpha, T beta, T* out)
+{
+  for (size_t k = 0; k < length; ++k) {
+    out[k] = alpha * values[k] + beta;
+  }
+}
+
+/// @brief Adds a multiple of an array to running sums, the row update of a dense product.
+/// @param alpha The multiple.
+/// @param values The values.
+/// @param length The number of values.
+/// @param out The running sums, length long.
+template <typename T>
+void ValueKernel<T>::axpy(Sum alpha, const T* values, size_t length, Sum* out)
+{
+  for (size_t k = 0; k < length; ++k) {
+    out[k] += alpha * values[k];
+  }
+}
+
+#if defined(__AVX2__)
+/// @brief Sums an int array in 64 bits, widening eight values per step.
+template <>
+long long ValueKernel<int>::sum(const int* values, size_t length)
+{
+  __m256i acc = _mm256_setzero_si256();
+  size_t k = 0;
+  for (; k + 8 <= length; k += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(values + k));
+    acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+    acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+  }
+  __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  long long sum = _mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1);
+  for (; k < length; ++k) {
+    sum += values[k];
+  }
+  return sum;
+}
+
+/// @brief Finds the largest value of an int array, eight lanes at a time.
+template <>
+int ValueKernel<int>::max(const int* values, size_t length, int start)
+{
+  __m256i best = _mm256_set1_epi32(start);
+  size_t k = 0;
+  for (; k + 8 <= length; k += 8) {
+    best = _mm256_max_epi32(best, _mm256_loadu_si256((const __m256i*)(values + k)));
+  }
+  int lanes[8];
+  _mm256_storeu_si256((__m256i*)lanes, best);
+  int result = *std::max_element(lanes, lanes + 8);
+  for (; k < length; ++k) {
+    result = std::max(result, values[k]);
+  }
+  return result;
+}
+
+/// @brief Counts the values of an int array above a threshold from eight lane comparison masks.
+template <>
+size_t ValueKernel<int>::countAbove(const int* values, size_t length, int threshold)
+{
+  __m256i limit = _mm256_set1_epi32(threshold);
+  size_t count = 0;
+  size_t k = 0;
+  for (; k + 8 <= length; k += 8) {
+    __m256i above = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(values + k)), limit);
+    count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(above)));
+  }
+  for (; k < length; ++k) {
+    count += values[k] > threshold;
+  }
+  return count;
+}
+
+/// @brief Sums the absolute values of an int array in 64 bits. The absolute values are widened as
+/// unsigned, so the one of INT_MIN comes out right.
+template <>
+long long ValueKernel<int>::sumAbs(const int* values, size_t length)
+{
+  __m256i acc = _mm256_setzero_si256();
+  size_t k = 0;
+  for (; k + 8 <= length; k += 8) {
+    __m256i v = _mm256_abs_epi32(_mm256_loadu_si256((const __m256i*)(values + k)));
+    acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+    acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+  }
+  __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  long long sum = _mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1);
+  for (; k < length; ++k) {
+    sum += values[k] < 0 ? -(long long)values[k] : values[k];
+  }
+  return sum;
+}
+
+/// @brief Sums the squares of an int array in double, four lanes converted at a time.
+template <>
+double ValueKernel<int>::sumSquares(const int* values, size_t length)
+{
+  __m256d acc = _mm256_setzero_pd();
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    __m256d v = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(values + k)));
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(v, v));
+  }
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+  double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  for (; k < length; ++k) {
+    sum += (double)values[k] * values[k];
+  }
+  return sum;
+}
+
+/// @brief Scales and shifts an int array, eight lanes at a time.
+template <>
+void ValueKernel<int>::affine(const int* values, size_t length, int alpha, int beta, int* out)
+{
+  __m256i scale = _mm256_set1_epi32(alpha);
+  __m256i shift = _mm256_set1_epi32(beta);
+  size_t k = 0;
+  for (; k + 8 <= length; k += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(values + k));
+    _mm256_storeu_si256((__m256i*)(out + k), _mm256_add_epi32(_mm256_mullo_epi32(v, scale), shift));
+  }
+  for (; k < length; ++k) {
+    out[k] = alpha * values[k] + beta;
+  }
+}
+
+/// @brief Adds a multiple of an int array to 64 bit sums, widening eight values per step.
+template <>
+void ValueKernel<int>::axpy(long long alpha, const int* values, size_t length, long long* out)
+{
+  size_t k = 0;
+  if (alpha >= numeric_limits<int>::min() && alpha <= numeric_limits<int>::max()) { // _mm256_mul_epi32 takes 32 bits
+    __m256i scale = _mm256_set1_epi64x(alpha);
+    for (; k + 8 <= length; k += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(values + k));
+      __m256i low = _mm256_mul_epi32(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)), scale);
+      __m256i high = _mm256_mul_epi32(_mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)), scale);
+      _mm256_storeu_si256((__m256i*)(out + k), _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(out + k)), low));
+      _mm256_storeu_si256((__m256i*)(out + k + 4),
+                          _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(out + k + 4)), high));
+    }
+  }
+  for (; k < length; ++k) {
+    out[k] += alpha * values[k];
+  }
+}
+
+/// @brief Sums a double array with two independent four lane accumulators.
+template <>
+double ValueKernel<double>::sum(const double* values, size_t length)
+{
+  __m256d low = _mm256_setzero_pd();
+  __m256d high = _mm256_setzero_pd();
+  size_t k = 0;
+  for (; k + 8 <= length; k += 8) {
+    low = _mm256_add_pd(low, _mm256_loadu_pd(values + k));
+    high = _mm256_add_pd(high, _mm256_loadu_pd(values + k + 4));
+  }
+  __m256d both = _mm256_add_pd(low, high);
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(both), _mm256_extractf128_pd(both, 1));
+  double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  for (; k < length; ++k) {
+    sum += values[k];
+  }
+  return sum;
+}
+
+/// @brief Finds the largest value of a double array, four lanes at a time.
+template <>
+double ValueKernel<double>::max(const double* values, size_t length, double start)
+{
+  __m256d best = _mm256_set1_pd(start);
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    best = _mm256_max_pd(best, _mm256_loadu_pd(values + k));
+  }
+  __m128d half = _mm_max_pd(_mm256_castpd256_pd128(best), _mm256_extractf128_pd(best, 1));
+  double result = _mm_cvtsd_f64(_mm_max_sd(half, _mm_unpackhi_pd(half, half)));
+  for (; k < length; ++k) {
+    result = std::max(result, values[k]);
+  }
+  return result;
+}
+
+/// @brief Counts the values of a double array above a threshold from four lane comparison masks.
+template <>
+size_t ValueKernel<double>::countAbove(const double* values, size_t length, double threshold)
+{
+  __m256d limit = _mm256_set1_pd(threshold);
+  size_t count = 0;
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    __m256d above = _mm256_cmp_pd(_mm256_loadu_pd(values + k), limit, _CMP_GT_OQ);
+    count += __builtin_popcount(_mm256_movemask_pd(above));
+  }
+  for (; k < length; ++k) {
+    count += values[k] > threshold;
+  }
+  return count;
+}
+
+/// @brief Sums the absolute values of a double array, clearing the sign bits four lanes at a time.
+template <>
+double ValueKernel<double>::sumAbs(const double* values, size_t length)
+{
+  __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d acc = _mm256_setzero_pd();
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    acc = _mm256_add_pd(acc, _mm256_andnot_pd(sign, _mm256_loadu_pd(values + k)));
+  }
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+  double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  for (; k < length; ++k) {
+    sum += values[k] < 0 ? -values[k] : values[k];
+  }
+  return sum;
+}
+
+/// @brief Sums the squares of a double array, four lanes at a time.
+template <>
+double ValueKernel<double>::sumSquares(const double* values, size_t length)
+{
+  __m256d acc = _mm256_setzero_pd();
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    __m256d v = _mm256_loadu_pd(values + k);
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(v, v));
+  }
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+  double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  for (; k < length; ++k) {
+    sum += values[k] * values[k];
+  }
+  return sum;
+}
+
+/// @brief Scales and shifts a double array, four lanes at a time.
+template <>
+void ValueKernel<double>::affine(const double* values, size_t length, double alpha, double beta, double* out)
+{
+  __m256d scale = _mm256_set1_pd(alpha);
+  __m256d shift = _mm256_set1_pd(beta);
+  size_t k = 0;
+  for (; k + 4 <= length; k += 4) {
+    _mm256_storeu_pd(out + k, _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(values + k), scale), shift));
+  }
+  for (; k < length; ++k) {
+    out[k] = alpha * values[k] + beta;
+  }
+}
+
+/// @brief Adds a multiple of a double array to running sums, eight values per step.
+template <>
+void ValueKernel<double>::axpy(double alpha, const double* values, size_t length, double* out)
+{
+  __m256d scale = _mm256_set1_pd(alpha);
+  size_t k = 0;
+  for (; k + 8 <= length; k += 8) {
+    __m256d low = _mm256_mul_pd(_mm256_loadu_pd(values + k), scale);
+    __m256d high = _mm256_mul_pd(_mm256_loadu_pd(values + k + 4), scale);
+    _mm256_storeu_pd(out + k, _mm256_add_pd(_mm256_loadu_pd(out + k), low));
+    _mm256_storeu_pd(out + k + 4, _mm256_add_pd(_mm256_loadu_pd(out + k + 4), high));
+  }
+  for (; k < length; ++k) {
+    out[k] += alpha * values[k];
+  }
+}
+#endif
+
+/// @brief Sums every row of the matrix.
+/// @param sums Receives the sums, noRows long.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::RowSums(Sum* sums) const
+{
+  this->RowSums(sums, 1);
+}
+
+/// @brief Sums every row of the matrix, with the rows split across threads.
+/// @param sums Receives the sums, noRows long.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::RowSums(Sum* sums, int noThreads) const
+{
+  this->lineSums(sums, true, false, noThreads);
+}
+
+/// @brief Sums every column of the matrix.
+/// @param sums Receives the sums, noCols long.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::ColSums(Sum* sums) const
+{
+  this->lineSums(sums, false, false, 1);
+}
+
+/// @brief Sums every column of the matrix, with the work split across threads.
+/// @param sums Receives the sums, noCols long.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::ColSums(Sum* sums, int noThreads) const
+{
+  this->lineSums(sums, false, false, noThreads);
+}
+
+/// @brief Sums the cells, or their absolute values, of every row or every column.
+///
+/// When the lines are the compressed ones, a line sums to its stored values plus the common value
+/// once for every cell it does not store, so only its contiguous values are read, by the SIMD kernel.
+/// Otherwise every part scatters its share of the entries into a private array, relative to the
+/// common value, and the arrays are added up slice by slice.
+/// @param sums Receives the sums, noRows long by rows and noCols long by columns.
+/// @param byRows True to sum the rows, false to sum the columns.
+/// @param absolute True to sum absolute values.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::lineSums(Sum* sums, bool byRows, bool absolute, int noThreads) const
+{
+  I majors = majorCount();
+  I minors = this->rowMajor ? this->noCols : this->noRows;
+  Sum common = absolute && this->commonValue < 0 ? -(Sum)this->commonValue : (Sum)this->commonValue;
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+
+  if (byRows == this->rowMajor) {
+    int noParts = (int)max((I)1, min((I)noThreads, majors));
+    I* bounds = new I[noParts + 1];
+    this->balanceEntries(noParts, bounds);
+    runParts(noParts, [&](int p) {
+      for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+        I start = this->myOffsets[i];
+        I length = this->myOffsets[i + 1] - start;
+        Sum stored = absolute ? ValueKernel<T>::sumAbs(this->myValues + start, length)
+                              : ValueKernel<T>::sum(this->myValues + start, length);
+        sums[i] = stored + common * (minors - length);
+      }
+    });
+    delete[] bounds;
+    return;
+  }
+
+  // Every stored cell replaces one common value of its line
+  int noParts = (int)max((I)1, min((I)noThreads, (I)(this->noNonSparseValues / 65536 + 1)));
+  I* bounds = new I[noParts + 1];
+  this->balanceEntries(noParts, bounds);
+  Sum* partials = new Sum[(size_t)(noParts - 1) * minors];
+  runParts(noParts, [&](int p) {
+    Sum* out = p == 0 ? sums : partials + (size_t)(p - 1) * minors;
+    fill(out, out + minors, (Sum)0);
+    for (I k = this->myOffsets[bounds[p]]; k < this->myOffsets[bounds[p + 1]]; ++k) {
+      T value = this->myValues[k];
+      out[this->myIndices[k]] += (absolute && value < 0 ? -(Sum)value : (Sum)value) - common;
+    }
+  });
+  runParts(noParts, [&](int p) {
+    for (I j = (I)((long long)minors * p / noParts); j < (I)((long long)minors * (p + 1) / noParts); ++j) {
+      Sum sum = sums[j] + common * majors;
+      for (int q = 1; q < noParts; ++q) {
+        sum += partials[(size_t)(q - 1) * minors + j];
+      }
+      sums[j] = sum;
+    }
+  });
+  delete[] partials;
+  delete[] bounds;
+}
+
+/// @brief Computes the Frobenius norm of the matrix.
+/// @return The square root of the sum of the squares of every cell.
+template <typename T, typename I>
+double BasicSparseMatrix<T, I>::FrobeniusNorm() const
+{
+  return this->FrobeniusNorm(1);
+}
+
+/// @brief Computes the Frobenius norm of the matrix, with the values split across threads.
+///
+/// The stored values are squared as one contiguous array and every other cell adds the square of the
+/// common value.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The square root of the sum of the squares of every cell.
+template <typename T, typename I>
+double BasicSparseMatrix<T, I>::FrobeniusNorm(int noThreads) const
+{
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, (I)(this->noNonSparseValues / 4096 + 1)));
+  double* parts = new double[noParts];
+  runParts(noParts, [&](int p) {
+    size_t first = (size_t)this->noNonSparseValues * p / noParts;
+    size_t last = (size_t)this->noNonSparseValues * (p + 1) / noParts;
+    parts[p] = ValueKernel<T>::sumSquares(this->myValues + first, last - first);
+  });
+  double total = (double)this->commonValue * this->commonValue
+               * ((double)this->noRows * this->noCols - this->noNonSparseValues);
+  for (int p = 0; p < noParts; ++p) {
+    total += parts[p];
+  }
+  delete[] parts;
+  return sqrt(total);
+}
+
+/// @brief Computes the 1-norm of the matrix.
+/// @return The largest sum of absolute values of a column, 0 for a matrix without cells.
+template <typename T, typename I>
+typename BasicSparseMatrix<T, I>::Sum BasicSparseMatrix<T, I>::OneNorm() const
+{
+  return this->OneNorm(1);
+}
+
+/// @brief Computes the 1-norm of the matrix, with the work split across threads.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The largest sum of absolute values of a column, 0 for a matrix without cells.
+template <typename T, typename I>
+typename BasicSparseMatrix<T, I>::Sum BasicSparseMatrix<T, I>::OneNorm(int noThreads) const
+{
+  Sum* sums = new Sum[this->noCols];
+  this->lineSums(sums, false, true, noThreads);
+  Sum norm = this->noCols > 0 ? *max_element(sums, sums + this->noCols) : 0;
+  delete[] sums;
+  return norm;
+}
+
+/// @brief Computes the infinity norm of the matrix.
+/// @return The largest sum of absolute values of a row, 0 for a matrix without cells.
+template <typename T, typename I>
+typename BasicSparseMatrix<T, I>::Sum BasicSparseMatrix<T, I>::InfinityNorm() const
+{
+  return this->InfinityNorm(1);
+}
+
+/// @brief Computes the infinity norm of the matrix, with the work split across threads.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The largest sum of absolute values of a row, 0 for a matrix without cells.
+template <typename T, typename I>
+typename BasicSparseMatrix<T, I>::Sum BasicSparseMatrix<T, I>::InfinityNorm(int noThreads) const
+{
+  Sum* sums = new Sum[this->noRows];
+  this->lineSums(sums, true, true, noThreads);
+  Sum norm = this->noRows > 0 ? *max_element(sums, sums + this->noRows) : 0;
+  delete[] sums;
+  return norm;
+}
+
+/// @brief Keeps the k largest stored entries of every row.
+/// @param k The number of entries to keep per row.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::TopK(I k) const
+{
+  return this->TopK(k, 1);
+}
+
+/// @brief Keeps the k largest stored entries of every row, with the rows split across threads.
+///
+/// Every row selects its k largest values with nth_element over the positions of its entries, ties
+/// going to the lower column, and the selected entries are written back in column order. The entries
+/// that are not kept revert to the common value, which the result shares with this matrix.
+/// @param k The number of entries to keep per row, 0 or less to keep none.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly genereated matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::TopK(I k, int noThreads) const
+{
+  BasicSparseMatrix* rowsOfA = this->rowMajor ? nullptr : this->Recompress(true);
+  const BasicSparseMatrix& A = rowsOfA ? *rowsOfA : *this;
+  I n = A.noRows;
+  k = max((I)0, k);
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+
+  // Positions of every row, its k largest first
+  I* order = new I[A.noNonSparseValues];
+  int noParts = (int)max((I)1, min((I)noThreads, n));
+  I* bounds = new I[noParts + 1];
+  A.balanceEntries(noParts, bounds);
+  runParts(noParts, [&](int p) {
+    for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+      I* first = order + A.myOffsets[i];
+      I* last = order + A.myOffsets[i + 1];
+      for (I* position = first; position < last; ++position) {
+        *position = (I)(position - order);
+      }
+      if (last - first > k) {
+        nth_element(first, first + k, last, [&](I a, I b) {
+          return A.myValues[a] > A.myValues[b] || (A.myValues[a] == A.myValues[b] && a < b);
+        });
+      }
+    }
+  });
+  delete[] bounds;
+
+  long long* cost = new long long[n + 1];
+  cost[0] = 0;
+  for (I i = 0; i < n; ++i) {
+    cost[i + 1] = cost[i] + 1 + min(k, A.myOffsets[i + 1] - A.myOffsets[i]);
+  }
+  BasicSparseMatrix* result = buildRows(n, A.noCols, A.commonValue, cost, noThreads, [&](I i, RowAccumulator<T, I>& acc) {
+    I length = min(k, A.myOffsets[i + 1] - A.myOffsets[i]);
+    for (I q = A.myOffsets[i]; q < A.myOffsets[i] + length; ++q) {
+      acc.add(A.myIndices[order[q]], (Sum)A.myValues[order[q]] - A.commonValue);
+    }
+  });
+
+  delete[] cost;
+  delete[] order;
+  delete rowsOfA;
+  return result;
+}
+
+/// @brief Finds the largest value of the matrix.
+/// @return The largest value, the common value included whenever some cell holds it.
+template <typename T, typename I>
+T BasicSparseMatrix<T, I>::MaxValue() const
+{
+  return this->MaxValue(1);
+}
+
+/// @brief Finds the largest value of the matrix, with the values split across threads.
+///
+/// Only the stored values are scanned, as one contiguous array whichever way the matrix is
+/// compressed; the common value is a candidate when the matrix does not store every cell.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The largest value, or the common value for a matrix without cells.
+template <typename T, typename I>
+T BasicSparseMatrix<T, I>::MaxValue(int noThreads) const
+{
+  bool anyCommon = (long long)this->noRows * this->noCols > (long long)this->noNonSparseValues;
+  if (this->noNonSparseValues == 0) {
+    return this->commonValue;
+  }
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, (I)(this->noNonSparseValues / 4096 + 1)));
+  T* best = new T[noParts];
+  runParts(noParts, [&](int p) {
+    size_t first = (size_t)this->noNonSparseValues * p / noParts;
+    size_t last = (size_t)this->noNonSparseValues * (p + 1) / noParts;
+    best[p] = ValueKernel<T>::max(this->myValues + first, last - first, this->myValues[first]);
+  });
+  T result = *max_element(best, best + noParts);
+  delete[] best;
+  return anyCommon ? max(result, this->commonValue) : result;
+}
+
+/// @brief Counts the cells of the matrix holding more than a threshold.
+/// @param threshold The value to compare with.
+/// @return The number of cells above threshold.
+template <typename T, typename I>
+long long BasicSparseMatrix<T, I>::CountAbove(T threshold) const
+{
+  return this->CountAbove(threshold, 1);
+}
+
+/// @brief Counts the cells of the matrix holding more than a threshold, with the values split across threads.
+///
+/// The stored values are counted as one contiguous array; the cells that are not stored all count,
+/// or none of them does, depending on the common value.
+/// @param threshold The value to compare with.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The number of cells above threshold.
+template <typename T, typename I>
+long long BasicSparseMatrix<T, I>::CountAbove(T threshold, int noThreads) const
+{
+  long long count = 0;
+  if (this->commonValue > threshold) {
+    count = (long long)this->noRows * this->noCols - this->noNonSparseValues;
+  }
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, (I)(this->noNonSparseValues / 4096 + 1)));
+  long long* counts = new long long[noParts];
+  runParts(noParts, [&](int p) {
+    size_t first = (size_t)this->noNonSparseValues * p / noParts;
+    size_t last = (size_t)this->noNonSparseValues * (p + 1) / noParts;
+    counts[p] = (long long)ValueKernel<T>::countAbove(this->myValues + first, last - first, threshold);
+  });
+  for (int p = 0; p < noParts; ++p) {
+    count += counts[p];
+  }
+  delete[] counts;
+  return count;
+}
+
+/// @brief Computes a reverse Cuthill-McKee ordering of a square matrix.
+///
+/// The ordering is a breadth-first search over the pattern of A + A^T that visits the neighbours of
+/// every vertex by increasing degree, reversed at the end, so vertices that share entries get nearby
+/// numbers and the entries gather around the diagonal. Every connected component is started from a
+/// pseudo-peripheral vertex: the search starts at a vertex of smallest degree and moves to the
+/// smallest degree vertex of its last level for as long as that makes the search deeper.
+/// @param perm Receives the old index of every new row and column, getNoRows() long.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::ReverseCuthillMcKee(I* perm) const
+{
+  if (this->noRows != this->noCols) {
+    throw std::invalid_argument("Matrix must be square");
+  }
+  I n = this->noRows;
+
+  // Adjacency of A + A^T without the diagonal, the stored entries seen from both ends
+  I* adjOffsets = new I[n + 1];
+  fill(adjOffsets, adjOffsets + n + 1, (I)0);
+  for (I major = 0; major < n; ++major) {
+    for (I k = myOffsets[major]; k < myOffsets[major + 1]; ++k) {
+      if (myIndices[k] != major) {
+        ++adjOffsets[major + 1];
+        ++adjOffsets[myIndices[k] + 1];
+      }
+    }
+  }
+  for (I v = 0; v < n; ++v) {
+    adjOffsets[v + 1] += adjOffsets[v];
+  }
+  I* adjacency = new I[adjOffsets[n]];
+  I* degree = new I[n];
+  copy(adjOffsets, adjOffsets + n, degree); // Fill positions for now, degrees once deduplicated
+  for (I major = 0; major < n; ++major) {
+    for (I k = myOffsets[major]; k < myOffsets[major + 1]; ++k) {
+      if (myIndices[k] != major) {
+        adjacency[degree[major]++] = myIndices[k];
+        adjacency[degree[myIndices[k]]++] = major;
+      }
+    }
+  }
+  for (I v = 0; v < n; ++v) {
+    I* first = adjacency + adjOffsets[v];
+    sort(first, adjacency + adjOffsets[v + 1]);
+    degree[v] = (I)(unique(first, adjacency + adjOffsets[v + 1]) - first);
+  }
+
+  // Breadth-first search from start over the unnumbered vertices into queue, returning its depth;
+  // the levels stay set until clear() is called on the same queue
+  I* level = new I[n];
+  fill(level, level + n, (I)-1);
+  bool* numbered = new bool[n];
+  fill(numbered, numbered + n, false);
+  auto search = [&](I start, I* queue, I& noQueued) {
+    noQueued = 0;
+    queue[noQueued++] = start;
+    level[start] = 0;
+    for (I head = 0; head < noQueued; ++head) {
+      I v = queue[head];
+      for (I k = adjOffsets[v]; k < adjOffsets[v] + degree[v]; ++k) {
+        I w = adjacency[k];
+        if (!numbered[w] && level[w] < 0) {
+          level[w] = level[v] + 1;
+          queue[noQueued++] = w;
+        }
+      }
+    }
+    return level[queue[noQueued - 1]];
+  };
+  auto clear = [&](const I* queue, I noQueued) {
+    for (I q = 0; q < noQueued; ++q) {
+      level[queue[q]] = -1;
+    }
+  };
+
+  I* byDegree = new I[n];
+  for (I v = 0; v < n; ++v) {
+    byDegree[v] = v;
+  }
+  stable_sort(byDegree, byDegree + n, [&](I a, I b) { return degree[a] < degree[b]; });
+  I noNumbered = 0;
+  for (I candidate = 0; candidate < n; ++candidate) {
+    I start = byDegree[candidate];
+    if (numbered[start]) {
+      continue;
+    }
+
+    // Walk to a pseudo-peripheral vertex, using the tail of perm as the search queue
+    I* queue = perm + noNumbered;
+    I noQueued = 0;
+    I depth = search(start, queue, noQueued);
+    for (int tries = 0; tries < 8; ++tries) {
+      I far = queue[noQueued - 1];
+      for (I q = noQueued - 1; q >= 0 && level[queue[q]] == depth; --q) {
+        if (degree[queue[q]] < degree[far]) {
+          far = queue[q];
+        }
+      }
+      clear(queue, noQueued);
+      I farDepth = search(far, queue, noQueued);
+      if (farDepth <= depth) {
+        break;
+      }
+      start = far;
+      depth = farDepth;
+    }
+    clear(queue, noQueued);
+
+    // Cuthill-McKee order of the component: neighbours by increasing degree
+    queue[0] = start;
+    numbered[start] = true;
+    I tail = 1;
+    for (I head = 0; head < tail; ++head) {
+      I v = queue[head];
+      I firstNew = tail;
+      for (I k = adjOffsets[v]; k < adjOffsets[v] + degree[v]; ++k) {
+        I w = adjacency[k];
+        if (!numbered[w]) {
+          numbered[w] = true;
+          queue[tail++] = w;
+        }
+      }
+      stable_sort(queue + firstNew, queue + tail, [&](I a, I b) { return degree[a] < degree[b]; });
+    }
+    noNumbered += tail;
+  }
+  reverse(perm, perm + n);
+
+  delete[] adjOffsets;
+  delete[] adjacency;
+  delete[] degree;
+  delete[] level;
+  delete[] numbered;
+  delete[] byDegree;
+}
+
+/// @brief Renumbers the rows and columns of a square matrix.
+/// @param perm The old index of every new row and column, as made by ReverseCuthillMcKee().
+/// @return The permuted matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Permute(const I* perm) const
+{
+  return this->Permute(perm, 1);
+}
+
+/// @brief Renumbers the rows and columns of a square matrix, B = P*A*P^T, with the rows split across threads.
+///
+/// Row i of the result is row perm[i] of A with every column c moved to the new index of c, so the
+/// rows are built independently from the inverse permutation.
+/// @param perm The old index of every new row and column, as made by ReverseCuthillMcKee().
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The permuted matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::Permute(const I* perm, int noThreads) const
+{
+  if (this->noRows != this->noCols) {
+    throw std::invalid_argument("Matrix must be square");
+  }
+  I n = this->noRows;
+  I* inverse = new I[n];
+  fill(inverse, inverse + n, (I)-1);
+  for (I i = 0; i < n; ++i) {
+    if (perm[i] < 0 || perm[i] >= n || inverse[perm[i]] != -1) {
+      delete[] inverse;
+      throw std::invalid_argument("Not a permutation of the rows");
+    }
+    inverse[perm[i]] = i;
+  }
+
+  BasicSparseMatrix* rowsOfA = this->rowMajor ? nullptr : this->Recompress(true);
+  const BasicSparseMatrix& A = rowsOfA ? *rowsOfA : *this;
+  long long* cost = new long long[n + 1];
+  cost[0] = 0;
+  for (I i = 0; i < n; ++i) {
+    cost[i + 1] = cost[i] + 1 + A.myOffsets[perm[i] + 1] - A.myOffsets[perm[i]];
+  }
+
+  // The accumulator sorts the moved columns; sums are kept relative to the common value it adds back
+  BasicSparseMatrix* result = buildRows(n, n, this->commonValue, cost, noThreads, [&](I i, RowAccumulator<T, I>& acc) {
+    for (I k = A.myOffsets[perm[i]]; k < A.myOffsets[perm[i] + 1]; ++k) {
+      acc.add(inverse[A.myIndices[k]], (Sum)A.myValues[k] - this->commonValue);
+    }
+  });
+
+  delete[] cost;
+  delete[] inverse;
+  delete rowsOfA;
+  return result;
+}
+
+/// @brief Moves a vector into the numbering of a permuted matrix, so Permute(perm) times y equals
+/// the permuted A times x.
+/// @param perm The old index of every new position.
+/// @param n The length of the vectors.
+/// @param x The vector in the original numbering.
+/// @param y Receives x in the new numbering, must not overlap x.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::PermuteVector(const I* perm, I n, const T* x, T* y)
+{
+  for (I i = 0; i < n; ++i) {
+    y[i] = x[perm[i]];
+  }
+}
+
+/// @brief Moves a vector from the numbering of a permuted matrix back to the original one.
+/// @param perm The old index of every new position.
+/// @param n The length of the vectors.
+/// @param x The vector in the new numbering.
+/// @param y Receives x in the original numbering, must not overlap x.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::UnpermuteVector(const I* perm, I n, const T* x, T* y)
+{
+  for (I i = 0; i < n; ++i) {
+    y[perm[i]] = x[i];
+  }
+}
+
+/// @brief Gets the bandwidth of the stored entries, to measure what a reordering gained.
+/// @return The largest distance of a stored entry from the diagonal, 0 for an empty matrix.
+template <typename T, typename I>
+I BasicSparseMatrix<T, I>::getBandwidth() const
+{
+  I bandwidth = 0;
+  for (I major = 0; major < majorCount(); ++major) {
+    for (I k = myOffsets[major]; k < myOffsets[major + 1]; ++k) {
+      bandwidth = max(bandwidth, myIndices[k] > major ? myIndices[k] - major : major - myIndices[k]);
+    }
+  }
+  return bandwidth;
+}
+
+/// @brief Gets the mean distance of the stored entries from the diagonal, which follows the spread of
+/// the vector accesses of SpMV more closely than the bandwidth, set by the single farthest entry.
+/// @return The mean distance, 0 for a matrix without entries.
+template <typename T, typename I>
+double BasicSparseMatrix<T, I>::getAverageBandwidth() const
+{
+  double total = 0;
+  for (I major = 0; major < majorCount(); ++major) {
+    for (I k = myOffsets[major]; k < myOffsets[major + 1]; ++k) {
+      total += myIndices[k] > major ? myIndices[k] - major : major - myIndices[k];
+    }
+  }
+  return noNonSparseValues > 0 ? total / noNonSparseValues : 0;
+}
+
+/// @brief Builds a CSR matrix row by row, with the rows split across threads.
+///
+/// Rows are split into contiguous ranges of equal cost. Every range gets its own RowAccumulator and
+/// EntryBuffer, and the buffers are joined by assembleParts, so the row callback never needs a lock.
+/// @param n The number of rows of the result.
+/// @param m The number of columns of the result.
+/// @param cv The common value of the result, added to every accumulated sum.
+/// @param costPrefix Running cost of the rows, n+1 long.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @param row Adds the contributions to row i into the accumulator.
+/// @return The matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::buildRows(I n, I m, T cv, const long long* costPrefix, int noThreads,
+                                                             const function<void(I, RowAccumulator<T, I>&)>& row)
+{
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, n));
+  I* bounds = new I[noParts + 1];
+  balanceRows(costPrefix, n, noParts, bounds);
+
+  EntryBuffer<T, I>* parts = new EntryBuffer<T, I>[noParts];
+  I* offsets = new I[n + 1];
+  runParts(noParts, [&](int p) {
+    RowAccumulator<T, I> acc(m);
+    for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+      acc.start(i);
+      row(i, acc);
+      offsets[i + 1] = acc.flush(parts[p], cv); // Row length for now, offsets after the prefix sum
+    }
+  });
+
+  BasicSparseMatrix* result = assembleParts(n, m, cv, noParts, bounds, parts, offsets);
+  delete[] bounds;
+  delete[] parts;
+  return result;
+}
+
+/// @brief Splits rows into contiguous ranges of about the same total cost.
+/// @param costPrefix Running cost, costPrefix[i] is the cost of rows 0..i-1, noRows+1 long.
+/// @param noRows The number of rows to split.
+/// @param noParts The number of ranges to make.
+/// @param bounds Receives the first row of every range and noRows at the end, noParts+1 long.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::balanceRows(const long long* costPrefix, I noRows, int noParts, I* bounds)
+{
+  long long total = costPrefix[noRows];
+  bounds[0] = 0;
+  for (int p = 1; p < noParts; ++p) {
+    long long target = total * p / noParts;
+    I row = (I)(lower_bound(costPrefix, costPrefix + noRows + 1, target) - costPrefix);
+    bounds[p] = max(bounds[p - 1], min(row, noRows));
+  }
+  bounds[noParts] = noRows;
+}
+
+/// @brief Runs numbered parts of a kernel, on the calling thread when there is only one.
+/// @param noParts The number of parts.
+/// @param part The work of a single part.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::runParts(int noParts, const function<void(int)>& part)
+{
+  if (noParts == 1) {
+    part(0);
+  } else {
+    WorkerPool::shared().run(noParts, part);
+  }
+}
+
+/// @brief Builds a CSR matrix from per-part row buffers.
+/// @param n The number of rows of the result.
+/// @param m The number of columns of the result.
+/// @param cv The common value of the result.
+/// @param noParts The number of parts the rows were split into.
+/// @param bounds The first row of every part, noParts+1 long.
+/// @param parts The entries of every part in row order.
+/// @param offsets Row lengths in offsets[1..n] on entry, taken over as the row offsets of the result.
+/// @return The assembled matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrix<T, I>::assembleParts(I n, I m, T cv, int noParts, const I* bounds,
+                                                                 const EntryBuffer<T, I>* parts, I* offsets)
+{
+  offsets[0] = 0;
+  for (I i = 0; i < n; ++i) {
+    offsets[i + 1] += offsets[i];
+  }
+  I nnz = offsets[n];
+  I* indices = new I[nnz];
+  T* values = new T[nnz];
+
+  // Every part lands in a disjoint slice of the result
+  runParts(noParts, [&](int p) {
+    I start = offsets[bounds[p]];
+    copy(parts[p].indices, parts[p].indices + parts[p].size, indices + start);
+    copy(parts[p].values, parts[p].values + parts[p].size, values + start);
+  });
+
+  return new BasicSparseMatrix(n, m, cv, nnz, offsets, indices, values, true);
+}
+
+/// @brief Overload << operator to allow for easier printing of SparseMatrix object.
+///
+/// Entries are printed in storage order, row by row for CSR and column by column for CSC.
+/// @param s The stream to send the display data.
+/// @param sm The reference to the SparseMatrix object to print.
+/// @return A reference to the stream where the object was sent.
+template <typename T, typename I>
+ostream& operator<<(ostream& s, const BasicSparseMatrix<T, I>& sm)
+{
+  // Print matrix dimensions and common value
+  //s << sm.noRows << ", " << sm.noCols << ", " << sm.commonValue << ", " << sm.noNonSparseValues << endl;
+
+  // Print non-sparse values
+  for (I major = 0; major < sm.majorCount(); ++major) {
+    for (I k = sm.myOffsets[major]; k < sm.myOffsets[major + 1]; ++k) {
+      I row = sm.rowMajor ? major : sm.myIndices[k];
+      I col = sm.rowMajor ? sm.myIndices[k] : major;
+      s << row << ", " << col << ", " << sm.myValues[k] << endl;
+    }
+  }
+
+  return s;
+}
+
+/// @brief Display the matrix in its original format.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::displayMatrix() const
+{
+  cout.flush(); // Whatever cout holds goes out before the rows
+  this->displayMatrix(1);
+}
+
+/// @brief Writes the matrix in its original format, one row per line, to a file descriptor.
+///
+/// Every row is walked with a cursor over its sorted entries, so printing costs O(n*m) with no
+/// getValue() lookups. The text collects in a 1 MiB buffer that goes out in large write() calls, and
+/// runs of the common value are copied from a pre-formatted strip rather than formatted cell by cell.
+/// @param fd The file descriptor to write to, 1 for standard output.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::displayMatrix(int fd) const
+{
+  typedef typename conditional<is_integral<T>::value, long long, double>::type Printed; ///< Picks formatValue()
+  BasicSparseMatrix* rows = rowMajor ? nullptr : Recompress(true);
+  const BasicSparseMatrix& A = rows ? *rows : *this;
+
+  const size_t capacity = 1 << 20;
+  const size_t cellRoom = 64; // More than the longest formatted value and its separator
+  char* buffer = new char[capacity];
+  size_t used = 0;
+  bool written = true;
+  auto flush = [&]() {
+    written = written && writeAll(fd, buffer, used);
+    used = 0;
+  };
+
+  // The common value followed by its separator, repeated over a strip of about 4 KiB
+  char common[cellRoom];
+  size_t commonLength = formatValue((Printed)commonValue, common) - common;
+  common[commonLength++] = ' ';
+  size_t stripCells = 4096 / commonLength;
+  char* strip = new char[stripCells * commonLength];
+  for (size_t c = 0; c < stripCells; ++c) {
+    memcpy(strip + c * commonLength, common, commonLength);
+  }
+  auto fillCommon = [&](I count) {
+    while (count > 0) {
+      size_t cells = min((size_t)count, stripCells);
+      if (capacity - used < cells * commonLength) {
+        flush();
+      }
+      memcpy(buffer + used, strip, cells * commonLength);
+      used += cells * commonLength;
+      count -= (I)cells;
+    }
+  };
+
+  for (I i = 0; i < noRows; ++i) {
+    I j = 0;
+    for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+      fillCommon(A.myIndices[k] - j);
+      if (capacity - used < cellRoom) {
+        flush();
+      }
+      used = formatValue((Printed)A.myValues[k], buffer + used) - buffer;
+      buffer[used++] = ' ';
+      j = A.myIndices[k] + 1;
+    }
+    fillCommon(noCols - j);
+    if (used == capacity) {
+      flush();
+    }
+    buffer[used++] = '\n';
+  }
+  flush();
+
+  delete[] buffer;
+  delete[] strip;
+  delete rows;
+  if (!written) {
+    throw std::runtime_error("Could not write the matrix");
+  }
+}
+
+/// @brief Writes the matrix as a Matrix Market coordinate file.
+/// @param fd The file descriptor to write to.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::writeMarket(int fd) const
+{
+  this->writeMarket(fd, 1);
+}
+
+/// @brief Writes the matrix as a Matrix Market coordinate file, with the lines formatted in parallel.
+///
+/// Every cell that is not zero becomes one "row col value" line with 1-based indices, in row order.
+/// The format has no background value, so a matrix with a non-zero common value lists every cell
+/// it does not store as well. Rows are written in rounds: the parts format their share of the round
+/// into their own buffers, which then go out in order, so memory stays bounded whatever the size.
+/// Floating point values are printed with enough digits to be read back exactly.
+/// @param fd The file descriptor to write to.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::writeMarket(int fd, int noThreads) const
+{
+  BasicSparseMatrix* rows = rowMajor ? nullptr : Recompress(true);
+  const BasicSparseMatrix& A = rows ? *rows : *this;
+  long long noLines = 0;
+  for (I k = 0; k < A.noNonSparseValues; ++k) {
+    noLines += A.myValues[k] != 0;
+  }
+  if (A.commonValue != 0) {
+    noLines += (long long)noRows * noCols - A.noNonSparseValues;
+  }
+  char header[160];
+  int headerLength = snprintf(header, sizeof(header), "%%%%MatrixMarket matrix coordinate %s general\n%lld %lld %lld\n",
+                              is_integral<T>::value ? "integer" : "real", (long long)noRows, (long long)noCols, noLines);
+  bool written = writeAll(fd, header, headerLength);
+
+  // Formats row i, growing the part's buffer so it holds the whole row
+  const size_t lineRoom = 64; // Two indices, a value and the separators
+  auto formatRow = [&](I i, char*& buffer, size_t& capacity, size_t& used) {
+    size_t needed = used + lineRoom * (size_t)(A.commonValue != 0 ? noCols : A.myOffsets[i + 1] - A.myOffsets[i]);
+    if (needed > capacity) {
+      capacity = max(needed, 2 * capacity);
+      char* bigger = new char[capacity];
+      memcpy(bigger, buffer, used);
+      delete[] buffer;
+      buffer = bigger;
+    }
+    char* out = buffer + used;
+    char row[24];
+    size_t rowLength = formatValue((long long)i + 1, row) - row;
+    row[rowLength++] = ' ';
+    auto line = [&](I j, T value) {
+      memcpy(out, row, rowLength);
+      out = formatValue((long long)j + 1, out + rowLength);
+      *out++ = ' ';
+      if (is_integral<T>::value || ((double)value > -1e15 && (double)value < 1e15 && value == (T)(long long)value)) {
+        out = formatValue((long long)value, out); // Whole numbers skip snprintf()
+      } else {
+        out += snprintf(out, 32, "%.*g", numeric_limits<T>::max_digits10, (double)value);
+      }
+      *out++ = '\n';
+    };
+    I j = 0;
+    for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+      for (; A.commonValue != 0 && j < A.myIndices[k]; ++j) {
+        line(j, A.commonValue);
+      }
+      if (A.myValues[k] != 0) {
+        line(A.myIndices[k], A.myValues[k]);
+      }
+      j = A.myIndices[k] + 1;
+    }
+    for (; A.commonValue != 0 && j < noCols; ++j) {
+      line(j, A.commonValue);
+    }
+    used = out - buffer;
+  };
+
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, noRows));
+  const long long linesPerPart = 1 << 16;
+  char** buffers = new char*[noParts];
+  size_t* capacities = new size_t[noParts];
+  size_t* used = new size_t[noParts];
+  for (int p = 0; p < noParts; ++p) {
+    capacities[p] = linesPerPart * lineRoom;
+    buffers[p] = new char[capacities[p]];
+  }
+  I* bounds = new I[noParts + 1];
+  for (I first = 0; first < noRows && written; ) {
+    // A round takes rows until every part has about linesPerPart lines to format
+    I last = first;
+    long long lines = 0;
+    while (last < noRows && lines < linesPerPart * noParts) {
+      lines += 1 + (A.commonValue != 0 ? noCols : A.myOffsets[last + 1] - A.myOffsets[last]);
+      ++last;
+    }
+    for (int p = 0; p <= noParts; ++p) {
+      bounds[p] = first + (I)((long long)(last - first) * p / noParts);
+    }
+    runParts(noParts, [&](int p) {
+      used[p] = 0;
+      for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+        formatRow(i, buffers[p], capacities[p], used[p]);
+      }
+    });
+    for (int p = 0; p < noParts; ++p) {
+      written = written && writeAll(fd, buffers[p], used[p]);
+    }
+    first = last;
+  }
+
+  for (int p = 0; p < noParts; ++p) {
+    delete[] buffers[p];
+  }
+  delete[] buffers;
+  delete[] capacities;
+  delete[] used;
+  delete[] bounds;
+  delete rows;
+  if (!written) {
+    throw std::runtime_error("Could not write the matrix");
+  }
+}
+
+/// @brief Formats an integer in decimal.
+/// @param value The value to format.
+/// @param out Receives the digits, at least 20 bytes.
+/// @return The end of the text written.
+template <typename T, typename I>
+char* BasicSparseMatrix<T, I>::formatValue(long long value, char* out)
+{
+  // Digits come out last first; the magnitude is taken unsigned so the smallest value survives
+  unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+  char digits[20];
+  int count = 0;
+  do {
+    digits[count++] = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0) {
+    *out++ = '-';
+  }
+  while (count > 0) {
+    *out++ = digits[--count];
+  }
+  return out;
+}
+
+/// @brief Formats a floating point value the way cout does by default, %g with 6 digits.
+/// @param value The value to format.
+/// @param out Receives the text, at least 32 bytes.
+/// @return The end of the text written.
+template <typename T, typename I>
+char* BasicSparseMatrix<T, I>::formatValue(double value, char* out)
+{
+  return out + snprintf(out, 32, "%g", value);
+}
+
+/// @brief Set value in the matrix.
+///
+/// Existing entries are updated in place. A new entry is inserted into its row keeping the columns
+/// sorted, which shifts the entries stored after it; bulk loading should go through SparseMatrixBuilder.
+/// @param row The row index.
+/// @param col The column index.
+/// @param value The value to set.
+template <typename T, typename I>
+void BasicSparseMatrix<T, I>::setValue(I row, I col, T value)
+{
+  if (row < 0 || row >= noRows || col < 0 || col >= noCols) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+
+  detach();
+
+  // Check if the value already exists in the matrix
+  I pos = find(row, col);
+  if (pos != -1) {
+    // Update the value if it already exists
+    myValues[pos] = value;
+    return;
+  }
+
+  // Grow the arrays geometrically so repeated inserts stay amortized
+  if (noNonSparseValues == capacity) {
+    reserve(capacity < 4 ? 8 : capacity * 2);
+  }
+
+  // Insert in front of the first larger index of the row, shifting everything after it
+  I major = rowMajor ? row : col;
+  I minor = rowMajor ? col : row;
+  I at = (I)(lower_bound(myIndices + myOffsets[major], myIndices + myOffsets[major + 1], minor) - myIndices);
+  copy_backward(myIndices + at, myIndices + noNonSparseValues, myIndices + noNonSparseValues + 1);
+  copy_backward(myValues + at, myValues + noNonSparseValues, myValues + noNonSparseValues + 1);
+  myIndices[at] = minor;
+  myValues[at] = value;
+  for (I i = major + 1; i <= majorCount(); ++i) {
+    ++myOffsets[i];
+  }
+  ++noNonSparseValues;
+}
+
+/// @brief Get value from the matrix.
+/// @param row The row index.
+/// @param col The column index.
+/// @return The value at the specified row and column.
+template <typename T, typename I>
+T BasicSparseMatrix<T, I>::getValue(I row, I col) const
+{
+  if (row < 0 || row >= noRows || col < 0 || col >= noCols) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+  I pos = find(row, col);
+  return pos != -1 ? myValues[pos] : commonValue;
+}
+
+/// @brief Gets the number of rows of the matrix.
+/// @return The number of rows.
+template <typename T, typename I>
+I BasicSparseMatrix<T, I>::getNoRows() const
+{
+  return this->noRows;
+}
+
+/// @brief Gets the number of columns of the matrix.
+/// @return The number of columns.
+template <typename T, typename I>
+I BasicSparseMatrix<T, I>::getNoCols() const
+{
+  return this->noCols;
+}
+
+/// @brief Gets the common (background) value of the matrix.
+/// @return The common value.
+template <typename T, typename I>
+T BasicSparseMatrix<T, I>::getCommonValue() const
+{
+  return this->commonValue;
+}
+
+/// @brief Gets the number of entries stored in the matrix.
+/// @return The number of non-sparse values.
+template <typename T, typename I>
+I BasicSparseMatrix<T, I>::getNoNonSparseValues() const
+{
+  return this->noNonSparseValues;
+}
+
+/// @brief Tells how the entries are compressed.
+/// @return True for CSR (by rows), false for CSC (by columns).
+template <typename T, typename I>
+bool BasicSparseMatrix<T, I>::isRowMajor() const
+{
+  return this->rowMajor;
+}
+
+/// @brief Prepares a matrix for repeated products.
+/// @param A The matrix, compressed either way.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+BasicSparseVectorPlan<T, I>::BasicSparseVectorPlan(const BasicSparseMatrix<T, I>& A, int noThreads)
+  : myRows(A.rowMajor ? nullptr : A.Recompress(true)), matrix(myRows ? *myRows : A)
+{
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  noParts = (int)max((I)1, min((I)noThreads, matrix.noRows));
+  myBounds = new I[noParts + 1];
+  matrix.balanceEntries(noParts, myBounds);
+}
+
+/// @brief Deletes the split and the rows of a CSC matrix.
+template <typename T, typename I>
+BasicSparseVectorPlan<T, I>::~BasicSparseVectorPlan()
+{
+  delete[] myBounds;
+  delete myRows;
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x, over the split made by the constructor.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+template <typename T, typename I>
+void BasicSparseVectorPlan<T, I>::Multiply(const T* x, T* y) const
+{
+  matrix.multiplyRows(x, y, noParts, myBounds);
+}
+
+/// @return The matrix the plan multiplies with, compressed by rows.
+template <typename T, typename I>
+const BasicSparseMatrix<T, I>& BasicSparseVectorPlan<T, I>::getMatrix() const
+{
+  return matrix;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              SparseMatrixBuilder Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Constructs an empty builder for a matrix of the given shape.
+/// @param n the number of rows of the entire matrix.
+/// @param m the number of columns of the entire matrix.
+/// @param cv the common(default) value of the matrix.
+/// @param nsv the expected number of non-sparse values, entries beyond it are still accepted.
+/// @param hashed true to look cells up in a hash table, for producers that update cells repeatedly.
+template <typename T, typename I>
+BasicSparseMatrixBuilder<T, I>::BasicSparseMatrixBuilder(I n, I m, T cv, I nsv, bool hashed)
+  : noRows(n), noCols(m), commonValue(cv), noEntries(0), capacity(nsv > 0 ? nsv : 0), hashed(hashed), noSlots(0),
+    mySlots(nullptr)
+{
+  if (n < 0 || m < 0) {
+    throw std::invalid_argument("Matrix dimensions must not be negative");
+  }
+  myRows = new I[capacity];
+  myCols = new I[capacity];
+  myVals = new T[capacity];
+  if (hashed) {
+    I slots = 16;
+    while (slots < 2 * capacity) {
+      slots *= 2;
+    }
+    rehash(slots);
+  }
+}
+
+/// @brief Deletes the recorded entries.
+template <typename T, typename I>
+BasicSparseMatrixBuilder<T, I>::~BasicSparseMatrixBuilder()
+{
+  delete[] myRows;
+  delete[] myCols;
+  delete[] myVals;
+  delete[] mySlots;
+  myRows = nullptr;
+  myCols = nullptr;
+  myVals = nullptr;
+  mySlots = nullptr;
+}
+
+/// @brief Finds the slot of a cell by linear probing from its hash.
+///
+/// The key row*noCols + col is spread with a Fibonacci multiply, whose high half makes a good index
+/// even for the regular keys of banded or blocked updates.
+/// @param row The row index.
+/// @param col The column index.
+/// @return The slot holding the cell, or the empty slot where it would be inserted.
+template <typename T, typename I>
+I BasicSparseMatrixBuilder<T, I>::slotOf(I row, I col) const
+{
+  unsigned long long key = (unsigned long long)row * (unsigned long long)noCols + (unsigned long long)col;
+  I mask = noSlots - 1;
+  I slot = (I)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+  while (mySlots[slot] != -1) {
+    if (myRows[mySlots[slot]] == row && myCols[mySlots[slot]] == col) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/// @brief Replaces the hash table with an empty one of the given size and reinserts every entry.
+/// @param newNoSlots The new number of slots, a power of two larger than noEntries.
+template <typename T, typename I>
+void BasicSparseMatrixBuilder<T, I>::rehash(I newNoSlots)
+{
+  delete[] mySlots;
+  mySlots = new I[newNoSlots];
+  fill(mySlots, mySlots + newNoSlots, (I)-1);
+  noSlots = newNoSlots;
+  for (I i = 0; i < noEntries; ++i) {
+    mySlots[slotOf(myRows[i], myCols[i])] = i;
+  }
+}
+
+/// @brief Records a value for (row, col), overriding anything set for that cell earlier.
+/// @param row The row index.
+/// @param col The column index.
+/// @param value The value to set.
+template <typename T, typename I>
+void BasicSparseMatrixBuilder<T, I>::setValue(I row, I col, T value)
+{
+  if (row < 0 || row >= noRows || col < 0 || col >= noCols) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+
+  // A hashed builder updates a cell it already holds in place, and keeps the table at most half full
+  if (hashed) {
+    if (2 * (noEntries + 1) > noSlots) {
+      rehash(noSlots * 2);
+    }
+    I slot = slotOf(row, col);
+    if (mySlots[slot] != -1) {
+      myVals[mySlots[slot]] = value;
+      return;
+    }
+    mySlots[slot] = noEntries;
+  }
+
+  // Only grows when the nsv hint was too small
+  if (noEntries == capacity) {
+    I newCapacity = capacity < 4 ? 8 : capacity * 2;
+    I* newRows = new I[newCapacity];
+    I* newCols = new I[newCapacity];
+    T* newVals = new T[newCapacity];
+    copy(myRows, myRows + noEntries, newRows);
+    copy(myCols, myCols + noEntries, newCols);
+    copy(myVals, myVals + noEntries, newVals);
+    delete[] myRows;
+    delete[] myCols;
+    delete[] myVals;
+    myRows = newRows;
+    myCols = newCols;
+    myVals = newVals;
+    capacity = newCapacity;
+  }
+  myRows[noEntries] = row;
+  myCols[noEntries] = col;
+  myVals[noEntries] = value;
+  ++noEntries;
+}
+
+/// @brief Looks up the value recorded for a cell.
+///
+/// Expected O(1) for a hashed builder. An appending builder scans its entries from the latest, which
+/// is linear, so producers that read back while building should ask for a hashed builder.
+/// @param row The row index.
+/// @param col The column index.
+/// @return The last value set for the cell, or the common value.
+template <typename T, typename I>
+T BasicSparseMatrixBuilder<T, I>::getValue(I row, I col) const
+{
+  if (row < 0 || row >= noRows || col < 0 || col >= noCols) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+  if (hashed) {
+    I slot = slotOf(row, col);
+    return mySlots[slot] != -1 ? myVals[mySlots[slot]] : commonValue;
+  }
+  for (I i = noEntries - 1; i >= 0; --i) {
+    if (myRows[i] == row && myCols[i] == col) {
+      return myVals[i];
+    }
+  }
+  return commonValue;
+}
+
+/// @brief Gets the number of recorded entries.
+/// @return The number of entries, which counts repeated cells unless the builder is hashed.
+template <typename T, typename I>
+I BasicSparseMatrixBuilder<T, I>::getNoEntries() const
+{
+  return this->noEntries;
+}
+
+/// @brief Tells whether cells are found through the hash table.
+/// @return True for a hashed builder.
+template <typename T, typename I>
+bool BasicSparseMatrixBuilder<T, I>::isHashed() const
+{
+  return this->hashed;
+}
+
+/// @brief Sorts the recorded entries into CSR arrays and hands them to a new SparseMatrix.
+///
+/// Entries are bucketed by row with a stable counting sort, then each row is sorted by column
+/// unless it already is (the usual case for row-major input). Columns and values are scattered into
+/// separate arrays, so the sortedness check and the row sort only walk the contiguous columns of a row.
+/// Of several values set for one cell, the last wins.
+/// A hashed builder holds every cell once, so there is nothing to drop.
+/// @return The frozen matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicSparseMatrixBuilder<T, I>::freeze()
+{
+  // Count the entries of every row and turn the counts into row starts
+  I* offsets = new I[noRows + 1]();
+  for (I i = 0; i < noEntries; ++i) {
+    ++offsets[myRows[i] + 1];
+  }
+  for (I r = 0; r < noRows; ++r) {
+    offsets[r + 1] += offsets[r];
+  }
+
+  // Stable scatter into row buckets
+  I* bucketCols = new I[noEntries];
+  T* bucketVals = new T[noEntries];
+  I* next = new I[noRows];
+  copy(offsets, offsets + noRows, next);
+  for (I i = 0; i < noEntries; ++i) {
+    I at = next[myRows[i]]++;
+    bucketCols[at] = myCols[i];
+    bucketVals[at] = myVals[i];
+  }
+  delete[] next;
+
+  // Sort every row by column, through a row-local order, and keep only the last value set for each cell
+  I* indices = new I[noEntries];
+  T* values = new T[noEntries];
+  I* order = new I[noEntries];
+  I nnz = 0;
+  for (I r = 0; r < noRows; ++r) {
+    I first = offsets[r];
+    I length = offsets[r + 1] - first;
+    const I* cols = bucketCols + first;
+    const T* vals = bucketVals + first;
+    bool sorted = true;
+    for (I k = 0; k + 1 < length; ++k) {
+      if (cols[k] >= cols[k + 1]) {
+        sorted = false;
+        break;
+      }
+    }
+    for (I k = 0; k < length; ++k) {
+      order[k] = k;
+    }
+    if (!sorted) {
+      stable_sort(order, order + length, [cols](I a, I b) { return cols[a] < cols[b]; });
+    }
+    offsets[r] = nnz;
+    for (I k = 0; k < length; ++k) {
+      if (k + 1 < length && cols[order[k + 1]] == cols[order[k]]) {
+        continue; // A later value for the same cell follows
+      }
+      indices[nnz] = cols[order[k]];
+      values[nnz] = vals[order[k]];
+      ++nnz;
+    }
+  }
+  offsets[noRows] = nnz;
+  delete[] bucketCols;
+  delete[] bucketVals;
+  delete[] order;
+
+  // Leave the builder empty but usable
+  delete[] myRows;
+  delete[] myCols;
+  delete[] myVals;
+  myRows = new I[0];
+  myCols = new I[0];
+  myVals = new T[0];
+  noEntries = 0;
+  capacity = 0;
+  if (hashed) {
+    rehash(16);
+  }
+
+  return new BasicSparseMatrix<T, I>(noRows, noCols, commonValue, nnz, offsets, indices, values, true);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              BlockSparseMatrix Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Multiplies one block row with x, y[r] = sum over its blocks of (block(r, c) - shift) * x[c].
+/// @param cols The block column of every block in the row.
+/// @param blocks The values of the blocks, B*B each, column by column.
+/// @param count The number of blocks in the row.
+/// @param x The dense vector, padded to whole blocks.
+/// @param shift Subtracted from every value, the common value of the matrix.
+/// @param y Receives the B sums.
+template <typename T, typename I, int B>
+void BlockKernel<T, I, B>::multiplyRow(const I* cols, const T* blocks, I count, const T* x, T shift, Sum* y)
+{
+  Sum acc[B] = {};
+  for (I b = 0; b < count; ++b) {
+    const T* block = blocks + (size_t)b * B * B;
+    const T* xs = x + (size_t)cols[b] * B;
+    for (int c = 0; c < B; ++c) {
+      Sum xc = xs[c];
+      for (int r = 0; r < B; ++r) {
+        acc[r] += (Sum)(block[c * B + r] - shift) * xc;
+      }
+    }
+  }
+  copy(acc, acc + B, y);
+}
+
+/// @brief Accumulates the product of two blocks, c += a*b, every block column by column.
+/// @param a The left block.
+/// @param b The right block.
+/// @param c The running sums of the result block.
+template <typename T, typename I, int B>
+void BlockKernel<T, I, B>::multiplyTile(const T* a, const T* b, Sum* c)
+{
+  for (int j = 0; j < B; ++j) {
+    for (int k = 0; k < B; ++k) {
+      Sum bkj = b[j * B + k];
+      for (int r = 0; r < B; ++r) {
+        c[j * B + r] += (Sum)a[k * B + r] * bkj;
+      }
+    }
+  }
+}
+
+#if defined(__AVX2__)
+/// @brief AVX2 block row kernel for 4 by 4 double blocks: one register holds the four row sums.
+template <>
+void BlockKernel<double, int, 4>::multiplyRow(const int* cols, const double* blocks, int count, const double* x,
+                                              double shift, double* y)
+{
+  __m256d acc = _mm256_setzero_pd();
+  __m256d shifts = _mm256_set1_pd(shift);
+  for (int b = 0; b < count; ++b) {
+    const double* block = blocks + (size_t)b * 16;
+    const double* xs = x + (size_t)cols[b] * 4;
+    for (int c = 0; c < 4; ++c) {
+      __m256d column = _mm256_sub_pd(_mm256_loadu_pd(block + c * 4), shifts);
+      acc = _mm256_add_pd(acc, _mm256_mul_pd(column, _mm256_broadcast_sd(xs + c)));
+    }
+  }
+  _mm256_storeu_pd(y, acc);
+}
+
+/// @brief AVX2 block row kernel for 8 by 8 double blocks: two registers hold the eight row sums.
+template <>
+void BlockKernel<double, int, 8>::multiplyRow(const int* cols, const double* blocks, int count, const double* x,
+                                              double shift, double* y)
+{
+  __m256d low = _mm256_setzero_pd();
+  __m256d high = _mm256_setzero_pd();
+  __m256d shifts = _mm256_set1_pd(shift);
+  for (int b = 0; b < count; ++b) {
+    const double* block = blocks + (size_t)b * 64;
+    const double* xs = x + (size_t)cols[b] * 8;
+    for (int c = 0; c < 8; ++c) {
+      __m256d xc = _mm256_broadcast_sd(xs + c);
+      low = _mm256_add_pd(low, _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(block + c * 8), shifts), xc));
+      high = _mm256_add_pd(high, _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(block + c * 8 + 4), shifts), xc));
+    }
+  }
+  _mm256_storeu_pd(y, low);
+  _mm256_storeu_pd(y + 4, high);
+}
+
+/// @brief AVX2 block row kernel for 4 by 4 int blocks, widening every column to 64 bit lanes.
+template <>
+void BlockKernel<int, int, 4>::multiplyRow(const int* cols, const int* blocks, int count, const int* x, int shift,
+                                           long long* y)
+{
+  __m256i acc = _mm256_setzero_si256();
+  __m128i shifts = _mm_set1_epi32(shift);
+  for (int b = 0; b < count; ++b) {
+    const int* block = blocks + (size_t)b * 16;
+    const int* xs = x + (size_t)cols[b] * 4;
+    for (int c = 0; c < 4; ++c) {
+      __m128i column = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(block + c * 4)), shifts);
+      acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_cvtepi32_epi64(column), _mm256_set1_epi64x(xs[c])));
+    }
+  }
+  _mm256_storeu_si256((__m256i*)y, acc);
+}
+
+/// @brief AVX2 block row kernel for 8 by 8 int blocks, widening every column to 64 bit lanes.
+template <>
+void BlockKernel<int, int, 8>::multiplyRow(const int* cols, const int* blocks, int count, const int* x, int shift,
+                                           long long* y)
+{
+  __m256i low = _mm256_setzero_si256();
+  __m256i high = _mm256_setzero_si256();
+  __m256i shifts = _mm256_set1_epi32(shift);
+  for (int b = 0; b < count; ++b) {
+    const int* block = blocks + (size_t)b * 64;
+    const int* xs = x + (size_t)cols[b] * 8;
+    for (int c = 0; c < 8; ++c) {
+      __m256i column = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(block + c * 8)), shifts);
+      __m256i xc = _mm256_set1_epi64x(xs[c]);
+      low = _mm256_add_epi64(low, _mm256_mul_epi32(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(column)), xc));
+      high = _mm256_add_epi64(high, _mm256_mul_epi32(_mm256_cvtepi32_epi64(_mm256_extracti128_si256(column, 1)), xc));
+    }
+  }
+  _mm256_storeu_si256((__m256i*)y, low);
+  _mm256_storeu_si256((__m256i*)(y + 4), high);
+}
+#endif
+
+/// @brief Constructs a matrix of the given shape with no arrays, for the kernels to fill in.
+/// @param n the number of rows of the entire matrix.
+/// @param m the number of columns of the entire matrix.
+/// @param cv the common(default) value of the matrix.
+/// @param blockSize the rows and columns of a block.
+template <typename T, typename I>
+BasicBlockSparseMatrix<T, I>::BasicBlockSparseMatrix(I n, I m, T cv, int blockSize)
+  : noRows(n), noCols(m), commonValue(cv), blockSize(blockSize), noBlockRows((n + blockSize - 1) / blockSize),
+    noBlockCols((m + blockSize - 1) / blockSize), noBlocks(0), myOffsets(nullptr), myIndices(nullptr),
+    myValues(nullptr)
+{
+}
+
+/// @brief Copies a matrix into blocks.
+///
+/// Every block row is gathered in two passes over its rows: the first finds the distinct block columns
+/// it touches, the second copies the entries into their blocks, which start out filled with the common
+/// value.
+/// @param M The matrix to block, compressed either way.
+/// @param blockSize 1, 2, 4 or 8, or 0 to let chooseBlockSize() pick one.
+template <typename T, typename I>
+BasicBlockSparseMatrix<T, I>::BasicBlockSparseMatrix(const BasicSparseMatrix<T, I>& M, int blockSize)
+  : BasicBlockSparseMatrix(M.noRows, M.noCols, M.commonValue, blockSize != 0 ? blockSize : chooseBlockSize(M))
+{
+  checkBlockSize(this->blockSize);
+  BasicSparseMatrix<T, I>* rowsOfM = M.rowMajor ? nullptr : M.Recompress(true);
+  const BasicSparseMatrix<T, I>& A = rowsOfM ? *rowsOfM : M;
+  const int B = this->blockSize;
+
+  // Count the distinct block columns of every block row, seen[] holds the block row that saw one last
+  I* seen = new I[noBlockCols];
+  fill(seen, seen + noBlockCols, (I)-1);
+  myOffsets = new I[noBlockRows + 1];
+  myOffsets[0] = 0;
+  for (I bi = 0; bi < noBlockRows; ++bi) {
+    I count = 0;
+    for (I i = bi * B; i < min((I)(bi * B + B), noRows); ++i) {
+      for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+        I bj = A.myIndices[k] / B;
+        if (seen[bj] != bi) {
+          seen[bj] = bi;
+          ++count;
+        }
+      }
+    }
+    myOffsets[bi + 1] = myOffsets[bi] + count;
+  }
+  noBlocks = myOffsets[noBlockRows];
+
+  // List the block columns of every block row in order, then drop the entries into their blocks
+  myIndices = new I[noBlocks];
+  myValues = new T[(size_t)noBlocks * B * B];
+  fill(myValues, myValues + (size_t)noBlocks * B * B, commonValue);
+  I* slot = new I[noBlockCols];
+  fill(seen, seen + noBlockCols, (I)-1);
+  for (I bi = 0; bi < noBlockRows; ++bi) {
+    I* cols = myIndices + myOffsets[bi];
+    I count = 0;
+    I end = min((I)(bi * B + B), noRows);
+    for (I i = bi * B; i < end; ++i) {
+      for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+        I bj = A.myIndices[k] / B;
+        if (seen[bj] != bi) {
+          seen[bj] = bi;
+          cols[count++] = bj;
+        }
+      }
+    }
+    sort(cols, cols + count);
+    for (I b = 0; b < count; ++b) {
+      slot[cols[b]] = myOffsets[bi] + b;
+    }
+    for (I i = bi * B; i < end; ++i) {
+      for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+        I j = A.myIndices[k];
+        myValues[(size_t)slot[j / B] * B * B + (j % B) * B + (i - bi * B)] = A.myValues[k];
+      }
+    }
+  }
+  delete[] seen;
+  delete[] slot;
+  delete rowsOfM;
+}
+
+/// @brief Deletes the block arrays.
+template <typename T, typename I>
+BasicBlockSparseMatrix<T, I>::~BasicBlockSparseMatrix()
+{
+  delete[] myOffsets;
+  delete[] myIndices;
+  delete[] myValues;
+  myOffsets = nullptr;
+  myIndices = nullptr;
+  myValues = nullptr;
+}
+
+/// @brief Rejects block sizes there are no kernels for.
+/// @param blockSize The requested block size.
+template <typename T, typename I>
+void BasicBlockSparseMatrix<T, I>::checkBlockSize(int blockSize)
+{
+  if (blockSize != 1 && blockSize != 2 && blockSize != 4 && blockSize != 8) {
+    throw std::invalid_argument("Block size must be 1, 2, 4 or 8");
+  }
+}
+
+/// @brief Picks the block size that moves the fewest bytes through a product, judging from a sample.
+///
+/// Up to noSamples windows of 8 rows, spread evenly over the matrix, are blocked at every size. A size
+/// costs B*B values plus one index per block it needs, plain CSR one value plus one index per entry,
+/// and the cheapest wins. Matrices whose entries do not cluster come out at 1, no blocking.
+/// @param M The matrix to sample.
+/// @param noSamples The number of 8 row windows to look at.
+/// @return 1, 2, 4 or 8.
+template <typename T, typename I>
+int BasicBlockSparseMatrix<T, I>::chooseBlockSize(const BasicSparseMatrix<T, I>& M, I noSamples)
+{
+  BasicSparseMatrix<T, I>* rowsOfM = M.rowMajor ? nullptr : M.Recompress(true);
+  const BasicSparseMatrix<T, I>& A = rowsOfM ? *rowsOfM : M;
+  I noWindows = (A.noRows + 7) / 8;
+  I stride = max((I)1, noWindows / max((I)1, noSamples));
+
+  // Windows start on multiples of 8, so no block row of size 2, 4 or 8 straddles two of them
+  long long entries = 0;
+  long long blocks[3] = {0, 0, 0};
+  I* seen = new I[A.noCols / 2 + 1];
+  for (int s = 0; s < 3; ++s) {
+    int B = 2 << s;
+    fill(seen, seen + A.noCols / 2 + 1, (I)-1);
+    for (I w = 0; w < noWindows; w += stride) {
+      for (I i = w * 8; i < min((I)(w * 8 + 8), A.noRows); ++i) {
+        for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+          I bj = A.myIndices[k] / B;
+          if (seen[bj] != i / B) {
+            seen[bj] = i / B;
+            ++blocks[s];
+          }
+        }
+        entries += s == 0 ? A.myOffsets[i + 1] - A.myOffsets[i] : 0;
+      }
+    }
+  }
+  delete[] seen;
+  delete rowsOfM;
+
+  int best = 1;
+  long long bestCost = entries * (long long)(sizeof(T) + sizeof(I));
+  for (int s = 0; s < 3; ++s) {
+    int B = 2 << s;
+    long long cost = blocks[s] * (long long)(B * B * sizeof(T) + sizeof(I));
+    if (cost < bestCost) {
+      best = B;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
+/// @brief Copies the matrix back into CSR form, leaving out cells that hold the common value.
+/// @return The CSR matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicBlockSparseMatrix<T, I>::toSparse() const
+{
+  const int B = blockSize;
+
+  // Walks row i, only counting when indices is null, and returns the number of entries kept
+  auto walkRow = [&](I i, I* indices, T* values) {
+    I kept = 0;
+    I bi = i / B;
+    int r = (int)(i % B);
+    for (I b = myOffsets[bi]; b < myOffsets[bi + 1]; ++b) {
+      const T* block = myValues + (size_t)b * B * B;
+      for (int c = 0; c < B && myIndices[b] * B + c < noCols; ++c) {
+        if (block[c * B + r] != commonValue) {
+          if (indices != nullptr) {
+            indices[kept] = myIndices[b] * B + c;
+            values[kept] = block[c * B + r];
+          }
+          ++kept;
+        }
+      }
+    }
+    return kept;
+  };
+
+  I* offsets = new I[noRows + 1];
+  offsets[0] = 0;
+  for (I i = 0; i < noRows; ++i) {
+    offsets[i + 1] = offsets[i] + walkRow(i, nullptr, nullptr);
+  }
+  I nnz = offsets[noRows];
+  I* indices = new I[nnz];
+  T* values = new T[nnz];
+  for (I i = 0; i < noRows; ++i) {
+    walkRow(i, indices + offsets[i], values + offsets[i]);
+  }
+  return new BasicSparseMatrix<T, I>(noRows, noCols, commonValue, nnz, offsets, indices, values, true);
+}
+
+/// @brief Multiplies two block matrices together and returns the result as a new matrix.
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @return The product, blocked like this matrix, owned by the caller.
+template <typename T, typename I>
+BasicBlockSparseMatrix<T, I>* BasicBlockSparseMatrix<T, I>::Multiply(const BasicBlockSparseMatrix &M) const
+{
+  return this->Multiply(M, 1);
+}
+
+/// @brief Multiplies two block matrices with the block rows of the result split across threads.
+///
+/// Runs the block Gustavson product of multiplyBlocks() for the block size at hand. M is re-blocked
+/// first if its block size differs, and operands with a non-zero common value go through
+/// SparseMatrix::Multiply.
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The product, blocked like this matrix, owned by the caller.
+template <typename T, typename I>
+BasicBlockSparseMatrix<T, I>* BasicBlockSparseMatrix<T, I>::Multiply(const BasicBlockSparseMatrix &M,
+                                                                     int noThreads) const
+{
+  if (this->noCols != M.noRows) {
+    throw std::invalid_argument("Matrix multiplication is not possible");
+  }
+
+  if (this->commonValue != 0 || M.commonValue != 0) {
+    BasicSparseMatrix<T, I>* left = this->toSparse();
+    BasicSparseMatrix<T, I>* right = M.toSparse();
+    BasicSparseMatrix<T, I>* product = left->Multiply(*right, noThreads);
+    BasicBlockSparseMatrix* result = new BasicBlockSparseMatrix(*product, this->blockSize);
+    delete left;
+    delete right;
+    delete product;
+    return result;
+  }
+  if (M.blockSize != this->blockSize) {
+    BasicSparseMatrix<T, I>* sparse = M.toSparse();
+    BasicBlockSparseMatrix reblocked(*sparse, this->blockSize);
+    delete sparse;
+    return this->Multiply(reblocked, noThreads);
+  }
+
+  switch (this->blockSize) {
+    case 1:
+      return this->template multiplyBlocks<1>(M, noThreads);
+    case 2:
+      return this->template multiplyBlocks<2>(M, noThreads);
+    case 4:
+      return this->template multiplyBlocks<4>(M, noThreads);
+    default:
+      return this->template multiplyBlocks<8>(M, noThreads);
+  }
+}
+
+/// @brief Block Gustavson product for one block size, on operands with a zero common value.
+///
+/// A first pass counts the distinct block columns of every block row of the result, so the arrays
+/// are allocated once at their exact size. The second pass sums B*B tiles in the accumulator type and
+/// narrows them into place. The structure is the symbolic product: a block whose products cancel out
+/// stays stored, as zeros.
+/// @param M The matrix to multiply with, blocked by B.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The product, owned by the caller.
+template <typename T, typename I>
+template <int B>
+BasicBlockSparseMatrix<T, I>* BasicBlockSparseMatrix<T, I>::multiplyBlocks(const BasicBlockSparseMatrix& M,
+                                                                           int noThreads) const
+{
+  const int area = B * B;
+  I n = this->noBlockRows;
+  I m = M.noBlockCols;
+  BasicBlockSparseMatrix* result = new BasicBlockSparseMatrix(this->noRows, M.noCols, 0, B);
+
+  // The cost of a block row is the number of tile products it needs
+  long long* cost = new long long[n + 1];
+  cost[0] = 0;
+  for (I bi = 0; bi < n; ++bi) {
+    long long rowCost = 1;
+    for (I a = myOffsets[bi]; a < myOffsets[bi + 1]; ++a) {
+      rowCost += M.myOffsets[myIndices[a] + 1] - M.myOffsets[myIndices[a]];
+    }
+    cost[bi + 1] = cost[bi] + rowCost;
+  }
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, n));
+  I* bounds = new I[noParts + 1];
+  BasicSparseMatrix<T, I>::balanceRows(cost, n, noParts, bounds);
+  delete[] cost;
+
+  // Count the distinct block columns of every block row of the result
+  I* offsets = result->myOffsets = new I[n + 1];
+  offsets[0] = 0;
+  BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+    I* seen = new I[m];
+    fill(seen, seen + m, (I)-1);
+    for (I bi = bounds[p]; bi < bounds[p + 1]; ++bi) {
+      I count = 0;
+      for (I a = myOffsets[bi]; a < myOffsets[bi + 1]; ++a) {
+        for (I b = M.myOffsets[myIndices[a]]; b < M.myOffsets[myIndices[a] + 1]; ++b) {
+          if (seen[M.myIndices[b]] != bi) {
+            seen[M.myIndices[b]] = bi;
+            ++count;
+          }
+        }
+      }
+      offsets[bi + 1] = count;
+    }
+    delete[] seen;
+  });
+  for (I bi = 0; bi < n; ++bi) {
+    offsets[bi + 1] += offsets[bi];
+  }
+  result->noBlocks = offsets[n];
+  result->myIndices = new I[result->noBlocks];
+  result->myValues = new T[(size_t)result->noBlocks * area];
+
+  // Sum the tiles of every block row, then write them out in block column order
+  BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+    Sum* tiles = new Sum[(size_t)m * area];
+    I* seen = new I[m];
+    fill(seen, seen + m, (I)-1);
+    for (I bi = bounds[p]; bi < bounds[p + 1]; ++bi) {
+      I* cols = result->myIndices + offsets[bi];
+      I count = 0;
+      for (I a = myOffsets[bi]; a < myOffsets[bi + 1]; ++a) {
+        I k = myIndices[a];
+        for (I b = M.myOffsets[k]; b < M.myOffsets[k + 1]; ++b) {
+          I j = M.myIndices[b];
+          if (seen[j] != bi) {
+            seen[j] = bi;
+            fill(tiles + (size_t)j * area, tiles + (size_t)(j + 1) * area, (Sum)0);
+            cols[count++] = j;
+          }
+          BlockKernel<T, I, B>::multiplyTile(myValues + (size_t)a * area, M.myValues + (size_t)b * area,
+                                             tiles + (size_t)j * area);
+        }
+      }
+      sort(cols, cols + count);
+      for (I c = 0; c < count; ++c) {
+        const Sum* tile = tiles + (size_t)cols[c] * area;
+        T* out = result->myValues + (size_t)(offsets[bi] + c) * area;
+        for (int e = 0; e < area; ++e) {
+          out[e] = (T)tile[e];
+        }
+      }
+    }
+    delete[] tiles;
+    delete[] seen;
+  });
+
+  delete[] bounds;
+  return result;
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+template <typename T, typename I>
+void BasicBlockSparseMatrix<T, I>::MultiplyVector(const T* x, T* y) const
+{
+  this->MultiplyVector(x, y, 1);
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x, with the block rows split across threads.
+///
+/// As with SparseMatrix::MultiplyVector the background is added as commonValue * sum(x), and the
+/// blocks contribute (value - commonValue) * x, so padding cells contribute nothing.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicBlockSparseMatrix<T, I>::MultiplyVector(const T* x, T* y, int noThreads) const
+{
+  Sum background = 0;
+  if (this->commonValue != 0) {
+    Sum sumX = 0;
+    for (I j = 0; j < this->noCols; ++j) {
+      sumX += x[j];
+    }
+    background = (Sum)this->commonValue * sumX;
+  }
+
+  switch (this->blockSize) {
+    case 1:
+      this->template multiplyVectorRows<1>(x, background, y, noThreads);
+      break;
+    case 2:
+      this->template multiplyVectorRows<2>(x, background, y, noThreads);
+      break;
+    case 4:
+      this->template multiplyVectorRows<4>(x, background, y, noThreads);
+      break;
+    default:
+      this->template multiplyVectorRows<8>(x, background, y, noThreads);
+      break;
+  }
+}
+
+/// @brief Runs the block row kernel for one block size over every block row.
+/// @param x The input vector, noCols long.
+/// @param background Added to every element of y.
+/// @param y Receives the result, noRows long.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+template <int B>
+void BasicBlockSparseMatrix<T, I>::multiplyVectorRows(const T* x, Sum background, T* y, int noThreads) const
+{
+  // Pad x to whole blocks so the kernels never check for the last block column
+  T* padded = nullptr;
+  if (this->noCols % B != 0) {
+    padded = new T[(size_t)this->noBlockCols * B]();
+    copy(x, x + this->noCols, padded);
+    x = padded;
+  }
+
+  long long* cost = new long long[this->noBlockRows + 1];
+  cost[0] = 0;
+  for (I bi = 0; bi < this->noBlockRows; ++bi) {
+    cost[bi + 1] = cost[bi] + 1 + (myOffsets[bi + 1] - myOffsets[bi]);
+  }
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, this->noBlockRows));
+  I* bounds = new I[noParts + 1];
+  BasicSparseMatrix<T, I>::balanceRows(cost, this->noBlockRows, noParts, bounds);
+  delete[] cost;
+
+  BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+    Sum sums[B];
+    for (I bi = bounds[p]; bi < bounds[p + 1]; ++bi) {
+      I first = myOffsets[bi];
+      BlockKernel<T, I, B>::multiplyRow(myIndices + first, myValues + (size_t)first * B * B,
+                                        myOffsets[bi + 1] - first, x, this->commonValue, sums);
+      for (int r = 0; r < B && bi * B + r < this->noRows; ++r) {
+        y[bi * B + r] = (T)(background + sums[r]);
+      }
+    }
+  });
+  delete[] bounds;
+  delete[] padded;
+}
+
+/// @brief Get value from the matrix.
+/// @param row The row index.
+/// @param col The column index.
+/// @return The value at the specified row and column.
+template <typename T, typename I>
+T BasicBlockSparseMatrix<T, I>::getValue(I row, I col) const
+{
+  if (row < 0 || row >= noRows || col < 0 || col >= noCols) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+  I bi = row / blockSize;
+  I bj = col / blockSize;
+  const I* first = myIndices + myOffsets[bi];
+  const I* last = myIndices + myOffsets[bi + 1];
+  const I* it = lower_bound(first, last, bj);
+  if (it == last || *it != bj) {
+    return commonValue;
+  }
+  return myValues[(size_t)(it - myIndices) * blockSize * blockSize + (col % blockSize) * blockSize + row % blockSize];
+}
+
+/// @brief Gets the number of rows of the matrix.
+/// @return The number of rows.
+template <typename T, typename I>
+I BasicBlockSparseMatrix<T, I>::getNoRows() const
+{
+  return this->noRows;
+}
+
+/// @brief Gets the number of columns of the matrix.
+/// @return The number of columns.
+template <typename T, typename I>
+I BasicBlockSparseMatrix<T, I>::getNoCols() const
+{
+  return this->noCols;
+}
+
+/// @brief Gets the common (background) value of the matrix.
+/// @return The common value.
+template <typename T, typename I>
+T BasicBlockSparseMatrix<T, I>::getCommonValue() const
+{
+  return this->commonValue;
+}
+
+/// @brief Gets the block size.
+/// @return The rows and columns of a block.
+template <typename T, typename I>
+int BasicBlockSparseMatrix<T, I>::getBlockSize() const
+{
+  return this->blockSize;
+}
+
+/// @brief Gets the number of stored blocks.
+/// @return The number of blocks.
+template <typename T, typename I>
+I BasicBlockSparseMatrix<T, I>::getNoBlocks() const
+{
+  return this->noBlocks;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              TriangleSparseMatrix Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Keeps one triangle of a square matrix.
+///
+/// The cells outside the triangle are checked first: for SYMMETRIC every stored entry must be
+/// mirrored, for UPPER and LOWER the other triangle must be zero. The triangle is then copied row by
+/// row, diagonal included.
+/// @param M The matrix, compressed either way.
+/// @param shape SYMMETRIC to keep the upper triangle of a symmetric matrix, UPPER or LOWER for a
+/// triangular one.
+template <typename T, typename I>
+BasicTriangleSparseMatrix<T, I>::BasicTriangleSparseMatrix(const BasicSparseMatrix<T, I>& M, Shape shape)
+  : shape(shape), myTriangle(nullptr)
+{
+  if (M.noRows != M.noCols) {
+    throw std::invalid_argument("Matrix must be square");
+  }
+  BasicSparseMatrix<T, I>* rowsOfM = M.rowMajor ? nullptr : M.Recompress(true);
+  const BasicSparseMatrix<T, I>& A = rowsOfM ? *rowsOfM : M;
+  I n = A.noRows;
+
+  bool fits = true;
+  long long zerosOutside = 0;
+  for (I i = 0; i < n && fits; ++i) {
+    for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1] && fits; ++k) {
+      I j = A.myIndices[k];
+      if (shape == SYMMETRIC) {
+        fits = i == j || A.getValue(j, i) == A.myValues[k];
+      } else if (!inTriangle(i, j)) {
+        fits = A.myValues[k] == 0;
+        ++zerosOutside;
+      }
+    }
+  }
+  // With a non-zero common value, every cell of the other triangle has to be stored as zero
+  if (shape != SYMMETRIC && A.commonValue != 0 && zerosOutside != (long long)n * (n - 1) / 2) {
+    fits = false;
+  }
+  if (!fits) {
+    delete rowsOfM;
+    throw std::invalid_argument(shape == SYMMETRIC ? "Matrix is not symmetric" : "Matrix is not triangular");
+  }
+
+  I* offsets = new I[n + 1];
+  offsets[0] = 0;
+  for (I i = 0; i < n; ++i) {
+    I count = 0;
+    for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+      count += inTriangle(i, A.myIndices[k]);
+    }
+    offsets[i + 1] = offsets[i] + count;
+  }
+  I nnz = offsets[n];
+  I* indices = new I[nnz];
+  T* values = new T[nnz];
+  for (I i = 0, at = 0; i < n; ++i) {
+    for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+      if (inTriangle(i, A.myIndices[k])) {
+        indices[at] = A.myIndices[k];
+        values[at] = A.myValues[k];
+        ++at;
+      }
+    }
+  }
+  myTriangle = new BasicSparseMatrix<T, I>(n, n, A.commonValue, nnz, offsets, indices, values, true);
+  delete rowsOfM;
+}
+
+/// @brief Deletes the stored triangle.
+template <typename T, typename I>
+BasicTriangleSparseMatrix<T, I>::~BasicTriangleSparseMatrix()
+{
+  delete myTriangle;
+  myTriangle = nullptr;
+}
+
+/// @brief Tells whether a cell lies in the stored triangle, diagonal included.
+/// @param row The row index.
+/// @param col The column index.
+/// @return True for a cell of the stored triangle.
+template <typename T, typename I>
+bool BasicTriangleSparseMatrix<T, I>::inTriangle(I row, I col) const
+{
+  return shape == LOWER ? col <= row : col >= row;
+}
+
+/// @brief Spells the whole matrix out in CSR form.
+///
+/// A symmetric matrix gets the mirror image of its strictly upper entries, found by a counting sort
+/// of them by column. A triangular matrix with a non-zero common value gets its other triangle as
+/// explicit zeros, since the common value of the result covers the triangle.
+/// @return The matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicTriangleSparseMatrix<T, I>::toSparse() const
+{
+  const BasicSparseMatrix<T, I>& U = *myTriangle;
+  I n = U.noRows;
+  T cv = U.commonValue;
+
+  // The strictly lower triangle of a symmetric matrix, in CSR, is the strictly upper one by columns
+  I* mirrorOffsets = nullptr;
+  I* mirrorIndices = nullptr;
+  T* mirrorValues = nullptr;
+  if (shape == SYMMETRIC) {
+    mirrorOffsets = new I[n + 1]();
+    for (I i = 0; i < n; ++i) {
+      for (I k = U.myOffsets[i]; k < U.myOffsets[i + 1]; ++k) {
+        mirrorOffsets[U.myIndices[k] + 1] += U.myIndices[k] != i;
+      }
+    }
+    for (I i = 0; i < n; ++i) {
+      mirrorOffsets[i + 1] += mirrorOffsets[i];
+    }
+    I* next = new I[n];
+    copy(mirrorOffsets, mirrorOffsets + n, next);
+    mirrorIndices = new I[mirrorOffsets[n]];
+    mirrorValues = new T[mirrorOffsets[n]];
+    for (I i = 0; i < n; ++i) {
+      for (I k = U.myOffsets[i]; k < U.myOffsets[i + 1]; ++k) {
+        if (U.myIndices[k] != i) {
+          I at = next[U.myIndices[k]]++;
+          mirrorIndices[at] = i;
+          mirrorValues[at] = U.myValues[k];
+        }
+      }
+    }
+    delete[] next;
+  }
+
+  // Walks row i, only counting when indices is null, and returns the number of entries
+  bool zeros = shape != SYMMETRIC && cv != 0;
+  auto walkRow = [&](I i, I* indices, T* values) {
+    I length = 0;
+    auto emit = [&](I col, T value) {
+      if (indices != nullptr) {
+        indices[length] = col;
+        values[length] = value;
+      }
+      ++length;
+    };
+    if (shape == SYMMETRIC) {
+      for (I k = mirrorOffsets[i]; k < mirrorOffsets[i + 1]; ++k) {
+        emit(mirrorIndices[k], mirrorValues[k]);
+      }
+    }
+    for (I j = 0; zeros && shape == UPPER && j < i; ++j) {
+      emit(j, (T)0);
+    }
+    for (I k = U.myOffsets[i]; k < U.myOffsets[i + 1]; ++k) {
+      emit(U.myIndices[k], U.myValues[k]);
+    }
+    for (I j = i + 1; zeros && shape == LOWER && j < n; ++j) {
+      emit(j, (T)0);
+    }
+    return length;
+  };
+
+  I* offsets = new I[n + 1];
+  offsets[0] = 0;
+  for (I i = 0; i < n; ++i) {
+    offsets[i + 1] = offsets[i] + walkRow(i, nullptr, nullptr);
+  }
+  I nnz = offsets[n];
+  I* indices = new I[nnz];
+  T* values = new T[nnz];
+  for (I i = 0; i < n; ++i) {
+    walkRow(i, indices + offsets[i], values + offsets[i]);
+  }
+  delete[] mirrorOffsets;
+  delete[] mirrorIndices;
+  delete[] mirrorValues;
+  return new BasicSparseMatrix<T, I>(n, n, cv, nnz, offsets, indices, values, true);
+}
+
+/// @brief Multiplies the matrix with a sparse matrix and returns the result as a new matrix.
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @return The product, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicTriangleSparseMatrix<T, I>::Multiply(const BasicSparseMatrix<T, I> &M) const
+{
+  return this->Multiply(M, 1);
+}
+
+/// @brief Multiplies the matrix with a sparse matrix, with the rows of the result split across threads.
+///
+/// A triangular matrix with a zero common value is its stored triangle, which multiplies as it is.
+/// Otherwise the rows are built from the stored triangle without spelling the matrix out. Write a, b
+/// for the common values and dU, dM for the stored entries minus them, as in SparseMatrix::Multiply.
+///
+/// A symmetric matrix is a*J + dU + (dU - D)^T, D the diagonal, so row i takes row i of dU and the
+/// column of dU above the diagonal at i, and the corrections for a and b of SparseMatrix::Multiply.
+/// The columns are found without a transpose, turning the mirrored scatter of the symmetric SpMV
+/// around: every row of dU keeps a cursor on its next entry and waits in the list of that entry's
+/// column, so reaching row i hands over exactly the rows with an entry in column i.
+///
+/// A triangular matrix is a*T + dU, T the triangle of ones, so row i adds a times the sum of the rows
+/// of dM inside its triangle, kept as a running sum updated as i advances, and b times the row sum
+/// of A to every column. The result has common value a*b*n. Every range of rows keeps its own cursors
+/// or running sum, one per row or column, so the extra memory does not grow with the entries.
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The product, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicTriangleSparseMatrix<T, I>::Multiply(const BasicSparseMatrix<T, I> &M,
+                                                                   int noThreads) const
+{
+  const BasicSparseMatrix<T, I>& U = *myTriangle;
+  T cv = U.commonValue;
+  if (shape != SYMMETRIC && cv == 0) {
+    return U.Multiply(M, noThreads);
+  }
+  if (U.noCols != M.noRows) {
+    throw std::invalid_argument("Matrix multiplication is not possible");
+  }
+  BasicSparseMatrix<T, I>* rowsOfM = M.rowMajor ? nullptr : M.Recompress(true);
+  const BasicSparseMatrix<T, I>& B = rowsOfM ? *rowsOfM : M;
+  I n = U.noRows;
+  I m = B.noCols;
+  T cvB = B.commonValue;
+  bool symmetric = shape == SYMMETRIC;
+
+  // The columns of dM with a non-zero sum, which a*(J*dM) adds to every row of a symmetric product
+  Sum* colSums = nullptr;
+  I* sumCols = nullptr;
+  I noSumCols = 0;
+  if (symmetric && cv != 0) {
+    colSums = new Sum[m]();
+    for (I k = 0; k < B.noNonSparseValues; ++k) {
+      colSums[B.myIndices[k]] += (Sum)B.myValues[k] - cvB;
+    }
+    sumCols = new I[m];
+    for (I j = 0; j < m; ++j) {
+      if (colSums[j] != 0) {
+        sumCols[noSumCols++] = j;
+      }
+    }
+  }
+
+  // The cost of an output row is the multiply-adds of its stored and mirrored entries, plus corrections
+  long long* cost = new long long[n + 1]();
+  for (I i = 0; i < n; ++i) {
+    for (I k = U.myOffsets[i]; k < U.myOffsets[i + 1]; ++k) {
+      I j = U.myIndices[k];
+      cost[i + 1] += B.myOffsets[j + 1] - B.myOffsets[j];
+      if (symmetric && j != i) {
+        cost[j + 1] += B.myOffsets[i + 1] - B.myOffsets[i];
+      }
+    }
+  }
+  long long extra = 1 + noSumCols + (symmetric && cvB == 0 ? 0 : m);
+  for (I i = 0; i < n; ++i) {
+    cost[i + 1] += cost[i] + extra;
+  }
+
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, n));
+  I* bounds = new I[noParts + 1];
+  BasicSparseMatrix<T, I>::balanceRows(cost, n, noParts, bounds);
+  T background = (T)((Sum)cv * cvB * n);
+  EntryBuffer<T, I>* parts = new EntryBuffer<T, I>[noParts];
+  I* offsets = new I[n + 1];
+
+  BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+    I first = bounds[p];
+    I last = bounds[p + 1];
+    RowAccumulator<T, I> acc(m);
+    auto addRow = [&](I k, Sum a) { // a times row k of dM
+      for (I kb = B.myOffsets[k]; a != 0 && kb < B.myOffsets[k + 1]; ++kb) {
+        acc.add(B.myIndices[kb], a * ((Sum)B.myValues[kb] - cvB));
+      }
+    };
+    auto addEverywhere = [&](Sum value) {
+      for (I j = 0; value != 0 && j < m; ++j) {
+        acc.add(j, value);
+      }
+    };
+
+    if (symmetric) {
+      // cursor[i] is the next entry of row i of dU, and row i waits in the list of its column
+      I* cursor = new I[last];
+      I* following = new I[last];
+      I* waiting = new I[last - first];
+      fill(waiting, waiting + (last - first), (I)-1);
+      auto wait = [&](I i) {
+        if (cursor[i] < U.myOffsets[i + 1] && U.myIndices[cursor[i]] < last) {
+          I col = U.myIndices[cursor[i]] - first;
+          following[i] = waiting[col];
+          waiting[col] = i;
+        }
+      };
+      for (I i = 0; i < first; ++i) {
+        cursor[i] = (I)(lower_bound(U.myIndices + U.myOffsets[i], U.myIndices + U.myOffsets[i + 1], first) -
+                        U.myIndices);
+        wait(i);
+      }
+      for (I i = first; i < last; ++i) {
+        acc.start(i);
+        Sum rowSum = 0;
+        for (I k = waiting[i - first]; k >= 0;) {
+          I after = following[k];
+          Sum a = (Sum)U.myValues[cursor[k]] - cv;
+          rowSum += a;
+          addRow(k, a);
+          ++cursor[k];
+          wait(k);
+          k = after;
+        }
+        for (I k = U.myOffsets[i]; k < U.myOffsets[i + 1]; ++k) {
+          Sum a = (Sum)U.myValues[k] - cv;
+          rowSum += a;
+          addRow(U.myIndices[k], a);
+        }
+        cursor[i] = U.myOffsets[i] + (U.myOffsets[i + 1] > U.myOffsets[i] && U.myIndices[U.myOffsets[i]] == i);
+        wait(i);
+        for (I s = 0; s < noSumCols; ++s) {
+          acc.add(sumCols[s], cv * colSums[sumCols[s]]);
+        }
+        addEverywhere(cvB * rowSum);
+        offsets[i + 1] = acc.flush(parts[p], background);
+      }
+      delete[] cursor;
+      delete[] following;
+      delete[] waiting;
+    } else {
+      // running holds the sum of the rows of dM in the triangle of the current row, over the columns listed
+      Sum* running = new Sum[m]();
+      bool* listed = new bool[m]();
+      I* columns = new I[m];
+      I noColumns = 0;
+      auto addToRunning = [&](I k, Sum sign) {
+        for (I kb = B.myOffsets[k]; kb < B.myOffsets[k + 1]; ++kb) {
+          I j = B.myIndices[kb];
+          if (!listed[j]) {
+            listed[j] = true;
+            columns[noColumns++] = j;
+          }
+          running[j] += sign * ((Sum)B.myValues[kb] - cvB);
+        }
+      };
+      for (I k = shape == UPPER ? first : 0; k < (shape == UPPER ? n : first); ++k) {
+        addToRunning(k, 1);
+      }
+      for (I i = first; i < last; ++i) {
+        if (shape == LOWER) {
+          addToRunning(i, 1);
+        }
+        acc.start(i);
+        Sum rowSum = 0;
+        for (I k = U.myOffsets[i]; k < U.myOffsets[i + 1]; ++k) {
+          Sum a = (Sum)U.myValues[k] - cv;
+          rowSum += a;
+          addRow(U.myIndices[k], a);
+        }
+        for (I s = 0; s < noColumns; ++s) {
+          if (running[columns[s]] != 0) {
+            acc.add(columns[s], cv * running[columns[s]]);
+          }
+        }
+        I covered = shape == UPPER ? n - i : i + 1;
+        addEverywhere(cvB * rowSum + (Sum)cv * cvB * (covered - n));
+        offsets[i + 1] = acc.flush(parts[p], background);
+        if (shape == UPPER) {
+          addToRunning(i, -1);
+        }
+      }
+      delete[] running;
+      delete[] listed;
+      delete[] columns;
+    }
+  });
+
+  BasicSparseMatrix<T, I>* result = BasicSparseMatrix<T, I>::assembleParts(n, m, background, noParts, bounds,
+                                                                           parts, offsets);
+  delete[] bounds;
+  delete[] parts;
+  delete[] cost;
+  delete[] colSums;
+  delete[] sumCols;
+  delete rowsOfM;
+  return result;
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+template <typename T, typename I>
+void BasicTriangleSparseMatrix<T, I>::MultiplyVector(const T* x, T* y) const
+{
+  this->MultiplyVector(x, y, 1);
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x, with the rows split across threads.
+///
+/// Every row starts from its background, the common value times the part of x the row covers. A
+/// triangular row then adds (v - commonValue) * x[j] over its stored entries with the SIMD row kernel.
+/// A symmetric row does the same for its upper half, and scatters the mirror image of each entry,
+/// (v - commonValue) * x[i] into row j, into a buffer private to its part; the buffers are summed in
+/// a second pass. Every stored entry is read once.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicTriangleSparseMatrix<T, I>::MultiplyVector(const T* x, T* y, int noThreads) const
+{
+  const BasicSparseMatrix<T, I>& U = *myTriangle;
+  I n = U.noRows;
+  T cv = U.commonValue;
+
+  Sum* background = new Sum[n]();
+  if (cv != 0) {
+    Sum covered = 0;
+    if (shape == SYMMETRIC) {
+      for (I j = 0; j < n; ++j) {
+        covered += x[j];
+      }
+      fill(background, background + n, (Sum)cv * covered);
+    } else if (shape == UPPER) {
+      for (I i = n - 1; i >= 0; --i) {
+        covered += x[i];
+        background[i] = (Sum)cv * covered;
+      }
+    } else {
+      for (I i = 0; i < n; ++i) {
+        covered += x[i];
+        background[i] = (Sum)cv * covered;
+      }
+    }
+  }
+
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, n));
+  I* bounds = new I[noParts + 1];
+  U.balanceEntries(noParts, bounds);
+
+  if (shape != SYMMETRIC) {
+    BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+      for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+        I start = U.myOffsets[i];
+        y[i] = (T)(background[i] + BasicSparseMatrix<T, I>::dotRow(U.myIndices + start, U.myValues + start,
+                                                                    U.myOffsets[i + 1] - start, x, cv));
+      }
+    });
+  } else {
+    Sum* mirrored = new Sum[(size_t)noParts * n]();
+    BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+      Sum* mine = mirrored + (size_t)p * n;
+      for (I i = bounds[p]; i < bounds[p + 1]; ++i) {
+        Sum direct = 0;
+        Sum xi = x[i];
+        for (I k = U.myOffsets[i]; k < U.myOffsets[i + 1]; ++k) {
+          I j = U.myIndices[k];
+          Sum v = (Sum)U.myValues[k] - cv;
+          direct += v * x[j];
+          if (j != i) {
+            mine[j] += v * xi;
+          }
+        }
+        background[i] += direct;
+      }
+    });
+    // Sum the buffers, splitting the rows evenly this time
+    BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+      for (I i = (I)((long long)n * p / noParts); i < (I)((long long)n * (p + 1) / noParts); ++i) {
+        Sum sum = background[i];
+        for (int q = 0; q < noParts; ++q) {
+          sum += mirrored[(size_t)q * n + i];
+        }
+        y[i] = (T)sum;
+      }
+    });
+    delete[] mirrored;
+  }
+  delete[] bounds;
+  delete[] background;
+}
+
+/// @brief Solves A*x = b by forward (LOWER) or back (UPPER) substitution.
+///
+/// Cells of the triangle that are not stored hold the common value, so every row subtracts the common
+/// value times the sum of the x solved so far, and (v - commonValue) * x[j] for its stored entries.
+/// Sums are kept in the accumulator type; for integer matrices the division is an integer division.
+/// @param b The right hand side, noRows long.
+/// @param x Receives the solution, noCols long, may be b itself.
+template <typename T, typename I>
+void BasicTriangleSparseMatrix<T, I>::Solve(const T* b, T* x) const
+{
+  if (shape == SYMMETRIC) {
+    throw std::invalid_argument("Only a triangular matrix can be solved by substitution");
+  }
+  const BasicSparseMatrix<T, I>& U = *myTriangle;
+  I n = U.noRows;
+  T cv = U.commonValue;
+
+  Sum solved = 0;
+  for (I step = 0; step < n; ++step) {
+    I i = shape == LOWER ? step : n - 1 - step;
+    Sum rest = (Sum)b[i] - (Sum)cv * solved;
+    Sum diagonal = cv;
+    for (I k = U.myOffsets[i]; k < U.myOffsets[i + 1]; ++k) {
+      if (U.myIndices[k] == i) {
+        diagonal = U.myValues[k];
+      } else {
+        rest -= ((Sum)U.myValues[k] - cv) * x[U.myIndices[k]];
+      }
+    }
+    if (diagonal == 0) {
+      throw std::runtime_error("Matrix is singular");
+    }
+    x[i] = (T)(rest / diagonal);
+    solved += x[i];
+  }
+}
+
+/// @brief Get value from the matrix.
+/// @param row The row index.
+/// @param col The column index.
+/// @return The value at the specified row and column.
+template <typename T, typename I>
+T BasicTriangleSparseMatrix<T, I>::getValue(I row, I col) const
+{
+  if (row < 0 || row >= myTriangle->noRows || col < 0 || col >= myTriangle->noCols) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+  if (shape == SYMMETRIC && row > col) {
+    swap(row, col);
+  }
+  if (!inTriangle(row, col)) {
+    return 0;
+  }
+  return myTriangle->getValue(row, col);
+}
+
+/// @brief Gets the number of rows of the matrix.
+/// @return The number of rows.
+template <typename T, typename I>
+I BasicTriangleSparseMatrix<T, I>::getNoRows() const
+{
+  return myTriangle->noRows;
+}
+
+/// @brief Gets the number of columns of the matrix.
+/// @return The number of columns.
+template <typename T, typename I>
+I BasicTriangleSparseMatrix<T, I>::getNoCols() const
+{
+  return myTriangle->noCols;
+}
+
+/// @brief Gets the common value, which fills the cells of the stored triangle that are not stored.
+/// @return The common value.
+template <typename T, typename I>
+T BasicTriangleSparseMatrix<T, I>::getCommonValue() const
+{
+  return myTriangle->commonValue;
+}
+
+/// @brief Gets what the stored triangle stands for.
+/// @return SYMMETRIC, UPPER or LOWER.
+template <typename T, typename I>
+typename BasicTriangleSparseMatrix<T, I>::Shape BasicTriangleSparseMatrix<T, I>::getShape() const
+{
+  return this->shape;
+}
+
+/// @brief Gets the number of stored entries, those of one triangle.
+/// @return The number of stored entries.
+template <typename T, typename I>
+I BasicTriangleSparseMatrix<T, I>::getNoNonSparseValues() const
+{
+  return myTriangle->noNonSparseValues;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              PackedSparseMatrix Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Packs a matrix.
+///
+/// A first pass finds the widest gap of every block, which fixes its bit width and so where every
+/// block starts; the second writes the gaps into the zeroed bit array. The first pass runs before
+/// the large arrays are allocated, so a matrix that cannot be packed costs only the block arrays.
+/// @param M The matrix to pack, compressed either way.
+template <typename T, typename I>
+BasicPackedSparseMatrix<T, I>::BasicPackedSparseMatrix(const BasicSparseMatrix<T, I>& M)
+  : noRows(M.noRows), noCols(M.noCols), commonValue(M.commonValue), noNonSparseValues(M.noNonSparseValues),
+    noBlocks((M.noRows + BLOCK_ROWS - 1) / BLOCK_ROWS)
+{
+  BasicSparseMatrix<T, I>* rowsOfM = M.rowMajor ? nullptr : M.Recompress(true);
+  const BasicSparseMatrix<T, I>& A = rowsOfM ? *rowsOfM : M;
+
+  myWidths = new unsigned char[noBlocks];
+  myBitStarts = new long long[noBlocks + 1];
+
+  // Size every block from its widest gap
+  myBitStarts[0] = 0;
+  for (I b = 0; b < noBlocks; ++b) {
+    unsigned long long widest = 0;
+    long long noGaps = 0;
+    for (I i = b * BLOCK_ROWS; i < min((I)(b * BLOCK_ROWS + BLOCK_ROWS), noRows); ++i) {
+      for (I k = A.myOffsets[i] + 1; k < A.myOffsets[i + 1]; ++k) {
+        widest = max(widest, (unsigned long long)(A.myIndices[k] - A.myIndices[k - 1] - 1));
+        ++noGaps;
+      }
+    }
+    int width = 0;
+    while (width < 64 && (widest >> width) != 0) {
+      ++width;
+    }
+    if (width > 57) {
+      delete[] myWidths;
+      delete[] myBitStarts;
+      delete rowsOfM;
+      throw std::invalid_argument("Column indices are too far apart to pack");
+    }
+    myWidths[b] = (unsigned char)width;
+    myBitStarts[b + 1] = myBitStarts[b] + noGaps * width;
+  }
+
+  myOffsets = new I[noRows + 1];
+  copy(A.myOffsets, A.myOffsets + noRows + 1, myOffsets);
+  myValues = new T[noNonSparseValues];
+  copy(A.myValues, A.myValues + noNonSparseValues, myValues);
+  myFirsts = new I[noRows];
+
+  // Write the gaps, OR-ing each into the little-endian bit stream through an unaligned 64 bit word
+  size_t noBytes = (size_t)((myBitStarts[noBlocks] + 7) / 8) + 8;
+  myBits = new unsigned char[noBytes]();
+  for (I b = 0; b < noBlocks; ++b) {
+    long long pos = myBitStarts[b];
+    int width = myWidths[b];
+    for (I i = b * BLOCK_ROWS; i < min((I)(b * BLOCK_ROWS + BLOCK_ROWS), noRows); ++i) {
+      myFirsts[i] = A.myOffsets[i + 1] > A.myOffsets[i] ? A.myIndices[A.myOffsets[i]] : 0;
+      for (I k = A.myOffsets[i] + 1; k < A.myOffsets[i + 1]; ++k) {
+        unsigned long long gap = (unsigned long long)(A.myIndices[k] - A.myIndices[k - 1] - 1);
+        unsigned long long word;
+        memcpy(&word, myBits + (pos >> 3), sizeof(word));
+        word |= gap << (pos & 7);
+        memcpy(myBits + (pos >> 3), &word, sizeof(word));
+        pos += width;
+      }
+    }
+  }
+  delete rowsOfM;
+}
+
+/// @brief Deletes the arrays.
+template <typename T, typename I>
+BasicPackedSparseMatrix<T, I>::~BasicPackedSparseMatrix()
+{
+  delete[] myOffsets;
+  delete[] myFirsts;
+  delete[] myWidths;
+  delete[] myBitStarts;
+  delete[] myBits;
+  delete[] myValues;
+}
+
+/// @brief Decodes a run of packed gaps into columns.
+/// @param bits The packed gaps.
+/// @param bitPos The bit the first gap starts at.
+/// @param width The bit width of every gap.
+/// @param count The number of gaps to decode.
+/// @param base The column before the first gap.
+/// @param cols Receives count columns.
+template <typename T, typename I>
+void BasicPackedSparseMatrix<T, I>::decodeRun(const unsigned char* bits, long long bitPos, int width, I count, I base,
+                                              I* cols)
+{
+  unsigned long long mask = width == 0 ? 0 : ~0ULL >> (64 - width);
+  for (I k = 0; k < count; ++k, bitPos += width) {
+    unsigned long long word;
+    memcpy(&word, bits + (bitPos >> 3), sizeof(word));
+    base += (I)((word >> (bitPos & 7)) & mask) + 1;
+    cols[k] = base;
+  }
+}
+
+#if defined(__AVX2__)
+/// @brief Decodes a run of packed gaps into int columns, eight per step.
+///
+/// Each lane gathers the 32 bit word holding its gap from the byte the gap starts in and shifts it
+/// into place, which works up to 25 bit gaps; wider ones take the scalar loop. An in-register prefix
+/// sum then turns the gaps into columns.
+template <>
+void BasicPackedSparseMatrix<int, int>::decodeRun(const unsigned char* bits, long long bitPos, int width, int count,
+                                                  int base, int* cols)
+{
+  int k = 0;
+  if (width <= 25) {
+    __m256i lanes = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(width));
+    __m256i mask = _mm256_set1_epi32((int)((1u << width) - 1));
+    __m256i ones = _mm256_set1_epi32(1);
+    __m256i sevens = _mm256_set1_epi32(7);
+    for (; k + 8 <= count; k += 8) {
+      long long pos = bitPos + (long long)k * width;
+      __m256i offsets = _mm256_add_epi32(lanes, _mm256_set1_epi32((int)(pos & 7)));
+      __m256i words = _mm256_i32gather_epi32((const int*)(bits + (pos >> 3)), _mm256_srli_epi32(offsets, 3), 1);
+      __m256i gaps = _mm256_and_si256(_mm256_srlv_epi32(words, _mm256_and_si256(offsets, sevens)), mask);
+      __m256i sums = _mm256_add_epi32(gaps, ones);
+      sums = _mm256_add_epi32(sums, _mm256_slli_si256(sums, 4));
+      sums = _mm256_add_epi32(sums, _mm256_slli_si256(sums, 8));
+      sums = _mm256_add_epi32(sums, _mm256_permute2x128_si256(_mm256_shuffle_epi32(sums, 0xFF), sums, 0x08));
+      sums = _mm256_add_epi32(sums, _mm256_set1_epi32(base));
+      _mm256_storeu_si256((__m256i*)(cols + k), sums);
+      base = cols[k + 7];
+    }
+  }
+  unsigned long long mask = width == 0 ? 0 : ~0ULL >> (64 - width);
+  for (long long pos = bitPos + (long long)k * width; k < count; ++k, pos += width) {
+    unsigned long long word;
+    memcpy(&word, bits + (pos >> 3), sizeof(word));
+    base += (int)((word >> (pos & 7)) & mask) + 1;
+    cols[k] = base;
+  }
+}
+#endif
+
+/// @brief Copies the matrix back into CSR form.
+/// @return The CSR matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicPackedSparseMatrix<T, I>::toSparse() const
+{
+  I* offsets = new I[noRows + 1];
+  I* indices = new I[noNonSparseValues];
+  T* values = new T[noNonSparseValues];
+  copy(myOffsets, myOffsets + noRows + 1, offsets);
+  copy(myValues, myValues + noNonSparseValues, values);
+  for (I b = 0; b < noBlocks; ++b) {
+    long long pos = myBitStarts[b];
+    for (I i = b * BLOCK_ROWS; i < min((I)(b * BLOCK_ROWS + BLOCK_ROWS), noRows); ++i) {
+      I length = myOffsets[i + 1] - myOffsets[i];
+      if (length > 0) {
+        indices[myOffsets[i]] = myFirsts[i];
+        decodeRun(myBits, pos, myWidths[b], length - 1, myFirsts[i], indices + myOffsets[i] + 1);
+        pos += (long long)(length - 1) * myWidths[b];
+      }
+    }
+  }
+  return new BasicSparseMatrix<T, I>(noRows, noCols, commonValue, noNonSparseValues, offsets, indices, values, true);
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+template <typename T, typename I>
+void BasicPackedSparseMatrix<T, I>::MultiplyVector(const T* x, T* y) const
+{
+  this->MultiplyVector(x, y, 1);
+}
+
+/// @brief Multiplies the matrix with a dense vector, y = A*x, with the row blocks split across threads.
+///
+/// As with SparseMatrix::MultiplyVector the background is added as commonValue * sum(x), and the
+/// entries contribute (value - commonValue) * x.
+/// @param x The input vector, noCols long.
+/// @param y Receives the result, noRows long, must not overlap x.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+void BasicPackedSparseMatrix<T, I>::MultiplyVector(const T* x, T* y, int noThreads) const
+{
+  Sum background = 0;
+  if (this->commonValue != 0) {
+    Sum sumX = 0;
+    for (I j = 0; j < this->noCols; ++j) {
+      sumX += x[j];
+    }
+    background = (Sum)this->commonValue * sumX;
+  }
+
+  long long* cost = new long long[noBlocks + 1];
+  cost[0] = 0;
+  for (I b = 0; b < noBlocks; ++b) {
+    I last = min((I)(b * BLOCK_ROWS + BLOCK_ROWS), noRows);
+    cost[b + 1] = cost[b] + (myOffsets[last] - myOffsets[b * BLOCK_ROWS]) + (last - b * BLOCK_ROWS);
+  }
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, noBlocks));
+  I* bounds = new I[noParts + 1];
+  BasicSparseMatrix<T, I>::balanceRows(cost, noBlocks, noParts, bounds);
+  delete[] cost;
+
+  BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+    this->multiplyBlocks(x, background, y, bounds[p], bounds[p + 1]);
+  });
+  delete[] bounds;
+}
+
+/// @brief Multiplies one packed row with x, decoding DECODE_CHUNK indices at a time.
+/// @param bits The packed gaps.
+/// @param bitPos The bit the row's first gap starts at.
+/// @param width The bit width of the gaps.
+/// @param first The first column of the row.
+/// @param length The number of entries in the row, at least one.
+/// @param values The values of the row.
+/// @param x The dense vector indexed by column.
+/// @param shift Subtracted from every value, the common value of the matrix.
+/// @return The dot product of the shifted row with x.
+template <typename T, typename I>
+typename BasicPackedSparseMatrix<T, I>::Sum BasicPackedSparseMatrix<T, I>::dotRow(const unsigned char* bits,
+                                                                                  long long bitPos, int width,
+                                                                                  I first, I length, const T* values,
+                                                                                  const T* x, T shift)
+{
+  I cols[DECODE_CHUNK];
+  Sum sum = 0;
+  I last = first;
+  for (I done = 0; done < length;) {
+    I chunk = min((I)DECODE_CHUNK, (I)(length - done));
+    // The first chunk of a row starts with its stored first column
+    I gaps = done == 0 ? chunk - 1 : chunk;
+    cols[0] = first;
+    decodeRun(bits, bitPos, width, gaps, last, done == 0 ? cols + 1 : cols);
+    bitPos += (long long)gaps * width;
+    sum += BasicSparseMatrix<T, I>::dotRow(cols, values + done, chunk, x, shift);
+    last = cols[chunk - 1];
+    done += chunk;
+  }
+  return sum;
+}
+
+/// @brief Runs SpMV over a range of row blocks.
+/// @param x The input vector.
+/// @param background Added to every element of y.
+/// @param y Receives the rows of the blocks.
+/// @param firstBlock The first block to run.
+/// @param lastBlock One past the last block to run.
+template <typename T, typename I>
+void BasicPackedSparseMatrix<T, I>::multiplyBlocks(const T* x, Sum background, T* y, I firstBlock, I lastBlock) const
+{
+  for (I b = firstBlock; b < lastBlock; ++b) {
+    long long pos = myBitStarts[b];
+    int width = myWidths[b];
+    for (I i = b * BLOCK_ROWS; i < min((I)(b * BLOCK_ROWS + BLOCK_ROWS), noRows); ++i) {
+      I length = myOffsets[i + 1] - myOffsets[i];
+      Sum sum = background;
+      if (length > 0) {
+        sum += dotRow(myBits, pos, width, myFirsts[i], length, myValues + myOffsets[i], x, commonValue);
+        pos += (long long)(length - 1) * width;
+      }
+      y[i] = (T)sum;
+    }
+  }
+}
+
+/// @brief Get value from the matrix.
+///
+/// Decodes the row up to the column asked for, after skipping the gaps of the rows before it in the
+/// block, so it costs up to a block's worth of work.
+/// @param row The row index.
+/// @param col The column index.
+/// @return The value at the specified row and column.
+template <typename T, typename I>
+T BasicPackedSparseMatrix<T, I>::getValue(I row, I col) const
+{
+  if (row < 0 || row >= noRows || col < 0 || col >= noCols) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+  I b = row / BLOCK_ROWS;
+  long long pos = myBitStarts[b];
+  for (I i = b * BLOCK_ROWS; i < row; ++i) {
+    pos += (long long)max((I)0, (I)(myOffsets[i + 1] - myOffsets[i] - 1)) * myWidths[b];
+  }
+  I column = myFirsts[row];
+  for (I k = myOffsets[row]; k < myOffsets[row + 1] && column <= col; ++k) {
+    if (column == col) {
+      return myValues[k];
+    }
+    if (k + 1 < myOffsets[row + 1]) {
+      decodeRun(myBits, pos, myWidths[b], 1, column, &column);
+      pos += myWidths[b];
+    }
+  }
+  return commonValue;
+}
+
+/// @brief Gets the number of rows of the matrix.
+/// @return The number of rows.
+template <typename T, typename I>
+I BasicPackedSparseMatrix<T, I>::getNoRows() const
+{
+  return this->noRows;
+}
+
+/// @brief Gets the number of columns of the matrix.
+/// @return The number of columns.
+template <typename T, typename I>
+I BasicPackedSparseMatrix<T, I>::getNoCols() const
+{
+  return this->noCols;
+}
+
+/// @brief Gets the common (background) value of the matrix.
+/// @return The common value.
+template <typename T, typename I>
+T BasicPackedSparseMatrix<T, I>::getCommonValue() const
+{
+  return this->commonValue;
+}
+
+/// @brief Gets the number of stored entries.
+/// @return The number of stored entries.
+template <typename T, typename I>
+I BasicPackedSparseMatrix<T, I>::getNoNonSparseValues() const
+{
+  return this->noNonSparseValues;
+}
+
+/// @brief Gets the memory the matrix holds, to compare against the bytes per entry of plain CSR.
+/// @return The size of all arrays in bytes.
+template <typename T, typename I>
+long long BasicPackedSparseMatrix<T, I>::getMemoryUsage() const
+{
+  return (long long)(2 * noRows + 1) * sizeof(I) + noBlocks * (1 + (long long)sizeof(long long)) + sizeof(long long)
+       + (myBitStarts[noBlocks] + 7) / 8 + 8 + (long long)noNonSparseValues * sizeof(T);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              SparseSolver Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Constructs a single threaded solver.
+/// @param A The square matrix to solve, compressed either way; a CSR one must outlive the solver.
+/// @param method CG for a symmetric positive definite matrix, BICGSTAB otherwise.
+template <typename T, typename I>
+BasicSparseSolver<T, I>::BasicSparseSolver(const BasicSparseMatrix<T, I>& A, Method method)
+  : BasicSparseSolver(A, method, 1)
+{
+}
+
+/// @brief Constructs a solver, reading the diagonal and allocating every work vector up front.
+/// @param A The square matrix to solve, compressed either way; a CSR one must outlive the solver.
+/// @param method CG for a symmetric positive definite matrix, BICGSTAB otherwise.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+BasicSparseSolver<T, I>::BasicSparseSolver(const BasicSparseMatrix<T, I>& A, Method method, int noThreads)
+  : plan(A, noThreads), method(method), n(A.noRows), noThreads(noThreads), maxIterations(1000), tolerance(1e-8),
+    preconditioned(true), noIterations(0), converged(false), seconds(0), spmvSeconds(0)
+{
+  if (A.noRows != A.noCols) {
+    throw std::invalid_argument("Matrix must be square");
+  }
+  if (this->noThreads <= 0) {
+    this->noThreads = WorkerPool::shared().size();
+  }
+  // Short vectors are not worth handing to the pool
+  noParts = (int)max((I)1, min((I)this->noThreads, n / 16384));
+
+  // A CSR row and a CSC column hold the same diagonal entry, so the arrays are searched either way
+  myInverseDiagonal = new T[n];
+  for (I i = 0; i < n; ++i) {
+    I k = A.find(i, i);
+    T diagonal = k >= 0 ? A.myValues[k] : A.commonValue;
+    myInverseDiagonal[i] = diagonal != 0 ? 1 / diagonal : 1;
+  }
+
+  int noVectors = method == CG ? 4 : 8;
+  myWork = new T[(size_t)noVectors * n];
+  r = myWork;
+  z = r + n;
+  p = z + n;
+  q = p + n;
+  rHat = method == CG ? nullptr : q + n;
+  s = method == CG ? nullptr : rHat + n;
+  t = method == CG ? nullptr : s + n;
+  u = method == CG ? nullptr : t + n;
+  myHistory = new double[maxIterations + 1];
+}
+
+/// @brief Destructor.
+template <typename T, typename I>
+BasicSparseSolver<T, I>::~BasicSparseSolver()
+{
+  delete[] myInverseDiagonal;
+  delete[] myWork;
+  delete[] myHistory;
+}
+
+/// @param tolerance The relative residual |b - A*x| / |b| to stop at.
+template <typename T, typename I>
+void BasicSparseSolver<T, I>::setTolerance(double tolerance)
+{
+  this->tolerance = tolerance;
+}
+
+/// @brief Sets the iteration limit, resizing the residual history (the only allocation after construction).
+/// @param maxIterations The number of iterations after which Solve() gives up.
+template <typename T, typename I>
+void BasicSparseSolver<T, I>::setMaxIterations(int maxIterations)
+{
+  maxIterations = max(0, maxIterations);
+  if (maxIterations != this->maxIterations) {
+    delete[] myHistory;
+    myHistory = new double[maxIterations + 1];
+    this->maxIterations = maxIterations;
+    noIterations = 0;
+  }
+}
+
+/// @param preconditioned True to apply the Jacobi preconditioner.
+template <typename T, typename I>
+void BasicSparseSolver<T, I>::setPreconditioned(bool preconditioned)
+{
+  this->preconditioned = preconditioned;
+}
+
+/// @brief Sums a function over ranges of 0..n-1, one range per part.
+/// @param range Returns the contribution of the indices from its first to its second argument.
+/// @return The sum over all ranges.
+template <typename T, typename I>
+typename BasicSparseSolver<T, I>::Sum BasicSparseSolver<T, I>::reduce(const function<Sum(I, I)>& range) const
+{
+  if (noParts == 1) {
+    return range(0, n);
+  }
+  Sum partials[64];
+  int parts = min(noParts, 64);
+  BasicSparseMatrix<T, I>::runParts(parts, [&](int part) {
+    partials[part] = range((I)((long long)n * part / parts), (I)((long long)n * (part + 1) / parts));
+  });
+  Sum total = 0;
+  for (int part = 0; part < parts; ++part) {
+    total += partials[part];
+  }
+  return total;
+}
+
+/// @brief Multiplies by the matrix, adding the time taken to the SpMV telemetry.
+/// @param x The vector to multiply.
+/// @param y Receives A*x.
+template <typename T, typename I>
+void BasicSparseSolver<T, I>::multiply(const T* x, T* y)
+{
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  plan.Multiply(x, y);
+  spmvSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/// @brief Solves A*x = b with the method chosen at construction.
+///
+/// Iterates until |b - A*x| <= tolerance * |b| or the iteration limit is reached. A zero b is solved
+/// by x = 0 straight away.
+/// @param b The right hand side, n long.
+/// @param x The starting guess on entry, the solution on return, n long.
+/// @return True if the tolerance was reached.
+template <typename T, typename I>
+bool BasicSparseSolver<T, I>::Solve(const T* b, T* x)
+{
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  spmvSeconds = 0;
+  noIterations = 0;
+  double normB = sqrt((double)reduce([&](I begin, I end) {
+    Sum sum = 0;
+    for (I i = begin; i < end; ++i) {
+      sum += (Sum)b[i] * b[i];
+    }
+    return sum;
+  }));
+  if (normB == 0) {
+    fill(x, x + n, (T)0);
+    myHistory[0] = 0;
+    converged = true;
+  } else {
+    converged = method == CG ? solveCG(b, x, normB) : solveBiCGSTAB(b, x, normB);
+  }
+  seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return converged;
+}
+
+/// @brief Preconditioned conjugate gradients.
+///
+/// Each iteration is one SpMV and three passes over the vectors: p.Ap, the x and r updates fused with
+/// |r|^2, and the preconditioned residual fused with r.z.
+/// @param b The right hand side.
+/// @param x The starting guess on entry, the last iterate on return.
+/// @param normB |b|, not zero.
+/// @return True if the tolerance was reached.
+template <typename T, typename I>
+bool BasicSparseSolver<T, I>::solveCG(const T* b, T* x, double normB)
+{
+  multiply(x, q);
+  Sum rr = reduce([&](I begin, I end) {
+    Sum sum = 0;
+    for (I i = begin; i < end; ++i) {
+      r[i] = b[i] - q[i];
+      sum += (Sum)r[i] * r[i];
+    }
+    return sum;
+  });
+  myHistory[0] = sqrt((double)rr) / normB;
+  Sum rz = reduce([&](I begin, I end) {
+    Sum sum = 0;
+    for (I i = begin; i < end; ++i) {
+      z[i] = preconditioned ? r[i] * myInverseDiagonal[i] : r[i];
+      p[i] = z[i];
+      sum += (Sum)r[i] * z[i];
+    }
+    return sum;
+  });
+
+  while (myHistory[noIterations] > tolerance && noIterations < maxIterations) {
+    multiply(p, q);
+    Sum pq = reduce([&](I begin, I end) {
+      Sum sum = 0;
+      for (I i = begin; i < end; ++i) {
+        sum += (Sum)p[i] * q[i];
+      }
+      return sum;
+    });
+    if (pq == 0) {
+      break; // p is in the null space, the matrix is not positive definite
+    }
+    T alpha = (T)(rz / pq);
+    rr = reduce([&](I begin, I end) {
+      Sum sum = 0;
+      for (I i = begin; i < end; ++i) {
+        x[i] += alpha * p[i];
+        r[i] -= alpha * q[i];
+        sum += (Sum)r[i] * r[i];
+      }
+      return sum;
+    });
+    myHistory[++noIterations] = sqrt((double)rr) / normB;
+    Sum rzNext = reduce([&](I begin, I end) {
+      Sum sum = 0;
+      for (I i = begin; i < end; ++i) {
+        z[i] = preconditioned ? r[i] * myInverseDiagonal[i] : r[i];
+        sum += (Sum)r[i] * z[i];
+      }
+      return sum;
+    });
+    T beta = (T)(rzNext / rz);
+    rz = rzNext;
+    reduce([&](I begin, I end) {
+      for (I i = begin; i < end; ++i) {
+        p[i] = z[i] + beta * p[i];
+      }
+      return (Sum)0;
+    });
+  }
+  return myHistory[noIterations] <= tolerance;
+}
+
+/// @brief BiCGSTAB with the Jacobi preconditioner applied on the right, so the residual it tracks is
+/// the true residual of the original system.
+/// @param b The right hand side.
+/// @param x The starting guess on entry, the last iterate on return.
+/// @param normB |b|, not zero.
+/// @return True if the tolerance was reached.
+template <typename T, typename I>
+bool BasicSparseSolver<T, I>::solveBiCGSTAB(const T* b, T* x, double normB)
+{
+  multiply(x, q);
+  Sum rr = reduce([&](I begin, I end) {
+    Sum sum = 0;
+    for (I i = begin; i < end; ++i) {
+      r[i] = b[i] - q[i];
+      rHat[i] = r[i];
+      p[i] = 0;
+      q[i] = 0; // q holds A*z, the v of the usual presentation
+      sum += (Sum)r[i] * r[i];
+    }
+    return sum;
+  });
+  myHistory[0] = sqrt((double)rr) / normB;
+  Sum rho = 1;
+  Sum alpha = 1;
+  Sum omega = 1;
+
+  while (myHistory[noIterations] > tolerance && noIterations < maxIterations) {
+    Sum rhoNext = reduce([&](I begin, I end) {
+      Sum sum = 0;
+      for (I i = begin; i < end; ++i) {
+        sum += (Sum)rHat[i] * r[i];
+      }
+      return sum;
+    });
+    if (rhoNext == 0 || omega == 0) {
+      break; // Breakdown, the shadow residual is orthogonal to r
+    }
+    T beta = (T)((rhoNext / rho) * (alpha / omega));
+    T lastOmega = (T)omega;
+    rho = rhoNext;
+    reduce([&](I begin, I end) {
+      for (I i = begin; i < end; ++i) {
+        p[i] = r[i] + beta * (p[i] - lastOmega * q[i]);
+        z[i] = preconditioned ? p[i] * myInverseDiagonal[i] : p[i];
+      }
+      return (Sum)0;
+    });
+    multiply(z, q);
+    Sum rHatQ = reduce([&](I begin, I end) {
+      Sum sum = 0;
+      for (I i = begin; i < end; ++i) {
+        sum += (Sum)rHat[i] * q[i];
+      }
+      return sum;
+    });
+    if (rHatQ == 0) {
+      break;
+    }
+    alpha = rho / rHatQ;
+    T a = (T)alpha;
+    Sum ss = reduce([&](I begin, I end) {
+      Sum sum = 0;
+      for (I i = begin; i < end; ++i) {
+        s[i] = r[i] - a * q[i];
+        x[i] += a * z[i];
+        u[i] = preconditioned ? s[i] * myInverseDiagonal[i] : s[i];
+        sum += (Sum)s[i] * s[i];
+      }
+      return sum;
+    });
+    if (sqrt((double)ss) / normB <= tolerance) {
+      copy(s, s + n, r);
+      myHistory[++noIterations] = sqrt((double)ss) / normB;
+      break;
+    }
+    multiply(u, t);
+    Sum ts = 0;
+    Sum tt = 0;
+    Sum partials[2 * 64];
+    int parts = noParts == 1 ? 1 : min(noParts, 64);
+    BasicSparseMatrix<T, I>::runParts(parts, [&](int part) {
+      Sum dot = 0;
+      Sum norm = 0;
+      for (I i = (I)((long long)n * part / parts); i < (I)((long long)n * (part + 1) / parts); ++i) {
+        dot += (Sum)t[i] * s[i];
+        norm += (Sum)t[i] * t[i];
+      }
+      partials[2 * part] = dot;
+      partials[2 * part + 1] = norm;
+    });
+    for (int part = 0; part < parts; ++part) {
+      ts += partials[2 * part];
+      tt += partials[2 * part + 1];
+    }
+    omega = tt != 0 ? ts / tt : 0;
+    T w = (T)omega;
+    rr = reduce([&](I begin, I end) {
+      Sum sum = 0;
+      for (I i = begin; i < end; ++i) {
+        x[i] += w * u[i];
+        r[i] = s[i] - w * t[i];
+        sum += (Sum)r[i] * r[i];
+      }
+      return sum;
+    });
+    myHistory[++noIterations] = sqrt((double)rr) / normB;
+  }
+  return myHistory[noIterations] <= tolerance;
+}
+
+/// @return The number of iterations done by the last solve.
+template <typename T, typename I>
+int BasicSparseSolver<T, I>::getIterations() const
+{
+  return noIterations;
+}
+
+/// @return The relative residual |b - A*x| / |b| reached by the last solve.
+template <typename T, typename I>
+double BasicSparseSolver<T, I>::getResidual() const
+{
+  return myHistory[noIterations];
+}
+
+/// @return The relative residual after 0, 1, ... getIterations() iterations of the last solve.
+template <typename T, typename I>
+const double* BasicSparseSolver<T, I>::getResidualHistory() const
+{
+  return myHistory;
+}
+
+/// @return True if the last solve reached the tolerance.
+template <typename T, typename I>
+bool BasicSparseSolver<T, I>::hasConverged() const
+{
+  return converged;
+}
+
+/// @return The wall time of the last solve in seconds.
+template <typename T, typename I>
+double BasicSparseSolver<T, I>::getSeconds() const
+{
+  return seconds;
+}
+
+/// @return The part of getSeconds() spent multiplying by the matrix.
+template <typename T, typename I>
+double BasicSparseSolver<T, I>::getSpMVSeconds() const
+{
+  return spmvSeconds;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              SparseGraph Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Constructs a single threaded graph.
+/// @param A The adjacency matrix, square with a zero common value.
+template <typename T, typename I>
+BasicSparseGraph<T, I>::BasicSparseGraph(const BasicSparseMatrix<T, I>& A)
+  : BasicSparseGraph(A, 1)
+{
+}
+
+/// @brief Constructs a graph, compressing the out-edges and in-edges by rows and allocating the work arrays.
+/// @param A The adjacency matrix, square with a zero common value. It is not referenced afterwards.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+template <typename T, typename I>
+BasicSparseGraph<T, I>::BasicSparseGraph(const BasicSparseMatrix<T, I>& A, int noThreads)
+  : n(A.noRows), noThreads(noThreads), noSteps(0), stepCapacity(0), myStepSeconds(nullptr),
+    myStepDeltas(nullptr), myStepFrontiers(nullptr), myStepDirections(nullptr)
+{
+  if (A.noRows != A.noCols) {
+    throw std::invalid_argument("Matrix must be square");
+  }
+  if (A.commonValue != 0) {
+    throw std::invalid_argument("An adjacency matrix must have a zero common value");
+  }
+  if (this->noThreads <= 0) {
+    this->noThreads = WorkerPool::shared().size();
+  }
+  // A view shares the arrays, so whichever orientation A has, one of the two costs nothing
+  myOut = A.rowMajor ? new BasicSparseMatrix<T, I>(A, false) : A.Recompress(true);
+  myIn = A.rowMajor ? A.Recompress(false) : new BasicSparseMatrix<T, I>(A, false);
+  BasicSparseMatrix<T, I>* transposed = myIn->Transpose();
+  delete myIn;
+  myIn = transposed;
+
+  myVisited = new atomic<char>[n];
+  myInFrontier = new unsigned char[n];
+  fill(myInFrontier, myInFrontier + n, (unsigned char)0);
+  myFrontier = new I[n];
+  myNext = new I[n];
+  myScratch = new double[n];
+}
+
+/// @brief Destructor.
+template <typename T, typename I>
+BasicSparseGraph<T, I>::~BasicSparseGraph()
+{
+  delete myOut;
+  delete myIn;
+  delete[] myVisited;
+  delete[] myInFrontier;
+  delete[] myFrontier;
+  delete[] myNext;
+  delete[] myScratch;
+  delete[] myStepSeconds;
+  delete[] myStepDeltas;
+  delete[] myStepFrontiers;
+  delete[] myStepDirections;
+}
+
+/// @brief Number of parts a pass over the vertices or edges is split into, one unless it is long.
+/// @param work The number of vertices or edges the pass touches.
+/// @return The number of parts.
+template <typename T, typename I>
+int BasicSparseGraph<T, I>::partsFor(long long work) const
+{
+  return (int)max(1LL, min((long long)noThreads, work / 4096));
+}
+
+/// @brief Appends one step to the telemetry, doubling the step arrays when they are full.
+/// @param seconds The wall time of the step.
+/// @param delta The L1 change of the ranks, 0 for BFS.
+/// @param frontier The frontier size, 0 for PageRank.
+/// @param direction The direction of a BFS level.
+template <typename T, typename I>
+void BasicSparseGraph<T, I>::recordStep(double seconds, double delta, I frontier, Direction direction)
+{
+  if (noSteps == stepCapacity) {
+    int capacity = max(16, 2 * stepCapacity);
+    double* stepSeconds = new double[capacity];
+    double* stepDeltas = new double[capacity];
+    I* stepFrontiers = new I[capacity];
+    Direction* stepDirections = new Direction[capacity];
+    copy(myStepSeconds, myStepSeconds + noSteps, stepSeconds);
+    copy(myStepDeltas, myStepDeltas + noSteps, stepDeltas);
+    copy(myStepFrontiers, myStepFrontiers + noSteps, stepFrontiers);
+    copy(myStepDirections, myStepDirections + noSteps, stepDirections);
+    delete[] myStepSeconds;
+    delete[] myStepDeltas;
+    delete[] myStepFrontiers;
+    delete[] myStepDirections;
+    myStepSeconds = stepSeconds;
+    myStepDeltas = stepDeltas;
+    myStepFrontiers = stepFrontiers;
+    myStepDirections = stepDirections;
+    stepCapacity = capacity;
+  }
+  myStepSeconds[noSteps] = seconds;
+  myStepDeltas[noSteps] = delta;
+  myStepFrontiers[noSteps] = frontier;
+  myStepDirections[noSteps] = direction;
+  ++noSteps;
+}
+
+/// @brief Breadth-first search from one vertex.
+///
+/// A level is pushed while its out-edges are few compared with the edges still unexplored: every
+/// frontier vertex claims its unvisited out-neighbours with an atomic exchange. Once the frontier has
+/// more than 1/PULL_FACTOR of them, every unvisited vertex instead looks through its in-edges for a
+/// frontier vertex and stops at the first, which skips most edges of a large frontier and needs no
+/// atomics. The search pushes again once the frontier is smaller than 1/PUSH_FACTOR of the vertices.
+/// @param source The vertex to start from.
+/// @param levels Receives the number of edges on a shortest path from source, or -1 for vertices it
+/// does not reach, getNoVertices() long.
+/// @return The number of vertices reached, source included.
+template <typename T, typename I>
+I BasicSparseGraph<T, I>::BFS(I source, I* levels)
+{
+  if (source < 0 || source >= n) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+  noSteps = 0;
+  fill(levels, levels + n, (I)-1);
+  for (I v = 0; v < n; ++v) {
+    myVisited[v].store(0, memory_order_relaxed);
+  }
+  levels[source] = 0;
+  myVisited[source].store(1, memory_order_relaxed);
+  myFrontier[0] = source;
+  I noFrontier = 1;
+  I noReached = 1;
+  long long frontierEdges = myOut->myOffsets[source + 1] - myOut->myOffsets[source];
+  long long unexploredEdges = myOut->noNonSparseValues - frontierEdges;
+  Direction direction = PUSH;
+
+  for (I depth = 0; noFrontier > 0; ++depth) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (direction == PUSH && frontierEdges > unexploredEdges / PULL_FACTOR) {
+      direction = PULL;
+    } else if (direction == PULL && noFrontier < n / PUSH_FACTOR) {
+      direction = PUSH;
+    }
+    I noNext;
+    if (direction == PUSH) {
+      atomic<I> counter(0);
+      push(depth, levels, noFrontier, counter);
+      noNext = counter.load();
+    } else {
+      noNext = pull(depth, levels, noFrontier);
+    }
+
+    frontierEdges = 0;
+    for (I k = 0; k < noNext; ++k) {
+      frontierEdges += myOut->myOffsets[myNext[k] + 1] - myOut->myOffsets[myNext[k]];
+    }
+    unexploredEdges -= frontierEdges;
+    recordStep(chrono::duration<double>(chrono::steady_clock::now() - start).count(), 0, noFrontier, direction);
+    swap(myFrontier, myNext);
+    noFrontier = noNext;
+    noReached += noNext;
+  }
+  return noReached;
+}
+
+/// @brief Expands a BFS level top-down, every frontier vertex claiming its unvisited out-neighbours.
+/// @param depth The level of the frontier.
+/// @param levels The levels being filled in.
+/// @param noFrontier The number of vertices in myFrontier.
+/// @param noNext Counts the vertices appended to myNext.
+template <typename T, typename I>
+void BasicSparseGraph<T, I>::push(I depth, I* levels, I noFrontier, atomic<I>& noNext)
+{
+  const I* offsets = myOut->myOffsets;
+  const I* targets = myOut->myIndices;
+  int noParts = partsFor(noFrontier);
+  BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+    for (I f = (I)((long long)noFrontier * p / noParts); f < (I)((long long)noFrontier * (p + 1) / noParts); ++f) {
+      I u = myFrontier[f];
+      for (I k = offsets[u]; k < offsets[u + 1]; ++k) {
+        I v = targets[k];
+        if (myVisited[v].load(memory_order_relaxed) == 0 && myVisited[v].exchange(1) == 0) {
+          levels[v] = depth + 1;
+          myNext[noNext++] = v;
+        }
+      }
+    }
+  });
+}
+
+/// @brief Expands a BFS level bottom-up, every unvisited vertex looking for a parent in the frontier.
+///
+/// Every part owns a range of vertices, so it writes their levels without atomics and collects the
+/// ones it reached at the start of its range in myNext; the ranges are then packed together.
+/// @param depth The level of the frontier.
+/// @param levels The levels being filled in.
+/// @param noFrontier The number of vertices in myFrontier.
+/// @return The number of vertices of the next level, left in myNext.
+template <typename T, typename I>
+I BasicSparseGraph<T, I>::pull(I depth, I* levels, I noFrontier)
+{
+  for (I f = 0; f < noFrontier; ++f) {
+    myInFrontier[myFrontier[f]] = 1;
+  }
+  const I* offsets = myIn->myOffsets;
+  const I* sources = myIn->myIndices;
+  int noParts = (int)max((I)1, min((I)partsFor(myIn->noNonSparseValues), n));
+  I* bounds = new I[noParts + 1];
+  myIn->balanceEntries(noParts, bounds);
+  I* counts = new I[noParts];
+  BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+    I count = 0;
+    for (I v = bounds[p]; v < bounds[p + 1]; ++v) {
+      if (myVisited[v].load(memory_order_relaxed) != 0) {
+        continue;
+      }
+      for (I k = offsets[v]; k < offsets[v + 1]; ++k) {
+        if (myInFrontier[sources[k]]) {
+          myVisited[v].store(1, memory_order_relaxed);
+          levels[v] = depth + 1;
+          myNext[bounds[p] + count++] = v;
+          break;
+        }
+      }
+    }
+    counts[p] = count;
+  });
+  I noNext = counts[0];
+  for (int p = 1; p < noParts; ++p) {
+    copy(myNext + bounds[p], myNext + bounds[p] + counts[p], myNext + noNext);
+    noNext += counts[p];
+  }
+  for (I f = 0; f < noFrontier; ++f) {
+    myInFrontier[myFrontier[f]] = 0;
+  }
+  delete[] bounds;
+  delete[] counts;
+  return noNext;
+}
+
+/// @brief Ranks the vertices by power iteration of PageRank.
+///
+/// Every iteration spreads the rank of every vertex evenly over its out-edges and pulls it in over
+/// the in-edges, an SpMV over the rows of the transpose with the work split by entries:
+/// rank'(v) = (1 - damping)/n + damping * (sum over edges u->v of rank(u)/outdegree(u) + dangling/n),
+/// where dangling is the rank of the vertices without out-edges, spread over every vertex so the
+/// ranks keep summing to one. Iterations stop once the L1 change of the ranks is at most tolerance.
+/// @param rank Receives the ranks, getNoVertices() long.
+/// @param damping The probability of following an edge, usually 0.85.
+/// @param tolerance The L1 change to stop at.
+/// @param maxIterations The number of iterations after which to stop anyway.
+/// @return The number of iterations done.
+template <typename T, typename I>
+int BasicSparseGraph<T, I>::PageRank(double* rank, double damping, double tolerance, int maxIterations)
+{
+  noSteps = 0;
+  if (n == 0) {
+    return 0;
+  }
+  fill(rank, rank + n, 1.0 / n);
+  const I* outOffsets = myOut->myOffsets;
+  const I* inOffsets = myIn->myOffsets;
+  const I* sources = myIn->myIndices;
+  int noVertexParts = partsFor(n);
+  int noEdgeParts = (int)max((I)1, min((I)partsFor(myIn->noNonSparseValues + (long long)n), n));
+  I* bounds = new I[noEdgeParts + 1];
+  myIn->balanceEntries(noEdgeParts, bounds);
+  double* partials = new double[max(noVertexParts, noEdgeParts)];
+
+  for (int iteration = 0; iteration < maxIterations; ++iteration) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // Share of every vertex per out-edge, and the rank stuck on vertices without any
+    BasicSparseMatrix<T, I>::runParts(noVertexParts, [&](int p) {
+      double dangling = 0;
+      for (I u = (I)((long long)n * p / noVertexParts); u < (I)((long long)n * (p + 1) / noVertexParts); ++u) {
+        I degree = outOffsets[u + 1] - outOffsets[u];
+        myScratch[u] = degree > 0 ? rank[u] / degree : 0;
+        dangling += degree > 0 ? 0 : rank[u];
+      }
+      partials[p] = dangling;
+    });
+    double dangling = 0;
+    for (int p = 0; p < noVertexParts; ++p) {
+      dangling += partials[p];
+    }
+
+    // Pull the shares over the in-edges
+    double base = (1 - damping) / n + damping * dangling / n;
+    BasicSparseMatrix<T, I>::runParts(noEdgeParts, [&](int p) {
+      double delta = 0;
+      for (I v = bounds[p]; v < bounds[p + 1]; ++v) {
+        double sum = 0;
+        for (I k = inOffsets[v]; k < inOffsets[v + 1]; ++k) {
+          sum += myScratch[sources[k]];
+        }
+        double next = base + damping * sum;
+        delta += fabs(next - rank[v]);
+        rank[v] = next;
+      }
+      partials[p] = delta;
+    });
+    double delta = 0;
+    for (int p = 0; p < noEdgeParts; ++p) {
+      delta += partials[p];
+    }
+
+    recordStep(chrono::duration<double>(chrono::steady_clock::now() - start).count(), delta, 0, PULL);
+    if (delta <= tolerance) {
+      break;
+    }
+  }
+  delete[] bounds;
+  delete[] partials;
+  return noSteps;
+}
+
+/// @return The number of vertices.
+template <typename T, typename I>
+I BasicSparseGraph<T, I>::getNoVertices() const
+{
+  return n;
+}
+
+/// @return The number of edges, the stored entries of the adjacency matrix.
+template <typename T, typename I>
+I BasicSparseGraph<T, I>::getNoEdges() const
+{
+  return myOut->noNonSparseValues;
+}
+
+/// @return The number of BFS levels expanded or PageRank iterations done by the last run.
+template <typename T, typename I>
+int BasicSparseGraph<T, I>::getNoSteps() const
+{
+  return noSteps;
+}
+
+/// @return The wall time in seconds of every step of the last run, getNoSteps() long.
+template <typename T, typename I>
+const double* BasicSparseGraph<T, I>::getStepSeconds() const
+{
+  return myStepSeconds;
+}
+
+/// @return The L1 change of the ranks in every iteration of the last PageRank, getNoSteps() long.
+template <typename T, typename I>
+const double* BasicSparseGraph<T, I>::getStepDeltas() const
+{
+  return myStepDeltas;
+}
+
+/// @return The number of vertices of every level expanded by the last BFS, getNoSteps() long.
+template <typename T, typename I>
+const I* BasicSparseGraph<T, I>::getStepFrontiers() const
+{
+  return myStepFrontiers;
+}
+
+/// @return The direction every level of the last BFS was expanded in, getNoSteps() long.
+template <typename T, typename I>
+const typename BasicSparseGraph<T, I>::Direction* BasicSparseGraph<T, I>::getStepDirections() const
+{
+  return myStepDirections;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              HybridSparseMatrix Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Constructs a matrix without blocks, for assemble() to fill in.
+/// @param n The number of rows.
+/// @param m The number of columns.
+/// @param cv The common value.
+/// @param threshold The density threshold, negative for the default.
+template <typename T, typename I>
+BasicHybridSparseMatrix<T, I>::BasicHybridSparseMatrix(I n, I m, T cv, double threshold)
+  : noRows(n), noCols(m), commonValue(cv),
+    threshold(threshold < 0 ? (double)sizeof(T) / (sizeof(T) + sizeof(I)) : threshold),
+    noBlocks((n + BLOCK_ROWS - 1) / BLOCK_ROWS), noNonSparseValues(0), mySparse(nullptr)
+{
+  myTiles = new T*[noBlocks];
+  fill(myTiles, myTiles + noBlocks, nullptr);
+}
+
+/// @brief Splits a matrix into blocks, storing densely the blocks at or above the threshold.
+/// @param M The matrix to split, compressed either way.
+/// @param threshold The share of non-common cells from which a block is stored densely, negative
+/// for the default, above 1 to keep every block sparse.
+template <typename T, typename I>
+BasicHybridSparseMatrix<T, I>::BasicHybridSparseMatrix(const BasicSparseMatrix<T, I>& M, double threshold)
+  : BasicHybridSparseMatrix(M.noRows, M.noCols, M.commonValue, threshold)
+{
+  BasicSparseMatrix<T, I>* rowsOfM = M.rowMajor ? nullptr : M.Recompress(true);
+  const BasicSparseMatrix<T, I>& A = rowsOfM ? *rowsOfM : M;
+
+  // Dense blocks move into tiles and leave empty rows behind
+  I* offsets = new I[noRows + 1];
+  offsets[0] = 0;
+  for (I b = 0; b < noBlocks; ++b) {
+    I first = b * BLOCK_ROWS;
+    I last = min((I)(first + BLOCK_ROWS), noRows);
+    if (isDense(A.myOffsets[last] - A.myOffsets[first], last - first)) {
+      myTiles[b] = new T[(size_t)(last - first) * noCols];
+      fill(myTiles[b], myTiles[b] + (size_t)(last - first) * noCols, commonValue);
+    }
+    for (I i = first; i < last; ++i) {
+      I length = A.myOffsets[i + 1] - A.myOffsets[i];
+      offsets[i + 1] = offsets[i] + (myTiles[b] ? 0 : length);
+      for (I k = A.myOffsets[i]; myTiles[b] && k < A.myOffsets[i + 1]; ++k) {
+        myTiles[b][(size_t)(i - first) * noCols + A.myIndices[k]] = A.myValues[k];
+        noNonSparseValues += A.myValues[k] != commonValue; // A stored common value is just background here
+      }
+    }
+  }
+  I nnz = offsets[noRows];
+  noNonSparseValues += nnz;
+  I* indices = new I[nnz];
+  T* values = new T[nnz];
+  for (I i = 0; i < noRows; ++i) {
+    if (offsets[i + 1] > offsets[i]) {
+      copy(A.myIndices + A.myOffsets[i], A.myIndices + A.myOffsets[i + 1], indices + offsets[i]);
+      copy(A.myValues + A.myOffsets[i], A.myValues + A.myOffsets[i + 1], values + offsets[i]);
+    }
+  }
+  mySparse = new BasicSparseMatrix<T, I>(noRows, noCols, commonValue, nnz, offsets, indices, values, true);
+  delete rowsOfM;
+}
+
+/// @brief Deletes the sparse blocks and the tiles.
+template <typename T, typename I>
+BasicHybridSparseMatrix<T, I>::~BasicHybridSparseMatrix()
+{
+  for (I b = 0; b < noBlocks; ++b) {
+    delete[] myTiles[b];
+  }
+  delete[] myTiles;
+  delete mySparse;
+}
+
+/// @brief Tells whether a block with count non-common cells is dense enough to be stored densely.
+/// @param count The number of non-common cells, or a bound on it.
+/// @param rows The number of rows of the block.
+/// @return True to store the block densely.
+template <typename T, typename I>
+bool BasicHybridSparseMatrix<T, I>::isDense(long long count, I rows) const
+{
+  return noCols > 0 && (double)count >= threshold * rows * noCols;
+}
+
+/// @brief Finds the cells of a row when its block is dense.
+/// @param row The row.
+/// @return The noCols cells of the row, or nullptr when its block is sparse.
+template <typename T, typename I>
+const T* BasicHybridSparseMatrix<T, I>::denseRow(I row) const
+{
+  const T* tile = myTiles[row / BLOCK_ROWS];
+  return tile ? tile + (size_t)(row % BLOCK_ROWS) * noCols : nullptr;
+}
+
+/// @brief Adds a multiple of a row to running sums, common values included.
+/// @param row The row.
+/// @param alpha The multiple.
+/// @param cells The running sums, noCols long.
+template <typename T, typename I>
+void BasicHybridSparseMatrix<T, I>::addRow(I row, Sum alpha, Sum* cells) const
+{
+  const T* dense = denseRow(row);
+  if (dense) {
+    ValueKernel<T>::axpy(alpha, dense, noCols, cells);
+    return;
+  }
+  if (commonValue != 0) {
+    Sum shift = alpha * commonValue;
+    for (I j = 0; j < noCols; ++j) {
+      cells[j] += shift;
+    }
+  }
+  for (I k = mySparse->myOffsets[row]; k < mySparse->myOffsets[row + 1]; ++k) {
+    cells[mySparse->myIndices[k]] += alpha * ((Sum)mySparse->myValues[k] - commonValue);
+  }
+}
+
+/// @brief Computes a matrix block by block, each block in the form its density calls for.
+///
+/// A block whose bound on non-common cells reaches the threshold is computed densely: denseRow()
+/// fills every cell of a row, which is then narrowed into the tile. Should cancellation leave the
+/// tile below the threshold after all, it is moved into the sparse part. The other blocks are
+/// computed like buildRows() does, with sparseRow() adding every cell's difference from the common
+/// value into a RowAccumulator. Blocks are split into contiguous ranges of about the same work.
+/// @param n The number of rows of the result.
+/// @param m The number of columns of the result.
+/// @param cv The common value of the result.
+/// @param threshold The density threshold of the result.
+/// @param estimates A bound on the non-common cells of every block.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @param denseRow Sets the noCols sums to the cells of row i.
+/// @param sparseRow Adds the differences of the cells of row i from cv into the accumulator.
+/// @return The matrix, owned by the caller.
+template <typename T, typename I>
+BasicHybridSparseMatrix<T, I>* BasicHybridSparseMatrix<T, I>::assemble(
+    I n, I m, T cv, double threshold, const long long* estimates, int noThreads,
+    const function<void(I, Sum*)>& denseRow, const function<void(I, RowAccumulator<T, I>&)>& sparseRow)
+{
+  BasicHybridSparseMatrix* result = new BasicHybridSparseMatrix(n, m, cv, threshold);
+  I noBlocks = result->noBlocks;
+  long long* cost = new long long[noBlocks + 1];
+  cost[0] = 0;
+  for (I b = 0; b < noBlocks; ++b) {
+    I rows = min((I)BLOCK_ROWS, (I)(n - b * BLOCK_ROWS));
+    cost[b + 1] = cost[b] + 1 + (result->isDense(estimates[b], rows) ? (long long)rows * m : estimates[b]);
+  }
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max((I)1, min((I)noThreads, noBlocks));
+  I* blockBounds = new I[noParts + 1];
+  BasicSparseMatrix<T, I>::balanceRows(cost, noBlocks, noParts, blockBounds);
+
+  EntryBuffer<T, I>* parts = new EntryBuffer<T, I>[noParts];
+  long long* counts = new long long[noParts];
+  I* offsets = new I[n + 1];
+  BasicSparseMatrix<T, I>::runParts(noParts, [&](int p) {
+    RowAccumulator<T, I> acc(m);
+    Sum* cells = nullptr;
+    counts[p] = 0;
+    for (I b = blockBounds[p]; b < blockBounds[p + 1]; ++b) {
+      I first = b * BLOCK_ROWS;
+      I last = min((I)(first + BLOCK_ROWS), n);
+      if (!result->isDense(estimates[b], last - first)) {
+        for (I i = first; i < last; ++i) {
+          acc.start(i);
+          sparseRow(i, acc);
+          offsets[i + 1] = acc.flush(parts[p], cv); // Row length for now, offsets after the prefix sum
+        }
+        continue;
+      }
+      if (cells == nullptr) {
+        cells = new Sum[m];
+      }
+      T* tile = new T[(size_t)(last - first) * m];
+      long long count = 0;
+      for (I i = first; i < last; ++i) {
+        T* out = tile + (size_t)(i - first) * m;
+        denseRow(i, cells);
+        for (I j = 0; j < m; ++j) {
+          out[j] = (T)cells[j];
+          count += out[j] != cv;
+        }
+      }
+      if (result->isDense(count, last - first)) {
+        result->myTiles[b] = tile;
+        counts[p] += count;
+        fill(offsets + first + 1, offsets + last + 1, (I)0);
+        continue;
+      }
+      for (I i = first; i < last; ++i) {
+        I before = parts[p].size;
+        for (I j = 0; j < m; ++j) {
+          if (tile[(size_t)(i - first) * m + j] != cv) {
+            parts[p].push(j, tile[(size_t)(i - first) * m + j]);
+          }
+        }
+        offsets[i + 1] = parts[p].size - before;
+      }
+      delete[] tile;
+    }
+    delete[] cells;
+  });
+
+  I* bounds = new I[noParts + 1];
+  for (int p = 0; p <= noParts; ++p) {
+    bounds[p] = (I)min((long long)blockBounds[p] * BLOCK_ROWS, (long long)n);
+  }
+  result->mySparse = BasicSparseMatrix<T, I>::assembleParts(n, m, cv, noParts, bounds, parts, offsets);
+  result->noNonSparseValues = result->mySparse->noNonSparseValues;
+  for (int p = 0; p < noParts; ++p) {
+    result->noNonSparseValues += (I)counts[p];
+  }
+  delete[] cost;
+  delete[] blockBounds;
+  delete[] bounds;
+  delete[] parts;
+  delete[] counts;
+  return result;
+}
+
+/// @brief Copies the matrix into CSR form.
+/// @return The CSR matrix, owned by the caller.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* BasicHybridSparseMatrix<T, I>::toSparse() const
+{
+  const BasicSparseMatrix<T, I>& S = *mySparse;
+  I* offsets = new I[noRows + 1];
+  I* indices = new I[noNonSparseValues];
+  T* values = new T[noNonSparseValues];
+  offsets[0] = 0;
+  for (I i = 0; i < noRows; ++i) {
+    const T* dense = denseRow(i);
+    I next = offsets[i];
+    for (I j = 0; dense && j < noCols; ++j) {
+      if (dense[j] != commonValue) {
+        indices[next] = j;
+        values[next++] = dense[j];
+      }
+    }
+    copy(S.myIndices + S.myOffsets[i], S.myIndices + S.myOffsets[i + 1], indices + next);
+    copy(S.myValues + S.myOffsets[i], S.myValues + S.myOffsets[i + 1], values + next);
+    offsets[i + 1] = next + S.myOffsets[i + 1] - S.myOffsets[i];
+  }
+  return new BasicSparseMatrix<T, I>(noRows, noCols, commonValue, noNonSparseValues, offsets, indices, values, true);
+}
+
+/// @brief Adds two matrices together and returns the result as a new matrix.
+/// @param M The matrix to add to the current matrix calling the method.
+/// @return The newly generated matrix based on the addition completed.
+template <typename T, typename I>
+BasicHybridSparseMatrix<T, I>* BasicHybridSparseMatrix<T, I>::Add(const BasicHybridSparseMatrix &M) const
+{
+  return this->Add(M, 1);
+}
+
+/// @brief Adds two matrices with the blocks split across threads.
+///
+/// A block of the result is dense when either operand block is, or when the two blocks together
+/// store enough cells to reach the threshold; dense rows are two axpy passes. Sparse blocks merge
+/// the stored entries. The result has the sum of the two common values as its own.
+/// @param M The matrix to add to the current matrix calling the method.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly generated matrix based on the addition completed.
+template <typename T, typename I>
+BasicHybridSparseMatrix<T, I>* BasicHybridSparseMatrix<T, I>::Add(const BasicHybridSparseMatrix &M, int noThreads) const
+{
+  if (this->noRows != M.noRows || this->noCols != M.noCols) {
+    throw std::invalid_argument("Matrix addition is not possible");
+  }
+  const BasicSparseMatrix<T, I>& A = *this->mySparse;
+  const BasicSparseMatrix<T, I>& B = *M.mySparse;
+  long long* estimates = new long long[noBlocks];
+  for (I b = 0; b < noBlocks; ++b) {
+    I first = b * BLOCK_ROWS;
+    I last = min((I)(first + BLOCK_ROWS), noRows);
+    estimates[b] = this->myTiles[b] || M.myTiles[b] ? (long long)(last - first) * noCols
+                 : (long long)A.myOffsets[last] - A.myOffsets[first] + B.myOffsets[last] - B.myOffsets[first];
+  }
+  BasicHybridSparseMatrix* result = assemble(noRows, noCols, (T)(this->commonValue + M.commonValue), threshold,
+                                             estimates, noThreads, [&](I i, Sum* cells) {
+    fill(cells, cells + noCols, (Sum)0);
+    this->addRow(i, 1, cells);
+    M.addRow(i, 1, cells);
+  }, [&](I i, RowAccumulator<T, I>& acc) {
+    for (I k = A.myOffsets[i]; k < A.myOffsets[i + 1]; ++k) {
+      acc.add(A.myIndices[k], (Sum)A.myValues[k] - this->commonValue);
+    }
+    for (I k = B.myOffsets[i]; k < B.myOffsets[i + 1]; ++k) {
+      acc.add(B.myIndices[k], (Sum)B.myValues[k] - M.commonValue);
+    }
+  });
+  delete[] estimates;
+  return result;
+}
+
+/// @brief Multiplies two matrices together and returns the result as a new matrix.
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @return The newly generated matrix based on the multiplication completed.
+template <typename T, typename I>
+BasicHybridSparseMatrix<T, I>* BasicHybridSparseMatrix<T, I>::Multiply(const BasicHybridSparseMatrix &M) const
+{
+  return this->Multiply(M, 1);
+}
+
+/// @brief Multiplies two matrices with the blocks split across threads.
+///
+/// The multiply-add count of a block bounds its non-common cells, a dense row of M counting as
+/// noCols of them, so blocks that will come out dense are known before they are computed. A dense
+/// row of the result is the sum of the rows of M weighted by the row of this matrix, one axpy per
+/// weight; a sparse one is Gustavson's row product. Common values are handled as in
+/// SparseMatrix::Multiply: the result has common value a*b*k, and sparse rows add the rank-one
+/// corrections for the column sums of M and the row sums of this matrix to the product of the
+/// differences from the common values.
+/// @param M The matrix to multiply with the current matrix calling the method.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The newly generated matrix based on the multiplication completed.
+template <typename T, typename I>
+BasicHybridSparseMatrix<T, I>* BasicHybridSparseMatrix<T, I>::Multiply(const BasicHybridSparseMatrix &M,
+                                                                        int noThreads) const
+{
+  if (this->noCols != M.noRows) {
+    throw std::invalid_argument("Matrix multiplication is not possible");
+  }
+  const BasicSparseMatrix<T, I>& A = *this->mySparse;
+  const BasicSparseMatrix<T, I>& B = *M.mySparse;
+  T cvA = this->commonValue;
+  T cvB = M.commonValue;
+  I m = M.noCols;
+
+  // Cells a row of this matrix does not store weigh the rows of M by cvA, which adds cvA times the
+  // column sums of M to every row of the product; sparse rows add the part beyond cvA*cvB*k
+  Sum* colSums = nullptr;
+  I* sumCols = nullptr;
+  I noSumCols = 0;
+  if (cvA != 0) {
+    colSums = new Sum[m];
+    fill(colSums, colSums + m, (Sum)0);
+    for (I k = 0; k < M.noRows; ++k) {
+      M.addRow(k, 1, colSums);
+    }
+    sumCols = new I[m];
+    for (I j = 0; j < m; ++j) {
+      if (colSums[j] != (Sum)cvB * M.noRows) {
+        sumCols[noSumCols++] = j;
+      }
+    }
+  }
+
+  long long* estimates = new long long[noBlocks];
+  for (I b = 0; b < noBlocks; ++b) {
+    I first = b * BLOCK_ROWS;
+    I last = min((I)(first + BLOCK_ROWS), noRows);
+    long long full = (long long)(last - first) * m;
+    estimates[b] = (long long)(last - first) * noSumCols;
+    for (I i = first; i < last && estimates[b] < full; ++i) {
+      for (I ka = A.myOffsets[i]; ka < A.myOffsets[i + 1]; ++ka) {
+        I k = A.myIndices[ka];
+        estimates[b] += M.denseRow(k) ? m : B.myOffsets[k + 1] - B.myOffsets[k];
+      }
+      if (cvB != 0 && A.myOffsets[i + 1] > A.myOffsets[i]) {
+        estimates[b] += m;
+      }
+    }
+    estimates[b] = this->myTiles[b] ? full : min(estimates[b], full);
+  }
+
+  T background = (T)((Sum)cvA * cvB * this->noCols);
+  BasicHybridSparseMatrix* result = assemble(noRows, m, background, threshold, estimates, noThreads,
+                                             [&](I i, Sum* cells) {
+    for (I j = 0; j < m; ++j) {
+      cells[j] = colSums ? cvA * colSums[j] : 0;
+    }
+    const T* dense = this->denseRow(i);
+    if (dense) {
+      for (I k = 0; k < this->noCols; ++k) {
+        if (dense[k] != cvA) {
+          M.addRow(k, (Sum)dense[k] - cvA, cells);
+        }
+      }
+    }
+    for (I ka = A.myOffsets[i]; ka < A.myOffsets[i + 1]; ++ka) {
+      M.addRow(A.myIndices[ka], (Sum)A.myValues[ka] - cvA, cells);
+    }
+  }, [&](I i, RowAccumulator<T, I>& acc) {
+    // Only reached for sparse blocks of this matrix, whose rows are all in A
+    Sum rowSum = 0;
+    for (I ka = A.myOffsets[i]; ka < A.myOffsets[i + 1]; ++ka) {
+      I k = A.myIndices[ka];
+      Sum a = (Sum)A.myValues[ka] - cvA;
+      rowSum += a;
+      const T* dense = M.denseRow(k);
+      for (I j = 0; a != 0 && dense && j < m; ++j) {
+        if (dense[j] != cvB) {
+          acc.add(j, a * ((Sum)dense[j] - cvB));
+        }
+      }
+      for (I kb = B.myOffsets[k]; a != 0 && kb < B.myOffsets[k + 1]; ++kb) {
+        acc.add(B.myIndices[kb], a * ((Sum)B.myValues[kb] - cvB));
+      }
+    }
+    for (I s = 0; s < noSumCols; ++s) {
+      acc.add(sumCols[s], cvA * (colSums[sumCols[s]] - (Sum)cvB * M.noRows));
+    }
+    if (cvB != 0 && rowSum != 0) {
+      for (I j = 0; j < m; ++j) {
+        acc.add(j, cvB * rowSum);
+      }
+    }
+  });
+  delete[] estimates;
+  delete[] colSums;
+  delete[] sumCols;
+  return result;
+}
+
+/// @brief Get value from the matrix.
+/// @param row The row index.
+/// @param col The column index.
+/// @return The value at the specified row and column.
+template <typename T, typename I>
+T BasicHybridSparseMatrix<T, I>::getValue(I row, I col) const
+{
+  if (row < 0 || row >= noRows || col < 0 || col >= noCols) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+  const T* dense = denseRow(row);
+  return dense ? dense[col] : mySparse->getValue(row, col);
+}
+
+/// @brief Gets the number of rows of the matrix.
+/// @return The number of rows.
+template <typename T, typename I>
+I BasicHybridSparseMatrix<T, I>::getNoRows() const
+{
+  return this->noRows;
+}
+
+/// @brief Gets the number of columns of the matrix.
+/// @return The number of columns.
+template <typename T, typename I>
+I BasicHybridSparseMatrix<T, I>::getNoCols() const
+{
+  return this->noCols;
+}
+
+/// @brief Gets the common (background) value of the matrix.
+/// @return The common value.
+template <typename T, typename I>
+T BasicHybridSparseMatrix<T, I>::getCommonValue() const
+{
+  return this->commonValue;
+}
+
+/// @brief Gets the number of cells that differ from the common value, in either form.
+/// @return The number of non-common cells.
+template <typename T, typename I>
+I BasicHybridSparseMatrix<T, I>::getNoNonSparseValues() const
+{
+  return this->noNonSparseValues;
+}
+
+/// @brief Gets the number of blocks stored densely.
+/// @return The number of dense blocks.
+template <typename T, typename I>
+I BasicHybridSparseMatrix<T, I>::getNoDenseBlocks() const
+{
+  I count = 0;
+  for (I b = 0; b < noBlocks; ++b) {
+    count += myTiles[b] != nullptr;
+  }
+  return count;
+}
+
+/// @brief Gets the share of non-common cells from which a block is stored densely.
+/// @return The density threshold.
+template <typename T, typename I>
+double BasicHybridSparseMatrix<T, I>::getDensityThreshold() const
+{
+  return this->threshold;
+}
+
+/// @brief Gets the memory the matrix holds, to compare against plain CSR.
+/// @return The size of the CSR arrays and the tiles in bytes.
+template <typename T, typename I>
+long long BasicHybridSparseMatrix<T, I>::getMemoryUsage() const
+{
+  long long bytes = (long long)(noRows + 1) * sizeof(I) + (long long)noBlocks * sizeof(T*)
+                  + (long long)mySparse->noNonSparseValues * (sizeof(I) + sizeof(T));
+  for (I b = 0; b < noBlocks; ++b) {
+    if (myTiles[b]) {
+      bytes += (long long)min((I)BLOCK_ROWS, (I)(noRows - b * BLOCK_ROWS)) * noCols * sizeof(T);
+    }
+  }
+  return bytes;
+}
+
+/// @brief Overload << operator to allow for easier printing of HybridSparseMatrix object.
+///
+/// Prints the same lines as a SparseMatrix holding the same cells, every non-common cell in row
+/// order, by printing the CSR copy.
+/// @param s The stream to send the display data.
+/// @param hm The reference to the HybridSparseMatrix object to print.
+/// @return A reference to the stream where the object was sent.
+template <typename T, typename I>
+ostream& operator<<(ostream& s, const BasicHybridSparseMatrix<T, I>& hm)
+{
+  BasicSparseMatrix<T, I>* sparse = hm.toSparse();
+  s << *sparse;
+  delete sparse;
+  return s;
+}
+
+/// @brief Display the matrix in its original format, through the CSR printer.
+template <typename T, typename I>
+void BasicHybridSparseMatrix<T, I>::displayMatrix() const
+{
+  BasicSparseMatrix<T, I>* sparse = toSparse();
+  sparse->displayMatrix();
+  delete sparse;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              SparseExpr Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Wraps an already built node.
+/// @param node The root of the expression.
+template <typename T, typename I>
+BasicSparseExpr<T, I>::BasicSparseExpr(const shared_ptr<Node>& node)
+  : myNode(node)
+{
+}
+
+/// @brief Constructs an expression that is just a matrix.
+/// @param M The matrix, referenced until the expression is evaluated.
+template <typename T, typename I>
+BasicSparseExpr<T, I>::BasicSparseExpr(const Matrix& M)
+  : myNode(makeNode(LEAF, M.getNoRows(), M.getNoCols()))
+{
+  myNode->matrix = &M;
+}
+
+/// @brief Allocates a node with no operands.
+/// @param kind The operation of the node.
+/// @param noRows The rows of its result.
+/// @param noCols The columns of its result.
+/// @return The new node.
+template <typename T, typename I>
+shared_ptr<typename BasicSparseExpr<T, I>::Node> BasicSparseExpr<T, I>::makeNode(Kind kind, I noRows, I noCols)
+{
+  shared_ptr<Node> node = make_shared<Node>();
+  node->kind = kind;
+  node->matrix = nullptr;
+  node->alpha = 1;
+  node->beta = 1;
+  node->noRows = noRows;
+  node->noCols = noCols;
+  return node;
+}
+
+/// @brief Records a transpose.
+/// @return The transposed expression.
+template <typename T, typename I>
+BasicSparseExpr<T, I> BasicSparseExpr<T, I>::Transpose() const
+{
+  shared_ptr<Node> node = makeNode(TRANSPOSE, myNode->noCols, myNode->noRows);
+  node->left = myNode;
+  return BasicSparseExpr(node);
+}
+
+/// @brief Records a scaling.
+/// @param alpha The scale.
+/// @return alpha times this expression.
+template <typename T, typename I>
+BasicSparseExpr<T, I> BasicSparseExpr<T, I>::Scale(T alpha) const
+{
+  shared_ptr<Node> node = makeNode(SCALE, myNode->noRows, myNode->noCols);
+  node->alpha = alpha;
+  node->left = myNode;
+  return BasicSparseExpr(node);
+}
+
+/// @brief Records an addition.
+/// @param other The expression to add.
+/// @return this + other.
+template <typename T, typename I>
+BasicSparseExpr<T, I> BasicSparseExpr<T, I>::Add(const BasicSparseExpr& other) const
+{
+  return this->Axpby(1, other, 1);
+}
+
+/// @brief Records a scaled addition.
+/// @param alpha The scale of this expression.
+/// @param other The expression to add.
+/// @param beta The scale of other.
+/// @return alpha*this + beta*other.
+template <typename T, typename I>
+BasicSparseExpr<T, I> BasicSparseExpr<T, I>::Axpby(T alpha, const BasicSparseExpr& other, T beta) const
+{
+  if (myNode->noRows != other.myNode->noRows || myNode->noCols != other.myNode->noCols) {
+    throw std::invalid_argument("Matrix addition is not possible");
+  }
+  shared_ptr<Node> node = makeNode(AXPBY, myNode->noRows, myNode->noCols);
+  node->alpha = alpha;
+  node->beta = beta;
+  node->left = myNode;
+  node->right = other.myNode;
+  return BasicSparseExpr(node);
+}
+
+/// @brief Records a multiplication.
+/// @param other The right hand side.
+/// @return this * other.
+template <typename T, typename I>
+BasicSparseExpr<T, I> BasicSparseExpr<T, I>::Multiply(const BasicSparseExpr& other) const
+{
+  if (myNode->noCols != other.myNode->noRows) {
+    throw std::invalid_argument("Matrix multiplication is not possible");
+  }
+  shared_ptr<Node> node = makeNode(MULTIPLY, myNode->noRows, other.myNode->noCols);
+  node->left = myNode;
+  node->right = other.myNode;
+  return BasicSparseExpr(node);
+}
+
+/// @brief Gets the number of rows of the result.
+/// @return The number of rows.
+template <typename T, typename I>
+I BasicSparseExpr<T, I>::getNoRows() const
+{
+  return myNode->noRows;
+}
+
+/// @brief Gets the number of columns of the result.
+/// @return The number of columns.
+template <typename T, typename I>
+I BasicSparseExpr<T, I>::getNoCols() const
+{
+  return myNode->noCols;
+}
+
+/// @brief Computes the expression.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The result, owned by the caller.
+template <typename T, typename I>
+typename BasicSparseExpr<T, I>::Matrix* BasicSparseExpr<T, I>::evaluate(int noThreads) const
+{
+  return evaluate(*myNode, false, noThreads);
+}
+
+/// @brief Counts the terms a sum can flatten into, nested products count as one.
+/// @param node The root of the sum.
+/// @return An upper bound on the number of terms.
+template <typename T, typename I>
+int BasicSparseExpr<T, I>::countTerms(const Node& node)
+{
+  switch (node.kind) {
+    case AXPBY:
+      return countTerms(*node.left) + countTerms(*node.right);
+    case TRANSPOSE:
+    case SCALE:
+      return countTerms(*node.left);
+    default:
+      return 1;
+  }
+}
+
+/// @brief Flattens nested sums, scalings and transposes into a list of scaled matrices.
+///
+/// Transposes are pushed down to the operands, where they are views, and nested products are
+/// evaluated. Every matrix created on the way is recorded in temporaries for the caller to delete.
+/// @param node The root of the sum.
+/// @param coef The scale applied to the whole sum.
+/// @param transposed True to collect the terms of the transposed sum.
+/// @param noThreads The number of threads for nested products.
+/// @param terms Receives the terms.
+/// @param noTerms The number of terms so far, updated.
+/// @param temporaries Receives the matrices to delete.
+/// @param noTemporaries The number of temporaries so far, updated.
+template <typename T, typename I>
+void BasicSparseExpr<T, I>::collect(const Node& node, T coef, bool transposed, int noThreads, Term* terms, int& noTerms,
+                         Matrix** temporaries, int& noTemporaries)
+{
+  if (coef == 0) {
+    return; // Contributes nothing, background included
+  }
+  switch (node.kind) {
+    case LEAF:
+      terms[noTerms].coef = coef;
+      if (transposed) {
+        terms[noTerms].matrix = temporaries[noTemporaries++] = node.matrix->Transpose();
+      } else {
+        terms[noTerms].matrix = node.matrix;
       }
+      ++noTerms;
+      break;
+    case TRANSPOSE:
+      collect(*node.left, coef, !transposed, noThreads, terms, noTerms, temporaries, noTemporaries);
+      break;
+    case SCALE:
+      collect(*node.left, coef * node.alpha, transposed, noThreads, terms, noTerms, temporaries, noTemporaries);
+      break;
+    case AXPBY:
+      collect(*node.left, coef * node.alpha, transposed, noThreads, terms, noTerms, temporaries, noTemporaries);
+      collect(*node.right, coef * node.beta, transposed, noThreads, terms, noTerms, temporaries, noTemporaries);
+      break;
+    case MULTIPLY:
+      terms[noTerms].coef = coef;
+      terms[noTerms].matrix = temporaries[noTemporaries++] = evaluate(node, transposed, noThreads);
+      ++noTerms;
+      break;
+  }
+}
+
+/// @brief Gets every term into CSR form so the row kernels can walk it.
+///
+/// If every term is compressed by columns they are all replaced by their transposed views, which are
+/// CSR, and the caller solves the transposed problem. Otherwise the CSC terms are re-compressed by rows.
+/// @param terms The terms, updated in place.
+/// @param noTerms The number of terms.
+/// @param temporaries Receives the matrices to delete.
+/// @param noTemporaries The number of temporaries so far, updated.
+/// @return True when the terms were transposed.
+template <typename T, typename I>
+bool BasicSparseExpr<T, I>::toRows(Term* terms, int noTerms, Matrix** temporaries, int& noTemporaries)
+{
+  bool allColumns = noTerms > 0;
+  for (int t = 0; t < noTerms; ++t) {
+    allColumns = allColumns && !terms[t].matrix->rowMajor;
+  }
+  for (int t = 0; t < noTerms; ++t) {
+    if (allColumns) {
+      terms[t].matrix = temporaries[noTemporaries++] = terms[t].matrix->Transpose();
+    } else if (!terms[t].matrix->rowMajor) {
+      terms[t].matrix = temporaries[noTemporaries++] = terms[t].matrix->Recompress(true);
     }
   }
- 
- cin >> n >> m >> cv >> noNSV; 
- SparseMatrix* secondOne = new SparseMatrix(n, m, cv, noNSV); 
- 
-  // Read the values for the second matrix
+  return allColumns;
+}
+
+/// @brief Adds up scaled matrices of any orientation.
+/// @param terms The terms, all noRows by noCols.
+/// @param noTerms The number of terms.
+/// @param noRows The rows of the result.
+/// @param noCols The columns of the result.
+/// @param noThreads The number of threads to use.
+/// @return The sum, owned by the caller.
+template <typename T, typename I>
+typename BasicSparseExpr<T, I>::Matrix* BasicSparseExpr<T, I>::sumOf(Term* terms, int noTerms, I noRows, I noCols,
+                                                                      int noThreads)
+{
+  Matrix** temporaries = new Matrix*[noTerms + 1];
+  int noTemporaries = 0;
+  bool flipped = toRows(terms, noTerms, temporaries, noTemporaries);
+  Matrix* result = flipped ? combine(terms, noTerms, noCols, noRows, noThreads)
+                                 : combine(terms, noTerms, noRows, noCols, noThreads);
+  if (flipped) {
+    Matrix* view = result->Transpose();
+    delete result;
+    result = view;
+  }
+  for (int t = 0; t < noTemporaries; ++t) {
+    delete temporaries[t];
+  }
+  delete[] temporaries;
+  return result;
+}
+
+/// @brief Evaluates a node, or its transpose.
+///
+/// A sum is flattened into terms and combined in one pass. A product flattens both of its sides and
+/// runs one fused Gustavson pass over them. Products involving a non-zero common value are left to
+/// SparseMatrix::Multiply on the two evaluated sides.
+/// @param node The node to evaluate.
+/// @param transposed True to evaluate the transpose of node.
+/// @param noThreads The number of threads to use.
+/// @return The result, owned by the caller.
+template <typename T, typename I>
+typename BasicSparseExpr<T, I>::Matrix* BasicSparseExpr<T, I>::evaluate(const Node& node, bool transposed,
+                                                                         int noThreads)
+{
+  I noRows = transposed ? node.noCols : node.noRows;
+  I noCols = transposed ? node.noRows : node.noCols;
+
+  // A product is first * second with first and second sums, (LR)^T = R^T L^T
+  const Node* first = &node;
+  const Node* second = nullptr;
+  I inner = 0;
+  if (node.kind == MULTIPLY) {
+    first = transposed ? node.right.get() : node.left.get();
+    second = transposed ? node.left.get() : node.right.get();
+    inner = node.left->noCols;
+  }
+
+  int capacity = countTerms(*first) + (second ? countTerms(*second) : 0);
+  Term* terms = new Term[capacity];
+  Matrix** temporaries = new Matrix*[2 * capacity];
+  int noTerms = 0, noTemporaries = 0;
+  collect(*first, 1, transposed, noThreads, terms, noTerms, temporaries, noTemporaries);
+  int noFirst = noTerms;
+  if (second) {
+    collect(*second, 1, transposed, noThreads, terms, noTerms, temporaries, noTemporaries);
+  }
+
+  bool zeroBackground = true;
+  for (int t = 0; t < noTerms; ++t) {
+    zeroBackground = zeroBackground && terms[t].matrix->commonValue == 0;
+  }
+
+  Matrix* result;
+  if (!second) {
+    result = sumOf(terms, noTerms, noRows, noCols, noThreads);
+  } else if (!zeroBackground) {
+    Matrix* left = sumOf(terms, noFirst, noRows, inner, noThreads);
+    Matrix* right = sumOf(terms + noFirst, noTerms - noFirst, inner, noCols, noThreads);
+    result = left->Multiply(*right, noThreads);
+    delete left;
+    delete right;
+  } else {
+    // Transposed views turn (first * second)^T into second^T * first^T on CSR arrays
+    bool flipped = toRows(terms, noTerms, temporaries, noTemporaries);
+    if (flipped) {
+      Matrix* product = multiply(terms + noFirst, noTerms - noFirst, terms, noFirst, noCols, noRows, noThreads);
+      result = product->Transpose();
+      delete product;
+    } else {
+      result = multiply(terms, noFirst, terms + noFirst, noTerms - noFirst, noRows, noCols, noThreads);
+    }
+  }
+
+  delete[] terms;
+  for (int t = 0; t < noTemporaries; ++t) {
+    delete temporaries[t];
+  }
+  delete[] temporaries;
+  return result;
+}
+
+/// @brief Adds up scaled CSR matrices in one pass over their rows.
+///
+/// Every stored entry adds coef * (value - commonValue) to a sparse accumulator, and the result's
+/// background is the scaled sum of the common values, so no pairwise intermediate is built.
+/// @param terms The terms, all CSR and noRows by noCols.
+/// @param noTerms The number of terms.
+/// @param noRows The rows of the result.
+/// @param noCols The columns of the result.
+/// @param noThreads The number of threads to use.
+/// @return The sum, owned by the caller.
+template <typename T, typename I>
+typename BasicSparseExpr<T, I>::Matrix* BasicSparseExpr<T, I>::combine(Term* terms, int noTerms, I noRows, I noCols,
+                                                                        int noThreads)
+{
+  typedef typename Matrix::Sum Sum;
+  Sum background = 0;
+  for (int t = 0; t < noTerms; ++t) {
+    background += (Sum)terms[t].coef * terms[t].matrix->commonValue;
+  }
+
+  long long* cost = new long long[noRows + 1];
+  cost[0] = 0;
+  for (I i = 0; i < noRows; ++i) {
+    cost[i + 1] = cost[i] + 1;
+    for (int t = 0; t < noTerms; ++t) {
+      cost[i + 1] += terms[t].matrix->myOffsets[i + 1] - terms[t].matrix->myOffsets[i];
+    }
+  }
+
+  Matrix* result = Matrix::buildRows(noRows, noCols, (T)background, cost, noThreads, [&](I i, RowAccumulator<T, I>& acc) {
+    for (int t = 0; t < noTerms; ++t) {
+      const Matrix& X = *terms[t].matrix;
+      for (I k = X.myOffsets[i]; k < X.myOffsets[i + 1]; ++k) {
+        acc.add(X.myIndices[k], (Sum)terms[t].coef * (X.myValues[k] - X.commonValue));
+      }
+    }
+  });
+  delete[] cost;
+  return result;
+}
+
+/// @brief Multiplies two sums of scaled CSR matrices with a single Gustavson pass.
+///
+/// Row i of the result accumulates left_s(i,k) * right_t(k,:) over every pair of terms, which adds the
+/// operands on the fly instead of materializing either sum. All common values must be zero.
+/// @param left The terms of the left side.
+/// @param noLeft The number of left terms.
+/// @param right The terms of the right side.
+/// @param noRight The number of right terms.
+/// @param noRows The rows of the result.
+/// @param noCols The columns of the result.
+/// @param noThreads The number of threads to use.
+/// @return The product, owned by the caller.
+template <typename T, typename I>
+typename BasicSparseExpr<T, I>::Matrix* BasicSparseExpr<T, I>::multiply(Term* left, int noLeft, Term* right,
+                                                                         int noRight, I noRows, I noCols, int noThreads)
+{
+  typedef typename Matrix::Sum Sum;
+  long long* cost = new long long[noRows + 1];
+  cost[0] = 0;
+  for (I i = 0; i < noRows; ++i) {
+    cost[i + 1] = cost[i] + 1;
+    for (int s = 0; s < noLeft; ++s) {
+      const Matrix& L = *left[s].matrix;
+      for (I ka = L.myOffsets[i]; ka < L.myOffsets[i + 1]; ++ka) {
+        for (int t = 0; t < noRight; ++t) {
+          const Matrix& R = *right[t].matrix;
+          cost[i + 1] += R.myOffsets[L.myIndices[ka] + 1] - R.myOffsets[L.myIndices[ka]];
+        }
+      }
+    }
+  }
+
+  Matrix* result = Matrix::buildRows(noRows, noCols, 0, cost, noThreads, [&](I i, RowAccumulator<T, I>& acc) {
+    for (int s = 0; s < noLeft; ++s) {
+      const Matrix& L = *left[s].matrix;
+      for (I ka = L.myOffsets[i]; ka < L.myOffsets[i + 1]; ++ka) {
+        I k = L.myIndices[ka];
+        for (int t = 0; t < noRight; ++t) {
+          const Matrix& R = *right[t].matrix;
+          Sum a = (Sum)left[s].coef * right[t].coef * L.myValues[ka];
+          for (I kb = R.myOffsets[k]; kb < R.myOffsets[k + 1]; ++kb) {
+            acc.add(R.myIndices[kb], a * R.myValues[kb]);
+          }
+        }
+      }
+    }
+  });
+  delete[] cost;
+  return result;
+}
+
+// The instantiations other than SparseMatrix, compiled here so the build checks every supported type
+template class BasicSparseMatrix<long long, int>;
+template class BasicSparseMatrix<float, int>;
+template class BasicSparseMatrix<double, int>;
+template class BasicSparseMatrix<double, long long>;
+template class BasicBlockSparseMatrix<int, int>;
+template class BasicBlockSparseMatrix<float, int>;
+template class BasicBlockSparseMatrix<double, int>;
+template class BasicBlockSparseMatrix<double, long long>;
+template class BasicTriangleSparseMatrix<int, int>;
+template class BasicTriangleSparseMatrix<float, int>;
+template class BasicTriangleSparseMatrix<double, int>;
+template class BasicTriangleSparseMatrix<double, long long>;
+template class BasicPackedSparseMatrix<int, int>;
+template class BasicPackedSparseMatrix<float, int>;
+template class BasicPackedSparseMatrix<double, int>;
+template class BasicPackedSparseMatrix<double, long long>;
+template class BasicSparseSolver<float, int>;
+template class BasicSparseSolver<double, int>;
+template class BasicSparseSolver<double, long long>;
+template class BasicSparseGraph<int, int>;
+template class BasicSparseGraph<float, int>;
+template class BasicSparseGraph<double, int>;
+template class BasicSparseGraph<double, long long>;
+template class BasicHybridSparseMatrix<int, int>;
+template class BasicHybridSparseMatrix<float, int>;
+template class BasicHybridSparseMatrix<double, int>;
+template class BasicHybridSparseMatrix<double, long long>;
+template class BasicSparseVectorPlan<int, int>;
+template class BasicSparseVectorPlan<long long, int>;
+template class BasicSparseVectorPlan<float, int>;
+template class BasicSparseVectorPlan<double, int>;
+template class BasicSparseVectorPlan<double, long long>;
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//              MatrixReader Implementation.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Maps an open file for reading, or reads it whole when it cannot be mapped (pipes, terminals).
+///
+/// A mapping is only used when the file does not end on a page boundary: the rest of the last page
+/// reads as zeros, which gives the parser a NUL sentinel without copying anything. Copied input gets
+/// the same sentinel appended.
+/// @param fd The file descriptor to read, it is not closed.
+MatrixReader::MatrixReader(int fd)
+  : myData(nullptr), myLength(0), myMapping(nullptr), myCopy(nullptr), position(nullptr)
+{
+  struct stat info;
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && info.st_size % pageSize != 0) {
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+      myMapping = mapping;
+      myLength = info.st_size;
+      myData = (const char*)mapping;
+    }
+  }
+
+  if (myData == nullptr) {
+    size_t capacity = 1 << 16;
+    myCopy = new char[capacity + 1];
+    ssize_t got;
+    while ((got = read(fd, myCopy + myLength, capacity - myLength)) != 0) {
+      if (got < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Could not read the matrix input");
+      }
+      myLength += got;
+      if (myLength == capacity) {
+        char* bigger = new char[capacity * 2 + 1];
+        copy(myCopy, myCopy + myLength, bigger);
+        delete[] myCopy;
+        myCopy = bigger;
+        capacity *= 2;
+      }
+    }
+    myCopy[myLength] = '\0';
+    myData = myCopy;
+  }
+  position = myData;
+}
+
+/// @brief Unmaps or deletes the input.
+MatrixReader::~MatrixReader()
+{
+  if (myMapping != nullptr) {
+    munmap(myMapping, myLength);
+  }
+  delete[] myCopy;
+  myMapping = nullptr;
+  myCopy = nullptr;
+}
+
+/// @brief Parses the next integer of the input.
+/// @param value Receives the integer.
+/// @return False when the input ends (or holds something other than an integer) instead.
+bool MatrixReader::readInt(int& value)
+{
+  const char* p = position;
+  while ((unsigned char)(*p - 1) < ' ') { // Whitespace, the NUL sentinel stops the loop
+    ++p;
+  }
+  bool negative = *p == '-';
+  p += negative;
+  if ((unsigned)(*p - '0') > 9) {
+    return false;
+  }
+  unsigned magnitude = 0;
+  do {
+    magnitude = magnitude * 10 + (unsigned)(*p - '0');
+    ++p;
+  } while ((unsigned)(*p - '0') <= 9);
+  value = negative ? (int)(0u - magnitude) : (int)magnitude;
+  position = p;
+  return true;
+}
+
+/// @brief Reads the next matrix: a "rows cols commonValue noNonSparseValues" header, then every cell row by row.
+///
+/// Cells are read in row order, so the entries go straight into CSR arrays sized from the header's
+/// non-sparse count. Cells spelled exactly like the common value are skipped without being parsed.
+/// @return The matrix, owned by the caller, or nullptr when the input holds no further matrix.
+SparseMatrix* MatrixReader::next()
+{
+  int n, m, cv, nsv;
+  if (!readInt(n)) {
+    return nullptr;
+  }
+  if (!readInt(m) || !readInt(cv) || !readInt(nsv)) {
+    throw std::runtime_error("Incomplete matrix header");
+  }
+  if (n < 0 || m < 0) {
+    throw std::invalid_argument("Matrix dimensions must not be negative");
+  }
+
+  // Spell the common value out once so runs of it can be matched byte for byte
+  char common[16];
+  int commonLength = snprintf(common, sizeof(common), "%d", cv);
+
+  int capacity = nsv > 0 ? nsv : 16;
+  int* offsets = new int[n + 1];
+  int* indices = new int[capacity];
+  int* values = new int[capacity];
+  int nnz = 0;
+  offsets[0] = 0;
+
   for (int i = 0; i < n; ++i) {
     for (int j = 0; j < m; ++j) {
+      const char* p = position;
+      while ((unsigned char)(*p - 1) < ' ') {
+        ++p;
+      }
+      int c = 0;
+      while (c < commonLength && p[c] == common[c]) {
+        ++c;
+      }
+      if (c == commonLength && (unsigned char)p[c] <= ' ') {
+        position = p + c; // The common value, nothing to store
+        continue;
+      }
+
       int value;
-      cin >> value;
-      if (value != cv) {
-        secondOne->setValue(i, j, value);
+      position = p;
+      if (!readInt(value)) {
+        delete[] offsets;
+        delete[] indices;
+        delete[] values;
+        throw std::runtime_error("Matrix input ended early");
+      }
+      if (value == cv) {
+        continue; // Spelled differently, e.g. with a sign or leading zeros
+      }
+      if (nnz == capacity) { // Only when the header undercounted
+        int* newIndices = new int[capacity * 2];
+        int* newValues = new int[capacity * 2];
+        copy(indices, indices + nnz, newIndices);
+        copy(values, values + nnz, newValues);
+        delete[] indices;
+        delete[] values;
+        indices = newIndices;
+        values = newValues;
+        capacity *= 2;
+      }
+      indices[nnz] = j;
+      values[nnz] = value;
+      ++nnz;
+    }
+    offsets[i + 1] = nnz;
+  }
+
+  return new SparseMatrix(n, m, cv, nnz, offsets, indices, values, true);
+}
+
+/// @brief Reads the next whitespace separated word, such as the name of a check after the matrices.
+/// @param word Receives the word, cut to size - 1 characters and NUL terminated.
+/// @param size The size of word, at least 1.
+/// @return False when the input holds no further word.
+bool MatrixReader::nextWord(char* word, size_t size)
+{
+  const char* p = position;
+  while ((unsigned char)(*p - 1) < ' ') {
+    ++p;
+  }
+  if (*p == '\0') {
+    position = p;
+    return false;
+  }
+  size_t length = 0;
+  for (; (unsigned char)*p > ' '; ++p) {
+    if (length + 1 < size) {
+      word[length++] = *p;
+    }
+  }
+  word[length] = '\0';
+  position = p;
+  return true;
+}
+
+/// @brief Parses an integer that has to start on the current line.
+/// @param p The text to parse, moved past the integer.
+/// @param value Receives the integer.
+/// @return False if the line holds no further integer.
+bool MatrixReader::readLong(const char*& p, long long& value)
+{
+  while (*p == ' ' || *p == '\t') {
+    ++p;
+  }
+  bool negative = *p == '-';
+  p += negative || *p == '+';
+  if ((unsigned)(*p - '0') > 9) {
+    return false;
+  }
+  unsigned long long magnitude = 0;
+  do {
+    magnitude = magnitude * 10 + (unsigned)(*p - '0');
+    ++p;
+  } while ((unsigned)(*p - '0') <= 9);
+  value = negative ? (long long)(0ULL - magnitude) : (long long)magnitude;
+  return true;
+}
+
+/// @brief Parses a real number that has to start on the current line.
+/// @param p The text to parse, moved past the number.
+/// @param value Receives the number.
+/// @return False if the line holds no further number.
+bool MatrixReader::readReal(const char*& p, double& value)
+{
+  while (*p == ' ' || *p == '\t') {
+    ++p;
+  }
+  if (*p == '\n' || *p == '\r' || *p == '\0') {
+    return false; // strtod() would skip the line break
+  }
+
+  // Fast path: a mantissa below 2^53 scaled by an exact power of ten rounds correctly in one step
+  static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char* q = p;
+  bool negative = *q == '-';
+  q += negative || *q == '+';
+  unsigned long long mantissa = 0;
+  int noDigits = 0, exponent = 0;
+  for (; (unsigned)(*q - '0') <= 9; ++q, ++noDigits) {
+    mantissa = mantissa * 10 + (unsigned)(*q - '0');
+  }
+  if (*q == '.') {
+    for (++q; (unsigned)(*q - '0') <= 9; ++q, ++noDigits, --exponent) {
+      mantissa = mantissa * 10 + (unsigned)(*q - '0');
+    }
+  }
+  long long written = 0;
+  if ((*q == 'e' || *q == 'E') && noDigits > 0) {
+    const char* e = q + 1;
+    if ((*e == '-' || *e == '+' || (unsigned)(*e - '0') <= 9) && readLong(e, written) && written > -400 &&
+        written < 400) {
+      q = e;
+      exponent += (int)written;
+    } else {
+      noDigits = 0; // Let strtod() judge the exponent
+    }
+  }
+  if (noDigits > 0 && noDigits <= 15 && exponent >= -22 && exponent <= 22 && mantissa < (1ULL << 53) &&
+      (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n' || *q == '\0')) {
+    value = exponent < 0 ? (double)mantissa / powers[-exponent] : (double)mantissa * powers[exponent];
+    value = negative ? -value : value;
+    p = q;
+    return true;
+  }
+
+  char* end;
+  value = strtod(p, &end);
+  if (end == p) {
+    return false;
+  }
+  p = end;
+  return true;
+}
+
+/// @brief Moves position to the start of the following line.
+/// @return The start of the line position was on.
+const char* MatrixReader::readLine()
+{
+  const char* line = position;
+  const char* end = myData + myLength;
+  const char* newline = (const char*)memchr(line, '\n', end - line);
+  position = newline != nullptr ? newline + 1 : end;
+  return line;
+}
+
+/// @brief Reads the rest of the input as a Matrix Market coordinate file, parsing it in parallel.
+///
+/// After the banner and the size line, the entry lines are split into one chunk per part at line
+/// breaks, so the parts parse independently into their own arrays. The entries are then counted per
+/// row and group of consecutive chunks, which places every group's share of every row without
+/// locking, and scattered into CSR order; each row is finally sorted by column. Integer, real and
+/// pattern fields (pattern entries are 1) and the general, symmetric and skew-symmetric layouts are
+/// read; the stored half of a symmetric matrix is mirrored. An entry given twice keeps its last value
+/// and zeros are not stored, as with setValue(). A file with more or fewer entry lines than its
+/// header gives is rejected. The sort and pack passes visit every row, and there are no more groups
+/// than entries per row, so the work and memory follow the entries plus the rows, never rows times
+/// threads.
+/// @tparam T The value type of the matrix to build.
+/// @tparam I The index type of the matrix to build.
+/// @param noThreads The number of threads to use, 0 or less for one per hardware thread.
+/// @return The matrix, owned by the caller, with a zero common value.
+template <typename T, typename I>
+BasicSparseMatrix<T, I>* MatrixReader::nextMarket(int noThreads)
+{
+  const char* end = myData + myLength;
+
+  // "%%MatrixMarket matrix coordinate <field> <symmetry>", the words after the first in any case
+  const char* banner = readLine();
+  char text[256];
+  size_t textLength = min((size_t)(position - banner), sizeof(text) - 1);
+  copy(banner, banner + textLength, text);
+  text[textLength] = '\0';
+  char words[5][32];
+  int noWords = sscanf(text, "%31s %31s %31s %31s %31s", words[0], words[1], words[2], words[3], words[4]);
+  for (int w = 1; w < noWords; ++w) {
+    for (char* c = words[w]; *c != '\0'; ++c) {
+      *c = (char)tolower((unsigned char)*c);
+    }
+  }
+  if (noWords != 5 || strcmp(words[0], "%%MatrixMarket") != 0 || strcmp(words[1], "matrix") != 0) {
+    throw std::runtime_error("Not a Matrix Market file");
+  }
+  if (strcmp(words[2], "coordinate") != 0) {
+    throw std::runtime_error("Only coordinate Matrix Market files are supported");
+  }
+  bool pattern = strcmp(words[3], "pattern") == 0;
+  bool real = strcmp(words[3], "real") == 0;
+  if (!pattern && !real && strcmp(words[3], "integer") != 0) {
+    throw std::runtime_error("Unsupported Matrix Market field");
+  }
+  bool skew = strcmp(words[4], "skew-symmetric") == 0;
+  bool mirrored = skew || strcmp(words[4], "symmetric") == 0;
+  if (!mirrored && strcmp(words[4], "general") != 0) {
+    throw std::runtime_error("Unsupported Matrix Market symmetry");
+  }
+  if (real && is_integral<T>::value) {
+    throw std::invalid_argument("Real Matrix Market values need a floating point matrix");
+  }
+
+  // Comment lines, then "rows cols entries"
+  long long n, m, noEntries;
+  const char* p;
+  do {
+    p = readLine();
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+      ++p;
+    }
+  } while (p < end && (*p == '%' || *p == '\n'));
+  if (!readLong(p, n) || !readLong(p, m) || !readLong(p, noEntries)) {
+    throw std::runtime_error("Incomplete matrix header");
+  }
+  if (n < 0 || m < 0 || noEntries < 0) {
+    throw std::invalid_argument("Matrix dimensions must not be negative");
+  }
+  if (n > numeric_limits<I>::max() || m > numeric_limits<I>::max()) {
+    throw std::invalid_argument("Matrix dimensions do not fit the index type");
+  }
+
+  // One chunk of whole lines per part
+  const char* body = position;
+  position = end;
+  if (noThreads <= 0) {
+    noThreads = WorkerPool::shared().size();
+  }
+  int noParts = (int)max(1LL, min((long long)noThreads, (long long)(end - body) / (1 << 16) + 1));
+  auto runParts = [&](int count, const function<void(int)>& part) {
+    if (count == 1) {
+      part(0);
+    } else {
+      WorkerPool::shared().run(count, part);
+    }
+  };
+  const char** starts = new const char*[noParts + 1];
+  starts[0] = body;
+  starts[noParts] = end;
+  for (int part = 1; part < noParts; ++part) {
+    const char* at = max(starts[part - 1], body + (end - body) * part / noParts);
+    const char* newline = (const char*)memchr(at, '\n', end - at);
+    starts[part] = newline != nullptr ? newline + 1 : end;
+  }
+
+  // Every part parses its chunk into its own arrays, sized from its number of lines
+  I** rows = new I*[noParts];
+  I** cols = new I*[noParts];
+  T** vals = new T*[noParts];
+  long long* sizes = new long long[noParts];
+  long long* noRead = new long long[noParts];
+  int* failures = new int[noParts];
+  runParts(noParts, [&](int part) {
+    const char* chunk = starts[part];
+    const char* chunkEnd = starts[part + 1];
+    long long noLines = 1;
+    for (const char* c = chunk; (c = (const char*)memchr(c, '\n', chunkEnd - c)) != nullptr; ++c) {
+      ++noLines;
+    }
+    long long capacity = noLines * (mirrored ? 2 : 1);
+    rows[part] = new I[capacity];
+    cols[part] = new I[capacity];
+    vals[part] = new T[capacity];
+    long long size = 0;
+    long long read = 0;
+    int failure = 0;
+    for (const char* line = chunk; line < chunkEnd && failure == 0; ) {
+      const char* q = line;
+      const char* newline = (const char*)memchr(line, '\n', chunkEnd - line);
+      line = newline != nullptr ? newline + 1 : chunkEnd;
+      while (*q == ' ' || *q == '\t' || *q == '\r') {
+        ++q;
+      }
+      if (q >= chunkEnd || *q == '\n' || *q == '%') {
+        continue;
+      }
+      long long r, c, whole = 1;
+      double fraction = 0;
+      if (!readLong(q, r) || !readLong(q, c) || (!pattern && !(real ? readReal(q, fraction) : readLong(q, whole)))) {
+        failure = 1;
+        break;
+      }
+      if (r < 1 || r > n || c < 1 || c > m) {
+        failure = 2;
+        break;
+      }
+      T value = real ? (T)fraction : (T)whole;
+      ++read;
+      rows[part][size] = (I)(r - 1);
+      cols[part][size] = (I)(c - 1);
+      vals[part][size++] = value;
+      if (mirrored && r != c) {
+        rows[part][size] = (I)(c - 1);
+        cols[part][size] = (I)(r - 1);
+        vals[part][size++] = skew ? (T)-value : value;
+      }
+    }
+    sizes[part] = size;
+    noRead[part] = read;
+    failures[part] = failure;
+  });
+  int failure = *max_element(failures, failures + noParts);
+  long long noSized = 0;
+  long long noLinesRead = 0;
+  for (int part = 0; part < noParts; ++part) {
+    noSized += sizes[part];
+    noLinesRead += noRead[part];
+  }
+  if (failure == 0 && noLinesRead != noEntries) {
+    failure = 3;
+  }
+
+  // Count every row per group of consecutive chunks, with no more groups than entries per row; the
+  // running counts give every group its slots in every row, in file order
+  I* offsets = nullptr;
+  I* indices = nullptr;
+  T* values = nullptr;
+  I nnz = 0;
+  if (failure == 0) {
+    I noRows = (I)n;
+    int noGroups = (int)max(1LL, min((long long)noParts, noSized / max(1LL, n) + 1));
+    auto firstPart = [&](int group) { return (int)((long long)noParts * group / noGroups); };
+    I* slots = new I[(size_t)noGroups * noRows + 1];
+    fill(slots, slots + (size_t)noGroups * noRows + 1, (I)0);
+    runParts(noGroups, [&](int group) {
+      I* counts = slots + (size_t)group * noRows;
+      for (int part = firstPart(group); part < firstPart(group + 1); ++part) {
+        for (long long e = 0; e < sizes[part]; ++e) {
+          ++counts[rows[part][e]];
+        }
+      }
+    });
+    I* rowStarts = new I[noRows + 1];
+    I total = 0;
+    for (I i = 0; i < noRows; ++i) {
+      rowStarts[i] = total;
+      for (int group = 0; group < noGroups; ++group) {
+        I count = slots[(size_t)group * noRows + i];
+        slots[(size_t)group * noRows + i] = total;
+        total += count;
+      }
+    }
+    rowStarts[noRows] = total;
+    I* scatteredCols = new I[total];
+    T* scatteredVals = new T[total];
+    runParts(noGroups, [&](int group) {
+      I* next = slots + (size_t)group * noRows;
+      for (int part = firstPart(group); part < firstPart(group + 1); ++part) {
+        for (long long e = 0; e < sizes[part]; ++e) {
+          I slot = next[rows[part][e]]++;
+          scatteredCols[slot] = cols[part][e];
+          scatteredVals[slot] = vals[part][e];
+        }
+      }
+    });
+    delete[] slots;
+
+    // Sort every row by column, the last of equal columns and no zeros kept, then pack the rows
+    I* lengths = new I[noRows + 1];
+    runParts(noParts, [&](int part) {
+      pair<I, T>* sorted = nullptr;
+      I room = 0;
+      for (I i = (I)((long long)noRows * part / noParts); i < (I)((long long)noRows * (part + 1) / noParts); ++i) {
+        I start = rowStarts[i];
+        I length = rowStarts[i + 1] - start;
+        if (length > room) {
+          delete[] sorted;
+          room = max(length, 2 * room);
+          sorted = new pair<I, T>[room];
+        }
+        for (I k = 0; k < length; ++k) {
+          sorted[k] = make_pair(scatteredCols[start + k], scatteredVals[start + k]);
+        }
+        stable_sort(sorted, sorted + length, [](const pair<I, T>& a, const pair<I, T>& b) { return a.first < b.first; });
+        I kept = 0;
+        for (I k = 0; k < length; ++k) {
+          if ((k + 1 == length || sorted[k + 1].first != sorted[k].first) && sorted[k].second != 0) {
+            scatteredCols[start + kept] = sorted[k].first;
+            scatteredVals[start + kept] = sorted[k].second;
+            ++kept;
+          }
+        }
+        lengths[i + 1] = kept;
+      }
+      delete[] sorted;
+    });
+    offsets = lengths;
+    offsets[0] = 0;
+    for (I i = 0; i < noRows; ++i) {
+      offsets[i + 1] += offsets[i];
+    }
+    nnz = offsets[noRows];
+    indices = new I[nnz];
+    values = new T[nnz];
+    runParts(noParts, [&](int part) {
+      for (I i = (I)((long long)noRows * part / noParts); i < (I)((long long)noRows * (part + 1) / noParts); ++i) {
+        copy(scatteredCols + rowStarts[i], scatteredCols + rowStarts[i] + offsets[i + 1] - offsets[i], indices + offsets[i]);
+        copy(scatteredVals + rowStarts[i], scatteredVals + rowStarts[i] + offsets[i + 1] - offsets[i], values + offsets[i]);
+      }
+    });
+    delete[] rowStarts;
+    delete[] scatteredCols;
+    delete[] scatteredVals;
+  }
+
+  for (int part = 0; part < noParts; ++part) {
+    delete[] rows[part];
+    delete[] cols[part];
+    delete[] vals[part];
+  }
+  delete[] rows;
+  delete[] cols;
+  delete[] vals;
+  delete[] sizes;
+  delete[] noRead;
+  delete[] failures;
+  delete[] starts;
+  if (failure == 1) {
+    throw std::runtime_error("Malformed Matrix Market entry");
+  }
+  if (failure == 3) {
+    throw std::runtime_error("Matrix Market entry count does not match the header");
+  }
+  if (failure == 2) {
+    throw std::out_of_range("Matrix index out of range");
+  }
+  return new BasicSparseMatrix<T, I>((I)n, (I)m, 0, nnz, offsets, indices, values, true);
+}
+
+template BasicSparseMatrix<int, int>* MatrixReader::nextMarket<int, int>(int);
+template BasicSparseMatrix<long long, int>* MatrixReader::nextMarket<long long, int>(int);
+template BasicSparseMatrix<float, int>* MatrixReader::nextMarket<float, int>(int);
+template BasicSparseMatrix<double, int>* MatrixReader::nextMarket<double, int>(int);
+template BasicSparseMatrix<double, long long>* MatrixReader::nextMarket<double, long long>(int);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//             Testing with provided main()
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// @brief Print a label followed by the entries of a vector on one line, reals rounded to four decimals.
+/// @param label the text in front of the entries.
+/// @param v the entries.
+/// @param n the number of entries.
+template <typename T>
+void printVector(const char* label, const T* v, long long n)
+{
+  cout << label;
+  for (long long i = 0; i < n; i++) {
+    if (is_floating_point<T>::value) {
+      // Rounding to four decimals keeps the output stable, and clamping keeps -0.0000 out of it
+      char text[32];
+      double value = fabs((double)v[i]) < 5e-5 ? 0.0 : (double)v[i];
+      snprintf(text, sizeof(text), " %.4f", value);
+      cout << text;
+    } else {
+      cout << " " << v[i];
+    }
+  }
+  cout << endl;
+}
+
+/// @brief Rebuild first through a plain and a hashed builder, setting every entry twice in reverse order.
+/// @param first the matrix to rebuild.
+void checkBuild(const SparseMatrix& first)
+{
+  int n = first.getNoRows(), m = first.getNoCols();
+  for (int hashed = 0; hashed < 2; hashed++) {
+    SparseMatrixBuilder builder(n, m, first.getCommonValue(), 1, hashed != 0);
+    for (int i = n - 1; i >= 0; i--) {
+      for (int j = m - 1; j >= 0; j--) {
+        if (first.getValue(i, j) != first.getCommonValue()) {
+          builder.setValue(i, j, first.getValue(i, j) + 1);
+          builder.setValue(i, j, first.getValue(i, j));
+        }
+      }
+    }
+    SparseMatrix* built = builder.freeze();
+    cout << (hashed ? "Hashed builder result" : "Builder result") << endl;
+    cout << (*built);
+    delete built;
+  }
+}
+
+/// @brief Multiply the transpose view of first with second, and print the view compressed by rows.
+/// @param first the matrix to transpose.
+/// @param second the right operand.
+void checkTranspose(const SparseMatrix& first, const SparseMatrix& second)
+{
+  SparseMatrix* view = first.Transpose();
+  SparseMatrix* rows = view->Recompress(true);
+  cout << "Transpose compressed by rows" << endl;
+  cout << (*rows);
+  delete rows;
+  try {
+    cout << "Transpose times second" << endl;
+    SparseMatrix* product = view->Multiply(second);
+    product->displayMatrix();
+    delete product;
+  } catch (const std::invalid_argument& e) {
+    cout << "Matrix multiplication is not possible" << endl;
+  }
+  delete view;
+}
+
+/// @brief Multiply first and its transpose view with x = (1, 2, ..., m) through every SpMV path.
+/// @param first the matrix to multiply.
+void checkSpMV(const SparseMatrix& first)
+{
+  int n = first.getNoRows(), m = first.getNoCols();
+  int* x = new int[max(n, m)];
+  int* y = new int[max(n, m)];
+  for (int j = 0; j < max(n, m); j++) {
+    x[j] = j + 1;
+  }
+  first.MultiplyVector(x, y, 1);
+  printVector("Product with one thread:", y, n);
+  first.MultiplyVector(x, y, 0);
+  printVector("Product with every thread:", y, n);
+  SparseMatrix* columns = first.Recompress(false);
+  columns->MultiplyVector(x, y);
+  printVector("Product by columns:", y, n);
+  SparseVectorPlan plan(*columns, 0);
+  plan.Multiply(x, y);
+  printVector("Product through a plan:", y, n);
+  delete columns;
+  SparseMatrix* view = first.Transpose();
+  view->MultiplyVector(x, y);
+  printVector("Transpose product:", y, m);
+  delete view;
+  delete[] x;
+  delete[] y;
+}
+
+/// @brief Solve S*x = b with S = A^T*A + I for A the first matrix, and b chosen so that x = (1, 2, ..., m).
+/// @param first the matrix A.
+void checkSolve(const SparseMatrix& first)
+{
+  int m = first.getNoCols();
+  BasicSparseMatrix<double, int>* A = first.Convert<double, int>();
+  BasicSparseMatrix<double, int>* AT = A->Transpose();
+  BasicSparseMatrix<double, int>* normal = AT->Multiply(*A);
+  BasicSparseMatrix<double, int> identity(m, m, 0, m);
+  for (int j = 0; j < m; j++) {
+    identity.setValue(j, j, 1);
+  }
+  BasicSparseMatrix<double, int>* S = normal->Add(identity);
+  BasicSparseMatrix<double, int>* SC = S->Recompress(false);
+  double* b = new double[m];
+  double* x = new double[m];
+  for (int j = 0; j < m; j++) {
+    x[j] = j + 1;
+  }
+  S->MultiplyVector(x, b);
+  const char* names[] = { "CG by rows:", "BiCGSTAB by rows:", "CG by columns:", "BiCGSTAB by columns:" };
+  for (int run = 0; run < 4; run++) {
+    SparseSolver solver(run < 2 ? *S : *SC, run % 2 ? SparseSolver::BICGSTAB : SparseSolver::CG, 0);
+    solver.setTolerance(1e-12);
+    fill(x, x + m, 0.0);
+    bool converged = solver.Solve(b, x);
+    cout << names[run] << (converged ? " converged" : " did not converge") << endl;
+    printVector("Solution:", x, m);
+  }
+  delete[] b;
+  delete[] x;
+  delete SC;
+  delete S;
+  delete normal;
+  delete AT;
+  delete A;
+}
+
+/// @brief Run BFS from vertex 0 and PageRank on the graph with adjacency matrix first.
+/// @param first the adjacency matrix.
+void checkGraph(const SparseMatrix& first)
+{
+  try {
+    SparseGraph graph(first, 0);
+    int n = graph.getNoVertices();
+    int* levels = new int[n];
+    int reached = graph.BFS(0, levels);
+    cout << "BFS reached " << reached << " vertices" << endl;
+    printVector("Levels:", levels, n);
+    double* rank = new double[n];
+    graph.PageRank(rank, 0.85, 1e-12, 1000);
+    printVector("PageRank:", rank, n);
+    delete[] rank;
+    delete[] levels;
+  } catch (const std::invalid_argument& e) {
+    cout << "Graph is not possible" << endl;
+  }
+}
+
+/// @brief Round trip both matrices through 2x2 blocks, and multiply them with x and with each other.
+/// @param first the left matrix.
+/// @param second the right matrix.
+void checkBlocks(const SparseMatrix& first, const SparseMatrix& second)
+{
+  BlockSparseMatrix left(first, 2), right(second, 2);
+  SparseMatrix* back = left.toSparse();
+  cout << "Block form of the first one" << endl;
+  back->displayMatrix();
+  delete back;
+  int n = first.getNoRows(), m = first.getNoCols();
+  int* x = new int[m];
+  int* y = new int[n];
+  for (int j = 0; j < m; j++) {
+    x[j] = j + 1;
+  }
+  left.MultiplyVector(x, y);
+  printVector("Block product:", y, n);
+  delete[] x;
+  delete[] y;
+  try {
+    cout << "Block multiplication result" << endl;
+    BlockSparseMatrix* product = left.Multiply(right);
+    back = product->toSparse();
+    back->displayMatrix();
+    delete back;
+    delete product;
+  } catch (const std::invalid_argument& e) {
+    cout << "Matrix multiplication is not possible" << endl;
+  }
+}
+
+/// @brief Add and multiply the first matrix stored densely with the second stored sparsely.
+/// @param first the left matrix.
+/// @param second the right matrix.
+void checkHybrid(const SparseMatrix& first, const SparseMatrix& second)
+{
+  HybridSparseMatrix left(first, 0), right(second, 2);
+  cout << "Hybrid first one with " << left.getNoDenseBlocks() << " dense blocks" << endl;
+  left.displayMatrix();
+  cout << "Hybrid second one with " << right.getNoDenseBlocks() << " dense blocks" << endl;
+  cout << right;
+  try {
+    cout << "Hybrid addition result" << endl;
+    HybridSparseMatrix* sum = left.Add(right);
+    sum->displayMatrix();
+    delete sum;
+  } catch (const std::invalid_argument& e) {
+    cout << "Matrix addition is not possible" << endl;
+  }
+  try {
+    cout << "Hybrid multiplication result" << endl;
+    HybridSparseMatrix* product = left.Multiply(right);
+    product->displayMatrix();
+    delete product;
+  } catch (const std::invalid_argument& e) {
+    cout << "Matrix multiplication is not possible" << endl;
+  }
+}
+
+/// @brief Round trip the first matrix through the packed form and multiply it with x.
+/// @param first the matrix to pack.
+void checkPacked(const SparseMatrix& first)
+{
+  int n = first.getNoRows(), m = first.getNoCols();
+  PackedSparseMatrix packed(first);
+  SparseMatrix* back = packed.toSparse();
+  cout << "Packed form of the first one" << endl;
+  back->displayMatrix();
+  delete back;
+  int mismatches = 0;
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < m; j++) {
+      mismatches += packed.getValue(i, j) != first.getValue(i, j);
+    }
+  }
+  cout << "Packed values that differ: " << mismatches << endl;
+  int* x = new int[m];
+  int* y = new int[n];
+  for (int j = 0; j < m; j++) {
+    x[j] = j + 1;
+  }
+  packed.MultiplyVector(x, y);
+  printVector("Packed product:", y, n);
+  delete[] x;
+  delete[] y;
+}
+
+/// @brief Number of entries of row i of a gap matrix: row 5 of a block is empty, row 6 holds a single
+/// entry and the others 9 to 17, so the eight-wide decoders run as well as their scalar tails.
+/// @param i the row.
+/// @return the number of entries.
+int gapRowLength(int i)
+{
+  return i % 64 == 5 ? 0 : i % 64 == 6 ? 1 : 9 + i % 9;
+}
+
+/// @brief Column of entry k of row i of a gap matrix, given the column of entry k-1. Every eighth row
+/// of a block carries a gap of exactly 2^width at a different position, the other gaps are smaller.
+/// @param i the row.
+/// @param k the entry of the row, above 0.
+/// @param width the bit width of the largest gap minus one in the block of the row.
+/// @param column the column of entry k-1.
+/// @return the column of entry k.
+long long nextGapColumn(int i, int k, int width, long long column)
+{
+  if (i % 64 % 8 == 0 && k - 1 == i % 64 / 8) {
+    return column + (1LL << width);
+  }
+  int spread = width < 5 ? 1 << width : 1 << (width - 5);
+  return column + 1 + ((long long)i * 7919 + (long long)k * 104729) % spread;
+}
+
+/// @brief Build a matrix of 64 row blocks whose largest column gap has a given bit width in every block.
+/// @param widths the bit width of the largest gap minus one in every block.
+/// @param noWidths the number of blocks.
+/// @param m the number of columns, above the longest row span.
+/// @return the CSR matrix, owned by the caller.
+SparseMatrix* makeGapMatrix(const int* widths, int noWidths, int m)
+{
+  int n = noWidths * 64;
+  int* offsets = new int[n + 1];
+  int* indices = new int[n * 17];
+  int* values = new int[n * 17];
+  int nnz = 0;
+  for (int i = 0; i < n; i++) {
+    offsets[i] = nnz;
+    long long column = i % 5;
+    for (int k = 0; k < gapRowLength(i); k++) {
+      column = k == 0 ? column : nextGapColumn(i, k, widths[i / 64], column);
+      indices[nnz] = (int)column;
+      values[nnz] = (i * 31 + k) % 97 + 1;
+      nnz++;
+    }
+  }
+  offsets[n] = nnz;
+  return new SparseMatrix(n, m, 0, nnz, offsets, indices, values, true);
+}
+
+/// @brief Pack matrices whose column gaps span bit widths on both sides of the 25 bit limit of the
+/// eight-wide decoder, and compare unpacking, lookups and SpMV against the CSR source.
+void checkPackedWide()
+{
+  int widths[] = { 0, 3, 8, 24, 25, 26, 30 };
+  SparseMatrix* source = makeGapMatrix(widths, 7, numeric_limits<int>::max());
+  PackedSparseMatrix packed(*source);
+  SparseMatrix* back = packed.toSparse();
+  printVector("Packed gap widths:", widths, 7);
+  int entries = 0, lookups = 0;
+  for (int i = 0; i < source->getNoRows(); i++) {
+    long long column = i % 5;
+    for (int k = 0; k < gapRowLength(i); k++) {
+      column = k == 0 ? column : nextGapColumn(i, k, widths[i / 64], column);
+      int expected = (i * 31 + k) % 97 + 1;
+      entries += back->getValue(i, (int)column) != expected;
+      lookups += packed.getValue(i, (int)column) != expected;
+      lookups += packed.getValue(i, (int)column + 1) != source->getValue(i, (int)column + 1);
+    }
+    lookups += packed.getValue(i, 5) != source->getValue(i, 5);
+  }
+  entries += back->getNoNonSparseValues() != source->getNoNonSparseValues();
+  cout << "Entries that differ after unpacking: " << entries << endl;
+  cout << "Lookups that differ: " << lookups << endl;
+  delete back;
+  delete source;
+
+  // SpMV needs x as long as a row, so it runs on gaps of up to 17 bits, packed from CSR and from CSC
+  int narrow[] = { 0, 3, 8, 12, 17 };
+  int m = 1 << 19;
+  source = makeGapMatrix(narrow, 5, m);
+  SparseMatrix* columns = source->Recompress(false);
+  int n = source->getNoRows();
+  int* x = new int[m];
+  int* expected = new int[n];
+  int* y = new int[n];
+  for (int j = 0; j < m; j++) {
+    x[j] = j % 7 - 3;
+  }
+  source->MultiplyVector(x, expected);
+  int products = 0;
+  for (int from = 0; from < 2; from++) {
+    PackedSparseMatrix narrowPacked(from ? *columns : *source);
+    for (int noThreads = 0; noThreads < 2; noThreads++) {
+      narrowPacked.MultiplyVector(x, y, noThreads);
+      for (int i = 0; i < n; i++) {
+        products += y[i] != expected[i];
       }
     }
   }
+  long long checksum = 0;
+  for (int i = 0; i < n; i++) {
+    checksum += (long long)(i + 1) * expected[i];
+  }
+  cout << "Products that differ: " << products << endl;
+  cout << "Product checksum: " << checksum << endl;
+  delete[] x;
+  delete[] expected;
+  delete[] y;
+  delete columns;
+  delete source;
+}
+
+/// @brief Keep one triangle of first + first^T and multiply it with second and with x.
+/// @param first the matrix to symmetrize.
+/// @param second the right operand.
+void checkSymmetric(const SparseMatrix& first, const SparseMatrix& second)
+{
+  try {
+    SparseMatrix* view = first.Transpose();
+    SparseMatrix* sum = first.Add(*view);
+    delete view;
+    TriangleSparseMatrix triangle(*sum, TriangleSparseMatrix::SYMMETRIC);
+    delete sum;
+    cout << "Symmetric triangle with " << triangle.getNoNonSparseValues() << " entries" << endl;
+    int n = triangle.getNoRows();
+    int* x = new int[n];
+    int* y = new int[n];
+    for (int j = 0; j < n; j++) {
+      x[j] = j + 1;
+    }
+    triangle.MultiplyVector(x, y);
+    printVector("Symmetric product:", y, n);
+    delete[] x;
+    delete[] y;
+    cout << "Symmetric multiplication result" << endl;
+    SparseMatrix* product = triangle.Multiply(second);
+    product->displayMatrix();
+    delete product;
+  } catch (const std::invalid_argument& e) {
+    cout << "Symmetric multiplication is not possible" << endl;
+  }
+}
+
+/// @brief Open an anonymous temporary file holding the given text.
+/// @param text the contents of the file.
+/// @param length the number of bytes of text.
+/// @return the file descriptor, positioned at the start, to be closed by the caller.
+int textFile(const char* text, size_t length)
+{
+  char path[] = "/tmp/project1XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    throw std::runtime_error("Could not create a temporary file");
+  }
+  unlink(path);
+  if (write(fd, text, length) != (ssize_t)length || lseek(fd, 0, SEEK_SET) != 0) {
+    close(fd);
+    throw std::runtime_error("Could not write a temporary file");
+  }
+  return fd;
+}
+
+/// @brief Read a Matrix Market text and display the matrix, or the error the reader gives for it.
+/// @param text the Matrix Market file.
+/// @param length the number of bytes of text.
+void readMarketText(const char* text, size_t length)
+{
+  int fd = textFile(text, length);
+  try {
+    MatrixReader reader(fd);
+    SparseMatrix* read = reader.nextMarket<int, int>(0);
+    read->displayMatrix();
+    delete read;
+  } catch (const std::runtime_error& e) {
+    cout << "Reading failed: " << e.what() << endl;
+  }
+  close(fd);
+}
+
+/// @brief Write first as a Matrix Market file with one and with every thread, then read it back, read it
+/// without its last entry line, and read a symmetric file that has to be mirrored.
+/// @param first the matrix to write.
+void checkMarket(const SparseMatrix& first)
+{
+  char* texts[2];
+  off_t lengths[2];
+  for (int run = 0; run < 2; run++) {
+    int fd = textFile("", 0);
+    first.writeMarket(fd, run == 0 ? 1 : 0);
+    lengths[run] = lseek(fd, 0, SEEK_END);
+    texts[run] = new char[lengths[run]];
+    if (pread(fd, texts[run], lengths[run], 0) != lengths[run]) {
+      lengths[run] = 0;
+    }
+    close(fd);
+  }
+  cout << "Matrix Market file" << endl;
+  cout.write(texts[0], lengths[0]);
+  bool same = lengths[0] == lengths[1] && memcmp(texts[0], texts[1], lengths[0]) == 0;
+  cout << "Parallel writer output " << (same ? "matches" : "differs") << endl;
+  cout << "Read back" << endl;
+  readMarketText(texts[0], lengths[0]);
+  cout << "Read without the last entry" << endl;
+  off_t last = lengths[0] - 1;
+  while (last > 0 && texts[0][last - 1] != '\n') {
+    last--;
+  }
+  readMarketText(texts[0], last);
+  delete[] texts[0];
+  delete[] texts[1];
+  cout << "Read a symmetric file" << endl;
+  const char* symmetric = "%%MatrixMarket matrix coordinate integer symmetric\n% lower triangle\n"
+                          "3 3 4\n1 1 5\n3 1 2\n2 2 -1\n3 2 7\n";
+  readMarketText(symmetric, strlen(symmetric));
+}
+
+/// @brief Run the check named on the input after the two matrices.
+/// @param name the name of the check.
+/// @param first the first matrix of the input.
+/// @param second the second matrix of the input.
+void runCheck(const char* name, const SparseMatrix& first, const SparseMatrix& second)
+{
+  cout << "Check " << name << endl;
+  if (strcmp(name, "build") == 0) {
+    checkBuild(first);
+  } else if (strcmp(name, "transpose") == 0) {
+    checkTranspose(first, second);
+  } else if (strcmp(name, "spmv") == 0) {
+    checkSpMV(first);
+  } else if (strcmp(name, "solve") == 0) {
+    checkSolve(first);
+  } else if (strcmp(name, "graph") == 0) {
+    checkGraph(first);
+  } else if (strcmp(name, "bsr") == 0) {
+    checkBlocks(first, second);
+  } else if (strcmp(name, "hybrid") == 0) {
+    checkHybrid(first, second);
+  } else if (strcmp(name, "packed") == 0) {
+    checkPacked(first);
+  } else if (strcmp(name, "symmetric") == 0) {
+    checkSymmetric(first, second);
+  } else if (strcmp(name, "packedwide") == 0) {
+    checkPackedWide();
+  } else if (strcmp(name, "market") == 0) {
+    checkMarket(first);
+  } else {
+    cout << "Unknown check" << endl;
+  }
+}
+
+/// @brief Test
+/// @return 0 for success, >0 for failure.
+
+int main ()
+{
+ SparseMatrix* temp; 
+ 
+ // Input redirection makes stdin the input file, which the reader maps instead of streaming
+ MatrixReader reader(0); 
+ SparseMatrix* firstOne = reader.next(); 
+ SparseMatrix* secondOne = reader.next(); 
+ if (firstOne == nullptr || secondOne == nullptr) {
+   cerr << "Expected two matrices on the input" << endl;
+   return 1;
+ }
  
   cout << "First one in sparse matrix format" << endl; 
   cout << (*firstOne); 
  
   cout << "After transpose" << endl; 
-  cout << (*(*firstOne).Transpose()); 
+  temp = firstOne->Transpose(); 
+  cout << (*temp); 
+  delete temp; 
 
   cout << "First one in matrix format" << endl; 
   (*firstOne).displayMatrix(); 
@@ -347,7 +8631,9 @@ int main ()
   cout << (*secondOne); 
 
   cout << "After transpose" << endl; 
-  cout << (*(*secondOne).Transpose()); 
+  temp = secondOne->Transpose(); 
+  cout << (*temp); 
+  delete temp; 
 
   cout << "Second one in matrix format" << endl; 
   (*secondOne).displayMatrix(); 
@@ -372,6 +8658,14 @@ int main ()
     cout << "Matrix multiplication is not possible" << endl;
   }
 
+  // Any words after the two matrices name further checks to run on them
+  char check[32];
+  while (reader.nextWord(check, sizeof(check))) {
+    runCheck(check, *firstOne, *secondOne);
+  }
+
+  delete firstOne;
+  delete secondOne;
   return 0; 
 }
 